@@ -0,0 +1,409 @@
+/* load.c: HTTP Load Generator
+ *
+ * Keeps CONNECTIONS clients (one process each) sending requests for the
+ * given URLs in turn for SECONDS, and reports throughput and latency
+ * percentiles.  Used by bin/bench_load.sh and to train PGO builds:
+ *
+ *  make bench-load
+ *  build/bench/load [-c CONNECTIONS -d SECONDS -C] http://localhost:9898/ ...
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_URLS            64
+#define LATENCY_BUCKETS     512         /* Log-linear, 16 per power of two (µs) */
+
+typedef struct {
+    char   *host;                       /*< Host name */
+    char   *port;                       /*< Port number */
+    char   *request;                    /*< Formatted request */
+    size_t  length;                     /*< Length of request */
+} Target;
+
+typedef struct {
+    uint64_t requests;                  /*< Responses received */
+    uint64_t errors;                    /*< Failed connections or responses */
+    uint64_t unsuccessful;              /*< Responses with status >= 400 */
+    uint64_t bytes;                     /*< Response bytes received */
+    uint64_t latency[LATENCY_BUCKETS];  /*< Response time histogram */
+} Stats;
+
+typedef struct {
+    int    fd;                          /*< Connection (or -1) */
+    size_t start;                       /*< Offset of unread data */
+    size_t end;                         /*< Offset past buffered data */
+    char   data[1 << 16];               /*< Received data */
+} Connection;
+
+static Target Targets[MAX_URLS];
+static size_t TargetsCount = 0;
+static int    Connections  = 4;
+static int    Seconds      = 10;
+static bool   Close        = false;
+
+/* Functions */
+
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [-c CONNECTIONS -d SECONDS -C] URL...\n", progname);
+    fprintf(stderr, "    -c CONNECTIONS  Concurrent clients (%d)\n", Connections);
+    fprintf(stderr, "    -d SECONDS      Duration of run (%d)\n", Seconds);
+    fprintf(stderr, "    -C              Close connection after each request\n");
+    exit(status);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Map latency to histogram bucket (about 6% wide).
+ **/
+static int latency_bucket(uint64_t us) {
+    if (us < 16)
+        return us;
+    int e = 63 - __builtin_clzll(us);
+    int b = 16 + (e - 4) * 16 + (int)((us >> (e - 4)) & 15);
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+/**
+ * Map histogram bucket back to the lowest latency it holds.
+ **/
+static uint64_t bucket_latency(int b) {
+    if (b < 16)
+        return b;
+    int e = (b - 16) / 16 + 4;
+    return (16ULL + (b - 16) % 16) << (e - 4);
+}
+
+/**
+ * Parse http://HOST[:PORT]/PATH into target.
+ **/
+static int parse_url(const char *url, Target *t) {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV] = "80";
+
+    if (strncmp(url, "http://", 7) != 0)
+        return -1;
+    url += 7;
+
+    const char *path = url + strcspn(url, "/");
+    const char *colon = memchr(url, ':', path - url);
+    const char *end  = colon ? colon : path;
+    if (end == url || (size_t)(end - url) >= sizeof(host))
+        return -1;
+    memcpy(host, url, end - url);
+    host[end - url] = '\0';
+    if (colon) {
+        if ((size_t)(path - colon - 1) >= sizeof(port) || path == colon + 1)
+            return -1;
+        memcpy(port, colon + 1, path - colon - 1);
+        port[path - colon - 1] = '\0';
+    }
+
+    t->host = strdup(host);
+    t->port = strdup(port);
+    if (asprintf(&t->request, "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: spidey-load\r\n%s\r\n",
+                 *path ? path : "/", host, Close ? "Connection: close\r\n" : "") < 0)
+        return -1;
+    t->length = strlen(t->request);
+    return 0;
+}
+
+static int connect_to(const Target *t) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *results;
+    int fd = -1;
+
+    if (getaddrinfo(t->host, t->port, &hints, &results) != 0)
+        return -1;
+    for (struct addrinfo *p = results; p && fd < 0; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd >= 0 && connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+
+    int on = 1;
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+/**
+ * Read more data into connection buffer (compacting it first).
+ *
+ * @return  Number of bytes read (0 on EOF, -1 on error).
+ **/
+static ssize_t fill(Connection *c, Stats *stats) {
+    if (c->start == c->end)
+        c->start = c->end = 0;
+    else if (c->start > 0 && c->end == sizeof(c->data)) {
+        memmove(c->data, c->data + c->start, c->end - c->start);
+        c->end  -= c->start;
+        c->start = 0;
+    }
+    if (c->end == sizeof(c->data))
+        return -1;
+
+    ssize_t n;
+    while ((n = read(c->fd, c->data + c->end, sizeof(c->data) - c->end)) < 0 && errno == EINTR);
+    if (n > 0) {
+        c->end       += n;
+        stats->bytes += n;
+    }
+    return n;
+}
+
+/**
+ * Return next line (without CRLF) from connection, or NULL on EOF or error.
+ **/
+static char *read_line(Connection *c, Stats *stats) {
+    while (true) {
+        char *newline = memchr(c->data + c->start, '\n', c->end - c->start);
+        if (newline) {
+            char *line = c->data + c->start;
+            c->start   = newline - c->data + 1;
+            *newline   = '\0';
+            if (newline > line && newline[-1] == '\r')
+                newline[-1] = '\0';
+            return line;
+        }
+        if (fill(c, stats) <= 0)
+            return NULL;
+    }
+}
+
+/**
+ * Discard length bytes of body (or everything until EOF if length < 0).
+ **/
+static int skip_body(Connection *c, Stats *stats, long long length) {
+    while (length != 0) {
+        size_t available = c->end - c->start;
+        if (length > 0 && (long long)available >= length) {
+            c->start += length;
+            return 0;
+        }
+        if (length > 0)
+            length -= available;
+        c->start = c->end;
+
+        ssize_t n = fill(c, stats);
+        if (n == 0 && length < 0)
+            return 0;
+        if (n <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read one response from connection.
+ *
+ * @return  HTTP status (or -1 on error); *reusable is set if the connection
+ *          may carry another request.
+ **/
+static int read_response(Connection *c, Stats *stats, bool *reusable) {
+    char *line = read_line(c, stats);
+    int status;
+
+    if (!line || sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+        return -1;
+
+    long long length = -1;
+    bool chunked = false;
+    *reusable = strncmp(line, "HTTP/1.1", 8) == 0;
+
+    while ((line = read_line(c, stats)) && *line) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            length = atoll(line + 15);
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            chunked = strcasestr(line + 18, "chunked") != NULL;
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+            *reusable = strcasestr(line + 11, "close") == NULL;
+    }
+    if (!line)
+        return -1;
+
+    if (status == 204 || status == 304 || (status >= 100 && status < 200))
+        return status;
+
+    if (chunked) {
+        while (true) {
+            if (!(line = read_line(c, stats)))
+                return -1;
+            long long size = strtoll(line, NULL, 16);
+            if (size == 0)
+                break;
+            if (skip_body(c, stats, size + 2) < 0)
+                return -1;
+        }
+        while ((line = read_line(c, stats)) && *line);
+        return line ? status : -1;
+    }
+
+    if (length < 0) {
+        *reusable = false;
+        return skip_body(c, stats, -1) < 0 ? -1 : status;
+    }
+    return skip_body(c, stats, length) < 0 ? -1 : status;
+}
+
+/**
+ * Send requests until the deadline, recording results in stats.
+ **/
+static void client(int id, Stats *stats, uint64_t deadline) {
+    Connection *c = calloc(1, sizeof(Connection));
+    size_t next   = id % TargetsCount;
+
+    if (!c)
+        exit(EXIT_FAILURE);
+    c->fd = -1;
+
+    while (now_us() < deadline) {
+        const Target *t = &Targets[next];
+        next = (next + 1) % TargetsCount;
+
+        uint64_t start = now_us();
+        if (c->fd < 0 && (c->fd = connect_to(t)) < 0) {
+            stats->errors++;
+            usleep(1000);
+            continue;
+        }
+
+        bool reusable = false;
+        int  status   = -1;
+        if (send(c->fd, t->request, t->length, MSG_NOSIGNAL) == (ssize_t)t->length)
+            status = read_response(c, stats, &reusable);
+
+        if (status < 0) {
+            stats->errors++;
+        } else {
+            stats->requests++;
+            stats->unsuccessful += status >= 400;
+            stats->latency[latency_bucket(now_us() - start)]++;
+        }
+
+        if (status < 0 || !reusable) {
+            close(c->fd);
+            c->fd    = -1;
+            c->start = c->end = 0;
+        }
+    }
+
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c);
+}
+
+/**
+ * Return latency at fraction of histogram.
+ **/
+static uint64_t percentile(const Stats *total, double fraction) {
+    uint64_t target = total->requests * fraction;
+    uint64_t seen   = 0;
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += total->latency[b];
+        if (seen > target)
+            return bucket_latency(b);
+    }
+    return bucket_latency(LATENCY_BUCKETS - 1);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    int argind = 1;
+
+    while (argind < argc && argv[argind][0] == '-') {
+        const char *flag = argv[argind++];
+        if (strcmp(flag, "-c") == 0 && argind < argc)
+            Connections = atoi(argv[argind++]);
+        else if (strcmp(flag, "-d") == 0 && argind < argc)
+            Seconds = atoi(argv[argind++]);
+        else if (strcmp(flag, "-C") == 0)
+            Close = true;
+        else
+            usage(argv[0], strcmp(flag, "-h") == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    if (argind == argc || Connections < 1 || Seconds < 1)
+        usage(argv[0], EXIT_FAILURE);
+    for (; argind < argc && TargetsCount < MAX_URLS; argind++) {
+        if (parse_url(argv[argind], &Targets[TargetsCount++]) < 0) {
+            fprintf(stderr, "Invalid URL: %s\n", argv[argind]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Clients report into memory shared with this process */
+    Stats *stats = mmap(NULL, Connections * sizeof(Stats), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        fprintf(stderr, "Error with mmap: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start    = now_us();
+    uint64_t deadline = start + Seconds * 1000000ULL;
+    for (int i = 0; i < Connections; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Error with fork: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (pid == 0) {
+            client(i, &stats[i], deadline);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR);
+    double elapsed = (now_us() - start) / 1e6;
+
+    Stats total = {0};
+    uint64_t max = 0;
+    for (int i = 0; i < Connections; i++) {
+        total.requests     += stats[i].requests;
+        total.errors       += stats[i].errors;
+        total.unsuccessful += stats[i].unsuccessful;
+        total.bytes        += stats[i].bytes;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            total.latency[b] += stats[i].latency[b];
+            if (stats[i].latency[b] && bucket_latency(b) > max)
+                max = bucket_latency(b);
+        }
+    }
+
+    printf("Requests     %llu in %.2f s (%llu errors, %llu with status >= 400)\n",
+           (unsigned long long)total.requests, elapsed,
+           (unsigned long long)total.errors, (unsigned long long)total.unsuccessful);
+    printf("Throughput   %.1f requests/s %.1f MB/s\n", total.requests / elapsed, total.bytes / elapsed / 1e6);
+    printf("Latency      p50 %llu us p90 %llu us p99 %llu us max %llu us\n",
+           (unsigned long long)percentile(&total, 0.50), (unsigned long long)percentile(&total, 0.90),
+           (unsigned long long)percentile(&total, 0.99), (unsigned long long)max);
+    return total.errors > 0 && total.requests == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,72 @@
+/* mime.c: Mimetype Lookup Micro-benchmark
+ *
+ * Times determine_mimetype on a mix of common, rare, unknown, and missing
+ * extensions, scanning the mime.types file and then with the shared cache:
+ *
+ *  make bench-mime
+ *  build/bench/mime [iterations] 2> /dev/null
+ */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <time.h>
+
+static const char *Paths[] = {
+    "www/html/index.html",
+    "www/html/main.css",
+    "www/text/hackers.txt",
+    "www/images/logo.png",
+    "www/images/photo.jpg",
+    "www/scripts/app.js",
+    "www/data/report.pdf",
+    "www/notes.md",
+    "www/archive.unknown",
+    "www/README",
+};
+
+#define PATHS_COUNT (sizeof(Paths) / sizeof(Paths[0]))
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations  = argc > 1 ? atol(argv[1]) : 10000;
+    char *options[]  = {argv[0], NULL};
+    volatile size_t sink = 0;
+    char buffer[BUFSIZ];
+
+    if (!(Settings = config_load(1, options)))
+        return EXIT_FAILURE;
+    scan_init();
+
+    for (size_t p = 0; p < PATHS_COUNT; p++) {
+        const char *mimetype = determine_mimetype(&Settings->hosts[0], Paths[p], buffer, sizeof(buffer));
+        printf("%-24s %s\n", Paths[p], mimetype);
+    }
+
+    for (int cached = 0; cached < 2; cached++) {
+        if (cached && cache_init() < 0)
+            return EXIT_FAILURE;
+
+        double start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            for (size_t p = 0; p < PATHS_COUNT; p++) {
+                const char *mimetype = determine_mimetype(&Settings->hosts[0], Paths[p], buffer, sizeof(buffer));
+                sink += strlen(mimetype);
+            }
+        }
+        double elapsed = now_ns() - start;
+
+        printf("%-8s %9.1f ns/lookup\n", cached ? "cached" : "scan", elapsed / (iterations * PATHS_COUNT));
+    }
+
+    config_free(Settings);
+    (void)sink;
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,199 @@
+/* parse.c: Request Parser Micro-benchmark
+ *
+ * Times the request parser on corpora of recorded requests (separated by
+ * their blank lines), reporting time and heap allocations per request both
+ * for requests parsed from memory (parse_request_buffer) and for requests read
+ * from a socket as the server reads them (parse_request):
+ *
+ *  make bench-parse
+ *  build/bench/parse [-n iterations] [corpus ...] 2> /dev/null
+ */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+#define MAX_REQUESTS    256
+
+typedef struct {
+    char   *data;                       /*< Request line and headers */
+    size_t  length;                     /*< Length of request */
+} Sample;
+
+static Sample Samples[MAX_REQUESTS];
+static size_t SamplesCount = 0;
+static size_t Bytes        = 0;
+
+/* Heap allocations counted by interposing on the allocator (including those
+ * made inside libc, such as by strdup, and by the buffer pool) */
+static size_t Allocations  = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) {
+    Allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    Allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    Allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) {
+    Allocations++;
+    *pointer = __libc_memalign(alignment, size);
+    return *pointer ? 0 : ENOMEM;
+}
+
+/**
+ * Load corpus, one allocation per request (ending with its blank line).
+ **/
+static int load_corpus(const char *path) {
+    char buffer[BUFSIZ];
+    char request[1 << 16];
+    size_t length = 0;
+    FILE *fs = fopen(path, "r");
+
+    if (!fs) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    SamplesCount = Bytes = 0;
+    while (SamplesCount < MAX_REQUESTS && fgets(buffer, sizeof(buffer), fs)) {
+        size_t n = strlen(buffer);
+        if (length + n >= sizeof(request))
+            break;
+        memcpy(request + length, buffer, n);
+        length += n;
+        if (streq(buffer, "\r\n")) {
+            Samples[SamplesCount].data     = strndup(request, length);
+            Samples[SamplesCount++].length = length;
+            Bytes  += length;
+            length  = 0;
+        }
+    }
+
+    fclose(fs);
+    return SamplesCount > 0 ? 0 : -1;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Parse every request in the corpus from memory.
+ *
+ * @return  Number of requests that failed to parse.
+ **/
+static size_t parse_buffers(Request *r) {
+    size_t failures = 0;
+
+    for (size_t i = 0; i < SamplesCount; i++) {
+        failures += parse_request_buffer(r, Samples[i].data, Samples[i].length) != HTTP_STATUS_OK;
+        clear_request(r);
+    }
+    return failures;
+}
+
+/**
+ * Parse every request in the corpus from a socket (sent whole, then closed).
+ *
+ * @return  Number of requests that failed to parse.
+ **/
+static size_t parse_streams(Request *r) {
+    size_t failures = 0;
+
+    for (size_t i = 0; i < SamplesCount; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            failures++;
+            continue;
+        }
+
+        r->fd = fds[0];
+        if (write(fds[1], Samples[i].data, Samples[i].length) != (ssize_t)Samples[i].length)
+            failures++;
+        close(fds[1]);
+        failures += parse_request(r) != HTTP_STATUS_OK;
+        clear_request(r);
+        drop_request_input(r);
+        close(fds[0]);
+    }
+    return failures;
+}
+
+/**
+ * Time parser over corpus and report per-request cost.
+ **/
+static int run(const char *name, size_t (*parse)(Request *), long iterations) {
+    Request request = {.fd = -1, .path_fd = -1};
+
+    if (parse(&request) > 0) {
+        fprintf(stderr, "Corpus has requests that fail to parse\n");
+        return -1;
+    }
+
+    size_t allocations = Allocations;
+    double start       = now_ns();
+    for (long i = 0; i < iterations; i++)
+        parse(&request);
+    double elapsed     = now_ns() - start;
+    allocations        = Allocations - allocations;
+
+    printf("    %-8s %9.1f ns/request %6.1f allocations/request %8.0f MB/s\n", name,
+           elapsed / (iterations * SamplesCount),
+           (double)allocations / (iterations * SamplesCount),
+           Bytes * iterations / elapsed * 1e3);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *defaults[] = {"bench/headers.txt", "bench/minimal.txt"};
+    char *options[]  = {argv[0], NULL};
+    long iterations  = 100000;
+    int  argind      = 1;
+
+    if (argind + 1 < argc && streq(argv[argind], "-n")) {
+        iterations = atol(argv[argind + 1]);
+        argind    += 2;
+    }
+    if (argind == argc) {
+        argv   = defaults;
+        argc   = sizeof(defaults) / sizeof(defaults[0]);
+        argind = 0;
+    }
+
+    if (!(Settings = config_load(1, options)) || iterations < 1)
+        return EXIT_FAILURE;
+    scan_init();
+
+    for (; argind < argc; argind++) {
+        if (load_corpus(argv[argind]) < 0)
+            return EXIT_FAILURE;
+
+        printf("%s: %zu requests, %zu bytes\n", argv[argind], SamplesCount, Bytes);
+        if (run("buffer", parse_buffers, iterations) < 0 || run("stream", parse_streams, iterations) < 0)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,114 @@
+/* path.c: Request Path Resolution Micro-benchmark
+ *
+ * Times URI normalization, resolution beneath the root with openat2(2) (with
+ * and without the path cache), and the realpath(3) fallback on URIs for the
+ * bundled www root:
+ *
+ *  make bench-path
+ *  build/bench/path [iterations] 2> /dev/null
+ */
+
+#include "spidey.h"
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+static char *Uris[] = {
+    "/",
+    "/html/index.html",
+    "/html/main.css",
+    "/text/hackers.txt",
+    "/text/../song.txt",
+    "/scripts/./env.sh",
+    "/text/lyrics%2Etxt",
+    "//html///index.html",
+    "/missing/file.txt",
+    "/../etc/passwd",
+};
+
+#define URIS_COUNT  (sizeof(Uris) / sizeof(Uris[0]))
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t run_normalize(void) {
+    char path[PATH_MAX];
+    size_t found = 0;
+
+    for (size_t u = 0; u < URIS_COUNT; u++)
+        found += normalize_uri(Uris[u], path, sizeof(path)) == 0;
+    return found;
+}
+
+static size_t run_resolve(void) {
+    Request r = {.fd = -1, .path_fd = -1};
+    size_t found = 0;
+
+    for (size_t u = 0; u < URIS_COUNT; u++) {
+        r.uri  = Uris[u];
+        found += resolve_request_path(&r) == HTTP_STATUS_OK;
+        r.uri  = NULL;
+        clear_request(&r);
+    }
+    return found;
+}
+
+static size_t run_realpath(void) {
+    size_t found = 0;
+
+    for (size_t u = 0; u < URIS_COUNT; u++) {
+        char *path = determine_request_path(Settings->hosts[0].root_path, Uris[u]);
+        found += path != NULL;
+        free(path);
+    }
+    return found;
+}
+
+/**
+ * Time resolver over URIs and report per-URI cost.
+ **/
+static void run(const char *name, size_t (*resolve)(void), long iterations) {
+    size_t found = resolve();
+    double start = now_ns();
+
+    for (long i = 0; i < iterations; i++)
+        resolve();
+
+    double elapsed = now_ns() - start;
+    printf("%-10s %9.1f ns/uri (%zu of %zu found)\n", name,
+           elapsed / (iterations * URIS_COUNT), found, URIS_COUNT);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations  = argc > 1 ? atol(argv[1]) : 100000;
+    char *options[]  = {argv[0], "-r", "www", NULL};
+    Config *config;
+
+    scan_init();
+    if (!(config = config_load(3, options)))
+        return EXIT_FAILURE;
+    config->path_cache_size = 0;
+    Settings = config;
+    if (open_roots(Settings) < 0)
+        return EXIT_FAILURE;
+
+    run("normalize", run_normalize, iterations);
+    run("realpath", run_realpath, iterations / 10);
+    run("openat2", run_resolve, iterations / 10);
+
+    /* Reopen roots with the default path cache */
+    if (!(config = config_load(3, options)))
+        return EXIT_FAILURE;
+    Settings = config;
+    if (open_roots(Settings) < 0)
+        return EXIT_FAILURE;
+
+    run("cached", run_resolve, iterations / 10);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,189 @@
+/* scan.c: Header Scanning Micro-benchmark
+ *
+ * Compares the scalar and vectorized delimiter scanners (src/scan.c) with the
+ * libc calls the header parser used before, on a corpus of browser requests:
+ *
+ *  make bench-scan
+ *  build/bench/scan [bench/headers.txt [iterations]]
+ *
+ * Every implementation is first checked against the scalar one.
+ */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LINES   4096
+
+static char  *Lines[MAX_LINES];
+static size_t Lengths[MAX_LINES];
+static size_t LinesCount = 0;
+static size_t Requests   = 0;
+static size_t Bytes      = 0;
+
+/* Unused by the scanners, but declared by spidey.h */
+const Config *Settings = NULL;
+
+/**
+ * Load corpus, one allocation per line.
+ **/
+static int load_corpus(const char *path) {
+    char buffer[BUFSIZ];
+    FILE *fs = fopen(path, "r");
+
+    if (!fs) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (LinesCount < MAX_LINES && fgets(buffer, sizeof(buffer), fs)) {
+        if (streq(buffer, "\r\n"))
+            Requests++;
+        else {
+            Lengths[LinesCount] = strlen(buffer);
+            Lines[LinesCount++] = strdup(buffer);
+        }
+        Bytes += strlen(buffer);
+    }
+
+    fclose(fs);
+    return 0;
+}
+
+/**
+ * Split request or header line the way parse_request_method and
+ * parse_request_headers do.
+ **/
+static size_t parse_scan(char *line) {
+    if (strncmp(line, "GET ", 4) == 0) {
+        char *uri = scan_text(scan_whitespace(line));
+        char *version = scan_text(scan_whitespace(uri));
+        return (scan_whitespace(version) - line) + (uri - line);
+    }
+
+    char *value = scan_delimiter(line, ':', '\n');
+    if (*value != ':' || value == line)
+        return 0;
+    *value++ = '\0';
+    value = scan_text(value);
+    *scan_delimiter(value, '\r', '\n') = '\0';
+    return (value - line) + *value;
+}
+
+/**
+ * Split request or header line the way they were split before scanners were
+ * added (with isspace loops, strlen, strchr, and strtok).
+ **/
+static size_t parse_libc(char *line) {
+    if (strncmp(line, "GET ", 4) == 0) {
+        char *s = line;
+        while (*s && !isspace(*s)) s++;
+        while (*s && isspace(*s)) s++;
+        char *uri = s;
+        while (*s && !isspace(*s)) s++;
+        while (*s && isspace(*s)) s++;
+        char *version = s;
+        while (*s && !isspace(*s)) s++;
+        return (s - line) + (uri - line) + (version > uri);
+    }
+
+    if (strlen(line) <= 2)
+        return 0;
+    chomp(line);
+    if (line[0] && line[strlen(line) - 1] == '\r')
+        chomp(line);
+    char *value = strchr(line, ':');
+    if (!value)
+        return 0;
+    value++;
+    while (*value && isspace(*value)) value++;
+    char *name = strtok(line, ":");
+    if (!name)
+        return 0;
+    return (value - name) + *value;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Time parse over corpus and report per-line and per-request cost.
+ **/
+static void run(const char *name, size_t (*parse)(char *), long iterations) {
+    char buffer[BUFSIZ];
+    volatile size_t sink = 0;
+    double start = now_ns();
+
+    /* Lines are copied first, as fgets does in the server */
+    for (long i = 0; i < iterations; i++) {
+        for (size_t l = 0; l < LinesCount; l++) {
+            memcpy(buffer, Lines[l], Lengths[l] + 1);
+            sink += parse(buffer);
+        }
+    }
+
+    double elapsed = now_ns() - start;
+    printf("%-8s %8.2f ns/line %9.1f ns/request %8.0f MB/s\n", name,
+           elapsed / (iterations * LinesCount),
+           elapsed / (iterations * Requests),
+           Bytes * iterations / elapsed * 1e3);
+    (void)sink;
+}
+
+/**
+ * Check that the current scanners agree with the scalar ones at every offset.
+ **/
+static int verify(void) {
+    const char *impl = getenv("SPIDEY_SCAN");
+
+    if (streq(impl, "scalar"))
+        return 0;
+
+    for (size_t l = 0; l < LinesCount; l++) {
+        for (char *s = Lines[l]; *s; s++) {
+            char *results[3] = {scan_delimiter(s, ':', '\n'), scan_whitespace(s), scan_text(s)};
+            setenv("SPIDEY_SCAN", "scalar", 1);
+            scan_init();
+            char *scalar[3] = {scan_delimiter(s, ':', '\n'), scan_whitespace(s), scan_text(s)};
+            setenv("SPIDEY_SCAN", impl, 1);
+            scan_init();
+            if (memcmp(results, scalar, sizeof(results)) != 0) {
+                fprintf(stderr, "%s disagrees with scalar on line %zu offset %zd\n", impl, l, s - Lines[l]);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "bench/headers.txt";
+    long iterations  = argc > 2 ? atol(argv[2]) : 100000;
+    const char *impls[] = {"scalar", "sse2", "avx2"};
+
+    if (load_corpus(path) < 0 || LinesCount == 0 || Requests == 0)
+        return EXIT_FAILURE;
+
+    printf("%zu requests, %zu lines, %zu bytes\n", Requests, LinesCount, Bytes);
+    run("libc", parse_libc, iterations);
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        setenv("SPIDEY_SCAN", impls[i], 1);
+        const char *name = scan_init();
+        if (!streq(name, impls[i]))
+            continue;
+        if (verify() < 0)
+            return EXIT_FAILURE;
+        run(name, parse_scan, iterations);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# End-to-end load suite: run build/bench/load against spidey for a mix of
+# keep-alive, per-request connection, listing, and error workloads.
+#
+# Usage: bench_load.sh [PORT [SECONDS [CONNECTIONS]]]
+#
+# Extra configuration lines can be given in CONFIG (ie. CONFIG="cpu_affinity = on").
+
+SPIDEY=${SPIDEY:-./bin/spidey}
+LOAD=${LOAD:-./build/bench/load}
+WORKSPACE=/tmp/spidey.load.$(id -u)
+PORT=${1:-9898}
+SECONDS_PER_RUN=${2:-10}
+CONNECTIONS=${3:-8}
+URL=http://localhost:$PORT
+
+# Each workload is a name followed by load arguments
+WORKLOADS=(
+    "file|$URL/text/hackers.txt"
+    "file-close|-C $URL/text/hackers.txt"
+    "listing|$URL/ $URL/html/ $URL/text/"
+    "not-found|$URL/missing.html"
+    "mixed|$URL/ $URL/html/index.html $URL/html/main.css $URL/song.txt $URL/text/lyrics.txt $URL/missing"
+)
+
+# Functions
+
+cleanup() {
+    if [ -n "$SERVER" ]; then
+        kill $SERVER 2> /dev/null
+        wait $SERVER 2> /dev/null
+    fi
+    rm -fr $WORKSPACE
+}
+
+# Setup
+
+mkdir -p $WORKSPACE
+trap "cleanup" EXIT
+trap "cleanup; exit 1" INT TERM
+
+if [ ! -x $LOAD ]; then
+    echo "Missing $LOAD (make build/bench/load)"
+    exit 1
+fi
+
+printf "mode = prefork\nroot = www\n%b\n" "$CONFIG" > $WORKSPACE/spidey.conf
+$SPIDEY -f $WORKSPACE/spidey.conf -p $PORT &> /dev/null &
+SERVER=$!
+sleep 0.5
+
+# Benchmark (the server is stopped with SIGTERM so that instrumented builds
+# write their profiles)
+
+echo "Load test of $SPIDEY: $CONNECTIONS connections, $SECONDS_PER_RUN seconds per workload"
+[ -n "$CONFIG" ] && echo "Configuration: $CONFIG"
+for workload in "${WORKLOADS[@]}"; do
+    echo
+    echo "${workload%%|*}"
+    $LOAD -c $CONNECTIONS -d $SECONDS_PER_RUN ${workload#*|} | sed 's/^/    /'
+done
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# Compare socket options by hammering spidey with thor.py once per option.
+#
+# Usage: bench_sockets.sh [PORT [PROCESSES [REQUESTS [PATH]]]]
+
+SPIDEY=${SPIDEY:-./bin/spidey}
+THOR=${THOR:-./bin/thor.py}
+WORKSPACE=/tmp/spidey.bench.$(id -u)
+PORT=${1:-9898}
+PROCESSES=${2:-4}
+REQUESTS=${3:-100}
+URLPATH=${4:-/text/hackers.txt}
+
+# Each variant is one line of configuration added to the defaults
+VARIANTS=(
+    ""
+    "tcp_nodelay = off"
+    "tcp_cork = on"
+    "tcp_defer_accept = 1"
+    "tcp_fastopen = 256"
+    "reuse_port = on"
+    "send_buffer = 262144"
+    "receive_buffer = 262144"
+    "busy_poll = 50"
+)
+
+# Functions
+
+cleanup() {
+    [ -n "$SERVER" ] && kill $SERVER 2> /dev/null
+    rm -fr $WORKSPACE
+}
+
+# Setup
+
+mkdir -p $WORKSPACE
+trap "cleanup" EXIT
+trap "cleanup; exit 1" INT TERM
+
+# Benchmark
+
+printf "%-32s %s\n" "Option" "Average Elapsed Time (s)"
+for variant in "${VARIANTS[@]}"; do
+    printf "mode = prefork\nroot = www\n%s\n" "$variant" > $WORKSPACE/spidey.conf
+
+    $SPIDEY -f $WORKSPACE/spidey.conf -p $PORT &> /dev/null &
+    SERVER=$!
+    sleep 0.5
+
+    average=$($THOR -p $PROCESSES -r $REQUESTS http://localhost:$PORT$URLPATH | awk '/^TOTAL/ { print $NF }')
+    printf "%-32s %s\n" "${variant:-defaults}" "${average:-failed}"
+
+    kill $SERVER
+    wait $SERVER 2> /dev/null
+    SERVER=
+done
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+# Pack a document root into an asset bundle that spidey serves straight from
+# memory (spidey -b BUNDLE).  The layout is described by BundleHeader and
+# BundleEntry in include/spidey.h:
+#
+#   header | entries (sorted by path) | strings | bodies
+#
+# Files are indexed by their path relative to the root (as normalize_uri
+# produces it) and directories by a pre-rendered listing, as
+# handle_browse_request would produce it.  Executable files are left out so
+# that they are still run as CGI scripts from the root.
+
+import gzip
+import hashlib
+import os
+import stat
+import struct
+import sys
+
+# Globals
+
+MAGIC       = b'SPIDEYB1'
+HEADER      = struct.Struct('<8sIIQ')
+ENTRY       = struct.Struct('<IIIIQQQQ')
+MIME_TYPES  = '/etc/mime.types'
+DEFAULT     = 'text/plain'
+OVERRIDES   = {}
+MIN_GZIP    = 256       # Smallest body worth compressing
+GZIP_RATIO  = 0.9       # Largest compressed size (relative) worth keeping
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} [-m MIME_TYPES -M MIMETYPE -t EXT=MIMETYPE] ROOT BUNDLE
+    -h              Display help message
+
+    -m MIME_TYPES   Path to mime.types file ({})
+    -M MIMETYPE     Default mimetype ({})
+    -t EXT=MIMETYPE Mimetype override (repeatable)
+    '''.format(os.path.basename(sys.argv[0]), MIME_TYPES, DEFAULT))
+    sys.exit(status)
+
+def read_mime_types(path):
+    ''' Return extension to mimetype mapping (first rule wins, as in determine_mimetype) '''
+    types = {}
+    try:
+        for line in open(path):
+            fields = line.split()
+            if not fields or fields[0].startswith('#'):
+                continue
+            for extension in fields[1:]:
+                types.setdefault(extension, fields[0])
+    except OSError as e:
+        print('Error reading {}: {}'.format(path, e), file=sys.stderr)
+    return types
+
+def mimetype(path, types):
+    ''' Return mimetype of path from its extension '''
+    if '.' not in path:
+        return DEFAULT
+    extension = path.rsplit('.', 1)[1]
+    return OVERRIDES.get(extension) or types.get(extension, DEFAULT)
+
+def render_listing(path, names):
+    ''' Return directory listing as handle_browse_request renders it '''
+    prefix = '/' + path if path else ''
+    html   = "<html><body bgcolor=#9aa1ad><ul class='list-group'>\n"
+    for name in sorted(names + ['..'], key=os.fsencode):
+        html += '<li style="font-family:courier new;font-size:32px;font-color=green;"><a href="{0}/{1}">{1}</a></li>\n'.format(prefix, name)
+    html += '</ul></body></html>\n'
+    return html.encode()
+
+def collect(root, types):
+    ''' Return sorted (path, mimetype, body) assets under root '''
+    assets = []
+    for directory, subdirectories, files in os.walk(root):
+        relative = os.path.relpath(directory, root)
+        relative = '' if relative == '.' else relative
+        assets.append((relative, 'text/html', render_listing(relative, subdirectories + files)))
+
+        for name in files:
+            path = os.path.join(directory, name)
+            mode = os.stat(path).st_mode
+            if not stat.S_ISREG(mode) or mode & (stat.S_IXUSR | stat.S_IXGRP | stat.S_IXOTH):
+                continue
+            with open(path, 'rb') as fs:
+                assets.append((os.path.join(relative, name), mimetype(path, types), fs.read()))
+
+    return sorted(assets, key=lambda asset: os.fsencode(asset[0]))
+
+def build(assets, output):
+    ''' Write bundle of assets to output '''
+    strings = bytearray()
+    bodies  = []
+    entries = []
+    data    = HEADER.size + ENTRY.size * len(assets)
+
+    def add_string(s):
+        offset = len(strings)
+        strings.extend(s + b'\0')
+        return offset
+
+    for path, type, body in assets:
+        etag    = 'W/"{}"'.format(hashlib.blake2b(body, digest_size=8).hexdigest()).encode()
+        encoded = gzip.compress(body, 9, mtime=0) if len(body) >= MIN_GZIP else body
+        variant = encoded if len(encoded) < len(body) * GZIP_RATIO else b''
+        head    = 'Content-Type: {}\r\nETag: {}\r\n'.format(type, etag.decode())
+        if variant:
+            head += 'Vary: Accept-Encoding\r\n'
+        entries.append([add_string(os.fsencode(path)), add_string(etag), add_string(head.encode()), len(head), len(bodies), len(body), len(bodies) + 1, len(variant)])
+        bodies.extend([body, variant])
+
+    # Turn string and body indices into file offsets
+    offsets = []
+    offset  = data + len(strings)
+    for body in bodies:
+        offsets.append(offset)
+        offset += len(body)
+
+    with open(output, 'wb') as fs:
+        fs.write(HEADER.pack(MAGIC, len(entries), 0, offset))
+        for entry in entries:
+            entry[0:3] = [data + o for o in entry[0:3]]
+            entry[4]   = offsets[entry[4]]
+            entry[6]   = offsets[entry[6]] if entry[7] else 0
+            fs.write(ENTRY.pack(*entry))
+        fs.write(strings)
+        for body in bodies:
+            fs.write(body)
+
+    return offset
+
+# Main execution
+
+if __name__ == '__main__':
+    arguments = sys.argv[1:]
+    while arguments and arguments[0].startswith('-'):
+        flag = arguments.pop(0)
+        if flag == '-h':
+            usage(0)
+        elif flag == '-m' and arguments:
+            MIME_TYPES = arguments.pop(0)
+        elif flag == '-M' and arguments:
+            DEFAULT = arguments.pop(0)
+        elif flag == '-t' and arguments and '=' in arguments[0]:
+            extension, type = arguments.pop(0).split('=', 1)
+            OVERRIDES[extension] = type
+        else:
+            usage(1)
+
+    if len(arguments) != 2:
+        usage(1)
+
+    root, output = arguments
+    assets = collect(root, read_mime_types(MIME_TYPES))
+    size   = build(assets, output)
+    print('{}: {} assets in {} bytes'.format(output, len(assets), size))
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+
+# Generate perfect hash table of well-known header names (src/header_hash.h)
+# from the HeaderId enum in include/spidey.h
+
+import itertools
+import os
+import re
+import sys
+
+# Globals
+
+HEADER  = 'include/spidey.h'
+OUTPUT  = 'src/header_hash.h'
+ENTRY   = re.compile(r'^\s*(HEADER_[A-Z_]+)(?:\s*=\s*0)?,\s*/\*\s*([A-Za-z-]+)\s*\*/')
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} [SPIDEY_H [OUTPUT]]
+    -h              Display help message
+
+    SPIDEY_H        Header declaring HeaderId ({})
+    OUTPUT          Generated table ({})
+    '''.format(os.path.basename(sys.argv[0]), HEADER, OUTPUT))
+    sys.exit(status)
+
+def read_headers(path):
+    ''' Return (enum, name) pairs of the HeaderId enum '''
+    headers = None
+    for line in open(path):
+        if line.startswith('typedef enum'):
+            headers = []
+        elif line.startswith('}') and headers is not None:
+            if 'HeaderId' in line:
+                return headers
+            headers = None
+        elif headers is not None:
+            match = ENTRY.match(line)
+            if match:
+                headers.append((match.group(1), match.group(2)))
+    raise SystemExit('No HeaderId enum in {}'.format(path))
+
+def fold(c):
+    ''' Fold case of header name character (as | 0x20 does in C) '''
+    return ord(c) | 0x20
+
+def header_hash(name, first, last, length, size):
+    ''' Hash matching HEADER_HASH in the generated table '''
+    return (fold(name[0]) * first + fold(name[-1]) * last + len(name) * length) & (size - 1)
+
+def search(names):
+    ''' Find smallest table and multipliers with no collisions '''
+    size = 1
+    while size < len(names):
+        size <<= 1
+    while size <= 1024:
+        for first, last, length in itertools.product(range(1, 64), repeat=3):
+            slots = {header_hash(n, first, last, length, size) for n in names}
+            if len(slots) == len(names):
+                return size, first, last, length
+        size <<= 1
+    raise SystemExit('No perfect hash found')
+
+def write_table(path, headers, size, first, last, length):
+    table = [None] * size
+    for enum, name in headers:
+        table[header_hash(name, first, last, length, size)] = (enum, name)
+
+    with open(path, 'w') as fs:
+        fs.write('/* header_hash.h: Perfect Hash of Well-known Header Names */\n\n')
+        fs.write('/* Generated by bin/gen_headers.py from {}; do not edit */\n\n'.format(HEADER))
+        fs.write('#pragma once\n\n')
+        fs.write('#define HEADER_HASH_SIZE        {}\n'.format(size))
+        fs.write('#define HEADER_HASH_MIN_LENGTH  {}\n'.format(min(len(n) for _, n in headers)))
+        fs.write('#define HEADER_HASH_MAX_LENGTH  {}\n'.format(max(len(n) for _, n in headers)))
+        fs.write('#define HEADER_HASH(s, n)       ((((unsigned char)(s)[0] | 0x20) * {} + ((unsigned char)(s)[(n) - 1] | 0x20) * {} + (n) * {}) & (HEADER_HASH_SIZE - 1))\n\n'.format(first, last, length))
+        fs.write('static const struct {\n')
+        fs.write('    const char *name;\n')
+        fs.write('    size_t      length;\n')
+        fs.write('    HeaderId    id;\n')
+        fs.write('} HeaderHash[HEADER_HASH_SIZE] = {\n')
+        for slot, entry in enumerate(table):
+            if entry:
+                fs.write('    [{:3}] = {{"{}", {}, {}}},\n'.format(slot, entry[1], len(entry[1]), entry[0]))
+        fs.write('};\n\n')
+        fs.write('/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */\n')
+
+# Main execution
+
+if __name__ == '__main__':
+    arguments = sys.argv[1:]
+    if arguments and arguments[0] == '-h':
+        usage(0)
+    if len(arguments) > 2:
+        usage(1)
+
+    source  = arguments[0] if len(arguments) > 0 else HEADER
+    output  = arguments[1] if len(arguments) > 1 else OUTPUT
+    headers = read_headers(source)
+    size, first, last, length = search([name for _, name in headers])
+    write_table(output, headers, size, first, last, length)
+    print('{}: {} headers in {} slots'.format(output, len(headers), size))
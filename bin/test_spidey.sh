@@ -14,6 +14,7 @@ error() {
 
 cleanup() {
     STATUS=${1:-$FAILURES}
+    stop_servers
     rm -fr $WORKSPACE
     exit $STATUS
 }
@@ -37,7 +38,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -73,6 +74,17 @@ check_hrefs() {
     fi
 }
 
+start_server() {
+    "$@" > /dev/null 2>&1 &
+    SERVERS="$SERVERS $!"
+    sleep 0.5
+}
+
+stop_servers() {
+    [ -n "$SERVERS" ] && kill $SERVERS 2> /dev/null && wait $SERVERS 2> /dev/null
+    SERVERS=""
+}
+
 # Setup
 
 mkdir $WORKSPACE
@@ -115,7 +127,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -163,7 +175,7 @@ printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=36fcc1da4afe58242350ee3940bb4220
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "Spidey html thumbnail" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -265,7 +277,7 @@ sleep 2
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.1 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -297,3 +309,231 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Slow Clients"
+
+printf "     %-60s ... " "Request sent 2.5 s after connecting"
+STATUS="HTTP/1.0 200 OK"
+CONTENT="text/plain"
+(exec 3<>/dev/tcp/$HOST/$PORT && sleep 2.5 && printf "GET /song.txt HTTP/1.0\r\n\r\n" >&3 && cat <&3) > $WORKSPACE/test 2> /dev/null
+STATUS_CODE=$?
+tr -d '\r' < $WORKSPACE/test | sed '/^$/q' > $WORKSPACE/header
+if ! check_status $STATUS_CODE 0 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Persistent Connections"
+
+printf "     %-60s ... " "/ /text /song.txt"
+curl -s -v $HOST:$PORT/ $HOST:$PORT/text $HOST:$PORT/song.txt > /dev/null 2> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_count "Re-using" 2; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Rate Limits"
+
+cat > $WORKSPACE/spidey.conf <<EOF
+rate_limit = /song.txt 1 1
+EOF
+start_server ./bin/spidey -r www -p $((PORT + 1)) -f $WORKSPACE/spidey.conf
+
+printf "     %-60s ... " "/song.txt"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header localhost:$((PORT + 1))/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+for uri in /song.txt //song.txt /./song.txt /%73ong.txt; do
+    printf "     %-60s ... " "$uri (limited)"
+    STATUS="HTTP/1.1 429 Too Many Requests"
+    CONTENT="text/html"
+    curl -s -D $WORKSPACE/header localhost:$((PORT + 1))$uri > $WORKSPACE/test
+    if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT" || ! grep_all "^Retry-After:" $WORKSPACE/header; then
+	error "Failure"
+    else
+	echo "Success"
+    fi
+done
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Proxied Routes"
+
+cat > $WORKSPACE/spidey.conf <<EOF
+proxy = /api 127.0.0.1:$((PORT + 2)) 127.0.0.1:$((PORT + 3))
+proxy = /down 127.0.0.1:$((PORT + 4))
+EOF
+start_server ./bin/upstream.py $((PORT + 2))
+start_server ./bin/upstream.py $((PORT + 3))
+start_server ./bin/spidey -r www -p $((PORT + 1)) -f $WORKSPACE/spidey.conf
+
+printf "     %-60s ... " "/api/hello (round-robin)"
+curl -s localhost:$((PORT + 1))/api/hello localhost:$((PORT + 1))/api/hello > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "port=$((PORT + 2)) port=$((PORT + 3)) path=/api/hello" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "//api/hello"
+curl -s localhost:$((PORT + 1))//api/hello > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "method=GET" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/admin/x%2F..%2F..%2Fapi/h"
+curl -s --path-as-is localhost:$((PORT + 1))/admin/x%2F..%2F..%2Fapi/h > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "path=/api/h.x-forwarded-for" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/api/./a%20b/?q=1"
+curl -s --path-as-is "localhost:$((PORT + 1))/api/./a%20b/?q=1" > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "path=/api/a%20b/\\?q=1.x-forwarded-for" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/apiary"
+STATUS="HTTP/1.1 404 Not Found"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header localhost:$((PORT + 1))/apiary > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/api/chunked"
+curl -s -D $WORKSPACE/header localhost:$((PORT + 1))/api/chunked > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "^part.0 ^part.1 ^part.2" $WORKSPACE/test || ! grep_all "chunked" $WORKSPACE/header; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/api/echo (POST)"
+curl -s -d "hello=world" localhost:$((PORT + 1))/api/echo > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "method=POST length=11 ^hello=world" $WORKSPACE/test; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/down (upstream down)"
+STATUS="HTTP/1.1 502 Bad Gateway"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header localhost:$((PORT + 1))/down > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Virtual Hosts"
+
+cat > $WORKSPACE/spidey.conf <<EOF
+[text.example.com]
+root = www/text
+EOF
+start_server ./bin/spidey -r www -p $((PORT + 1)) -f $WORKSPACE/spidey.conf
+
+printf "     %-60s ... " "/song.txt (Host: www.example.com)"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -H "Host: www.example.com" -D $WORKSPACE/header localhost:$((PORT + 1))/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT" || ! cmp -s $WORKSPACE/test www/song.txt; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/lyrics.txt (Host: text.example.com)"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -H "Host: text.example.com:$((PORT + 1))" -D $WORKSPACE/header localhost:$((PORT + 1))/lyrics.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT" || ! cmp -s $WORKSPACE/test www/text/lyrics.txt; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/song.txt (Host: text.example.com)"
+STATUS="HTTP/1.1 404 Not Found"
+CONTENT="text/html"
+curl -s -H "Host: text.example.com" -D $WORKSPACE/header localhost:$((PORT + 1))/song.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle Bundled Assets"
+
+./bin/build_bundle.py www $WORKSPACE/www.bundle > /dev/null
+start_server ./bin/spidey -r www -p $((PORT + 1)) -b $WORKSPACE/www.bundle
+
+printf "     %-60s ... " "/text/hackers.txt"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -D $WORKSPACE/header localhost:$((PORT + 1))/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT" || ! cmp -s $WORKSPACE/test www/text/hackers.txt; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/text/hackers.txt (If-None-Match)"
+STATUS="HTTP/1.1 304 Not Modified"
+ETAG=$(awk 'tolower($1) == "etag:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+curl -s -H "If-None-Match: $ETAG" -D $WORKSPACE/header localhost:$((PORT + 1))/text/hackers.txt > $WORKSPACE/test
+if ! check_status $? 0 || [ -z "$ETAG" ] || [ "$(head -n 1 $WORKSPACE/header | tr -d '\r\n')" != "$STATUS" ] || [ -s $WORKSPACE/test ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "     %-60s ... " "/text/hackers.txt (Accept-Encoding: gzip)"
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/plain"
+curl -s -H "Accept-Encoding: gzip" -D $WORKSPACE/header localhost:$((PORT + 1))/text/hackers.txt > $WORKSPACE/test.gz
+if ! check_status $? 0 || ! check_header "$STATUS" "$CONTENT" || ! grep_all "^Content-Encoding:.gzip" $WORKSPACE/header || ! gunzip -c $WORKSPACE/test.gz | cmp -s - www/text/hackers.txt; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+stop_servers
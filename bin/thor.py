@@ -36,11 +36,11 @@ def do_request(pid):
         t_end = time.time()
         if (VERBOSE):
             print(response.text)
-        print("Process: {}, Request: {}, Elapsed Time: {}".format(pid, r, round((t_end - t_begin), 2)))
+        print("Process: {}, Request: {}, Elapsed Time: {}".format(pid, r, round((t_end - t_begin), 4)))
         times.append(t_end - t_begin)
 
     average = sum(times) / len(times)
-    print("Process: {}, AVERAGE:  , Elapsed Time: {}".format(pid, round(average, 2)))
+    print("Process: {}, AVERAGE:  , Elapsed Time: {}".format(pid, round(average, 4)))
     return average
 
 # Main execution
@@ -69,6 +69,6 @@ if __name__ == '__main__':
     # Create pool of workers and perform requests
     pool = multiprocessing.Pool(PROCESSES)
     times = pool.map(do_request, range(PROCESSES))
-    print("TOTAL AVERAGE ELAPSED TIME: {}".format(round(sum(times) / len(times), 2)))
+    print("TOTAL AVERAGE ELAPSED TIME: {}".format(round(sum(times) / len(times), 4)))
 
 # vim: set sts=4 sw=4 ts=8 expandtab ft=python:
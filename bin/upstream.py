@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+
+# Stub upstream server for trying out spidey's reverse proxy, for example:
+#
+#   bin/upstream.py 8001 & bin/upstream.py 8002 &
+#   ./spidey -f spidey.conf    # with proxy = /api/ 127.0.0.1:8001 127.0.0.1:8002
+#   curl localhost:9898/api/hello
+
+import os
+import sys
+import time
+
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+# Globals
+
+ADDRESS = '127.0.0.1'
+PORT    = None
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} PORT
+    -h              Display help message
+
+Every request is answered with a line describing it (port, method, path,
+X-Forwarded-For, and body length) followed by the request body.  Paths
+containing "chunked" get a chunked response sent in parts, and paths
+containing "slow" wait 3 seconds before responding.
+    '''.format(os.path.basename(sys.argv[0])))
+    sys.exit(status)
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        pass
+
+    def read_body(self):
+        ''' Read Content-Length or chunked request body '''
+        if 'chunked' not in self.headers.get('Transfer-Encoding', ''):
+            return self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+        body = b''
+        while True:
+            size = int(self.rfile.readline().split(b';')[0], 16)
+            if size == 0:
+                while self.rfile.readline() not in (b'\r\n', b'\n', b''):
+                    pass
+                return body
+            body += self.rfile.read(size)
+            self.rfile.readline()
+
+    def respond(self):
+        body = self.read_body()
+
+        if 'chunked' in self.path:
+            self.send_response(200)
+            self.send_header('Transfer-Encoding', 'chunked')
+            self.end_headers()
+            for part in range(3):
+                data = 'part {} from {}\n'.format(part, PORT).encode()
+                self.wfile.write(b'%x\r\n%s\r\n' % (len(data), data))
+                self.wfile.flush()
+                time.sleep(0.2)
+            self.wfile.write(b'0\r\n\r\n')
+            return
+
+        if 'slow' in self.path:
+            time.sleep(3)
+
+        data = 'port={} method={} path={} x-forwarded-for={} length={}\n'.format(
+            PORT, self.command, self.path, self.headers.get('X-Forwarded-For'), len(body)).encode() + body
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain')
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(data)
+
+    do_GET    = respond
+    do_HEAD   = respond
+    do_POST   = respond
+    do_PUT    = respond
+    do_DELETE = respond
+
+# Main execution
+
+if __name__ == '__main__':
+    arguments = sys.argv[1:]
+    if not arguments or arguments[0] == '-h':
+        usage(0 if arguments else 1)
+
+    PORT = int(arguments[0])
+    ThreadingHTTPServer((ADDRESS, PORT), Handler).serve_forever()
@@ -0,0 +1,79 @@
+/* driver.c: Fuzz Target Driver
+ *
+ * Runs a fuzz target once on each input file (or each file in each input
+ * directory), for compilers without libFuzzer and for replaying crashes:
+ *
+ *  build/fuzz/parse-regress fuzz/corpus/parse crash-1234
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/**
+ * Run fuzz target on contents of file.
+ *
+ * @return  -1 if the file could not be read and 0 otherwise.
+ **/
+static int run_file(const char *path) {
+    FILE *fs = fopen(path, "rb");
+    struct stat s;
+
+    if (!fs || fstat(fileno(fs), &s) < 0) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        if (fs)
+            fclose(fs);
+        return -1;
+    }
+
+    uint8_t *data = malloc(s.st_size ? s.st_size : 1);
+    size_t   size = data ? fread(data, 1, s.st_size, fs) : 0;
+    fclose(fs);
+    if (!data)
+        return -1;
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t inputs = 0;
+    int    status = EXIT_SUCCESS;
+
+    LLVMFuzzerInitialize(&argc, &argv);
+
+    for (int i = 1; i < argc; i++) {
+        DIR *directory = opendir(argv[i]);
+        if (!directory) {
+            if (run_file(argv[i]) < 0)
+                status = EXIT_FAILURE;
+            inputs++;
+            continue;
+        }
+
+        for (struct dirent *entry; (entry = readdir(directory)); ) {
+            char path[BUFSIZ];
+            if (entry->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+            if (run_file(path) < 0)
+                status = EXIT_FAILURE;
+            inputs++;
+        }
+        closedir(directory);
+    }
+
+    fprintf(stderr, "%s: ran %zu inputs\n", argv[0], inputs);
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,114 @@
+/* parse.c: Request Parser Fuzz Target
+ *
+ * Parses each input both from memory (parse_request_buffer) and from a socket
+ * (parse_request), and aborts if the two disagree or if a parsed
+ * request breaks an invariant the handlers rely on.  Lines are limited to
+ * 128 bytes so that short inputs reach the long line paths:
+ *
+ *  make fuzz-parse             (libFuzzer, needs clang)
+ *  make fuzz-regress           (seed corpus only, with gcc)
+ */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#include <sys/socket.h>
+
+/**
+ * Check invariants of successfully parsed request.
+ **/
+static void check_request(const Request *r) {
+    if (!r->method || !r->uri || !r->query || !*r->method || !*r->uri)
+        abort();
+    if (strchr(r->uri, '?') || r->http_minor < 0 || r->http_minor > 1)
+        abort();
+    if (r->nheaders < 0 || r->nheaders > REQUEST_MAX_HEADERS)
+        abort();
+
+    for (int i = 0; i < r->nheaders; i++) {
+        const Header *header = &r->headers[i];
+        size_t length = strlen(header->name);
+        if (length == 0 || header->value != header->name + length + 1)
+            abort();
+        if (strpbrk(header->name, ":\n") || strpbrk(header->value, "\r\n"))
+            abort();
+        if (header->id != header_id(header->name, length))
+            abort();
+    }
+
+    /* Each well-known header is indexed by its first occurrence */
+    for (int id = 0; id < HEADER_OTHER; id++) {
+        int first = 0;
+        while (first < r->nheaders && r->headers[first].id != (HeaderId)id)
+            first++;
+        const char *value = request_header(r, id);
+        if (first == r->nheaders ? value != NULL : value != r->headers[first].value)
+            abort();
+    }
+}
+
+/**
+ * Check that two parses of the same input agree.
+ **/
+static void check_same(const Request *a, const Request *b) {
+    if (!streq(a->method, b->method) || !streq(a->uri, b->uri) || !streq(a->query, b->query))
+        abort();
+    if (a->http_minor != b->http_minor || a->keep_alive != b->keep_alive || a->nheaders != b->nheaders)
+        abort();
+    for (int i = 0; i < a->nheaders; i++) {
+        if (!streq(a->headers[i].name, b->headers[i].name) || !streq(a->headers[i].value, b->headers[i].value))
+            abort();
+    }
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    char *options[] = {(*argv)[0], "-r", "www", NULL};
+    Config *config  = config_load(3, options);
+
+    (void)argc;
+    if (!config)
+        abort();
+    config->request_buffer = 128;
+    Settings = config;
+    scan_init();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    Request buffer = {.fd = -1, .path_fd = -1};
+    Request stream = {.fd = -1, .path_fd = -1};
+
+    /* The buffer is copied to an exact-size allocation so that reads past
+     * its end are caught */
+    char *copy = malloc(size ? size : 1);
+    if (!copy)
+        return 0;
+    memcpy(copy, data, size);
+
+    Status status = parse_request_buffer(&buffer, copy, size);
+    if (status == HTTP_STATUS_OK)
+        check_request(&buffer);
+
+    /* Inputs larger than a socket buffer would block the write */
+    int fds[2];
+    if (size && size <= 65536 && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        stream.fd = fds[0];
+        if (write(fds[1], copy, size) != (ssize_t)size)
+            abort();
+        close(fds[1]);
+        if (parse_request(&stream) != status)
+            abort();
+        if (status == HTTP_STATUS_OK)
+            check_same(&buffer, &stream);
+        close(fds[0]);
+    }
+
+    clear_request(&stream);
+    drop_request_input(&stream);
+    clear_request(&buffer);
+    free(copy);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
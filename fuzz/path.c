@@ -0,0 +1,90 @@
+/* path.c: Request Path Fuzz Target
+ *
+ * Treats each input as a request URI and aborts if normalization produces a
+ * path that could climb out of the root, writes past a short output buffer,
+ * or if either resolver (openat2 beneath the root, or the realpath fallback)
+ * returns a path outside the root:
+ *
+ *  make fuzz-path              (libFuzzer, needs clang)
+ *  make fuzz-regress           (seed corpus only, with gcc)
+ */
+
+#include "spidey.h"
+
+#include <limits.h>
+#include <string.h>
+
+#define SHORT_PATH  16
+
+/**
+ * Check that normalized path is relative and has no empty, "." or ".."
+ * segments.
+ **/
+static void check_normalized(const char *path, size_t size) {
+    size_t length = strlen(path);
+
+    if (length >= size || path[0] == '/' || (length && path[length - 1] == '/'))
+        abort();
+
+    for (const char *segment = path; *segment; ) {
+        size_t n = strcspn(segment, "/");
+        if (n == 0 || (n == 1 && segment[0] == '.') || (n == 2 && segment[0] == '.' && segment[1] == '.'))
+            abort();
+        segment += n + (segment[n] == '/');
+    }
+}
+
+/**
+ * Check that resolved path is the root or beneath it.
+ **/
+static void check_beneath(const char *path, const char *root) {
+    size_t length = strlen(root);
+
+    if (!path)
+        return;
+    if (strncmp(path, root, length) != 0 || (path[length] != '\0' && path[length] != '/'))
+        abort();
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    char *options[] = {(*argv)[0], "-r", "www", NULL};
+
+    (void)argc;
+    if (!(Settings = config_load(3, options)) || open_roots(Settings) < 0)
+        abort();
+    scan_init();
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char  path[PATH_MAX];
+    char *uri = strndup((const char *)data, size);
+
+    if (!uri)
+        return 0;
+
+    if (normalize_uri(uri, path, sizeof(path)) == 0)
+        check_normalized(path, sizeof(path));
+
+    /* Short buffers are exact-size allocations so that overflows are caught */
+    char *short_path = malloc(SHORT_PATH);
+    if (short_path && normalize_uri(uri, short_path, SHORT_PATH) == 0)
+        check_normalized(short_path, SHORT_PATH);
+    free(short_path);
+
+    const char *root = Settings->hosts[0].root_path;
+    Request request  = {.fd = -1, .path_fd = -1, .uri = uri};
+    if (resolve_request_path(&request) == HTTP_STATUS_OK)
+        check_beneath(request.path, root);
+    request.uri = NULL;
+    clear_request(&request);
+
+    char *real = determine_request_path(root, uri);
+    check_beneath(real, root);
+    free(real);
+
+    free(uri);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
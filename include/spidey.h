@@ -3,11 +3,15 @@
 
 #pragma once
 
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
@@ -20,15 +24,118 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    PREFORK,                            /**< Fixed pool of worker processes */
     UNKNOWN
 } ServerMode;
 
-/* Global Variables */
+/* Configuration */
 
-extern char *Port;                      /**< Port number */
-extern char *MimeTypesPath;             /**< Path to mime.types file */
-extern char *DefaultMimeType;           /**< Default file mimetype */
-extern char *RootPath;                  /**< Path to root directory */
+#define CONFIG_MAX_LISTENERS 16
+#define CONFIG_MAX_SOCKETS 64
+#define CONFIG_MAX_RATE_LIMITS 16
+#define CONFIG_MAX_MIME_TYPES 16
+#define CONFIG_MAX_HOSTS 32
+#define CONFIG_MAX_PROXIES 8
+#define CONFIG_MAX_UPSTREAMS 8
+
+/**
+ * Load balancing policies
+ */
+typedef enum {
+    BALANCE_ROUND_ROBIN,                /**< Each upstream in turn */
+    BALANCE_LEAST_CONNECTIONS,          /**< Upstream with fewest requests in flight */
+} Balance;
+
+typedef struct {
+    char       *prefix;                 /*< URI prefix the limit applies to */
+    int         rate;                   /*< Requests per second per client */
+    int         burst;                  /*< Requests a client may make at once */
+} RateLimit;
+
+typedef struct {
+    char       *extension;              /*< File extension (without '.') */
+    char       *type;                   /*< Mimetype of files with extension */
+} MimeType;
+
+typedef struct {
+    char       *prefix;                 /*< URI prefix forwarded upstream */
+    char       *upstreams[CONFIG_MAX_UPSTREAMS];    /*< Upstream addresses (allocated with prefix) */
+    int         nupstreams;             /*< Number of upstream addresses */
+} ProxyRoute;
+
+typedef struct {
+    int         index;                  /*< Index in Config hosts (0 = default) */
+    char       *names;                  /*< Host names (separated by spaces) */
+    char       *root;                   /*< Root directory (as configured) */
+    char       *root_path;              /*< Real path to root directory */
+    char       *bundle;                 /*< Asset bundle served before root (or NULL) */
+    char       *default_mime_type;      /*< Default file mimetype */
+    MimeType    mime_types[CONFIG_MAX_MIME_TYPES];      /*< Mimetype overrides */
+    int         nmime_types;            /*< Number of mimetype overrides */
+    RateLimit   rate_limits[CONFIG_MAX_RATE_LIMITS];    /*< Per-route client rate limits */
+    int         nrate_limits;           /*< Number of rate limits */
+    ProxyRoute  proxies[CONFIG_MAX_PROXIES];        /*< Routes forwarded to upstream servers */
+    int         nproxies;               /*< Number of proxied routes */
+} VirtualHost;
+
+typedef struct {
+    const char *name;                   /*< Host name (NULL = unused slot) */
+    size_t      length;                 /*< Length of host name */
+    int         host;                   /*< Index of virtual host */
+} HostName;
+
+typedef struct {
+    ServerMode  mode;                   /*< Concurrency mode */
+    int         workers;                /*< Worker processes in prefork mode */
+    char       *listeners[CONFIG_MAX_LISTENERS];   /*< Listen addresses */
+    int         nlisteners;             /*< Number of listen addresses */
+    int         backlog;                /*< Listen backlog */
+    VirtualHost hosts[CONFIG_MAX_HOSTS];/*< Default host and virtual hosts */
+    int         nhosts;                 /*< Number of hosts */
+    HostName   *host_names;             /*< Hash table of virtual host names */
+    size_t      host_names_size;        /*< Size of host name table (power of 2) */
+    char       *mime_types;             /*< Path to mime.types file */
+    int         keepalive_timeout;      /*< Seconds to wait for next request */
+    int         request_buffer;         /*< Longest request or header line */
+    int         stream_chunk_size;      /*< Bytes coalesced per body write */
+    int         stream_flush_ms;        /*< Longest time body data is held */
+    int         path_cache_size;        /*< Cached URI normalizations (0 = none) */
+    int         max_connections;        /*< Concurrent connection limit (0 = none) */
+    int         max_requests;           /*< In-flight request limit (0 = none) */
+    int         max_dynamic_requests;   /*< In-flight CGI and proxied request limit (0 = none) */
+    int         max_queue_time;         /*< Accept to dispatch limit in ms (0 = none) */
+    int         retry_after;            /*< Seconds clients should wait after 503 */
+    int         drain_timeout;          /*< Seconds to drain connections on SIGTERM */
+    int         rate_limit_table;       /*< Token buckets shared by all clients */
+    int         cache_size;             /*< Bytes of cache shared by all workers (0 = none) */
+    int         cache_max_file;         /*< Largest file or listing cached */
+    uint64_t    generation;             /*< Distinguishes configurations in the cache */
+    Balance     proxy_balance;          /*< How requests are spread over upstreams */
+    int         proxy_timeout;          /*< Seconds to wait for an upstream */
+    int         proxy_fail_timeout;     /*< Seconds a failed upstream is skipped */
+    int         proxy_idle_timeout;     /*< Seconds an idle upstream connection is kept */
+    int         proxy_pool_size;        /*< Idle upstream connections kept per process */
+    int         pool_idle_buffers;      /*< Idle buffers of each size kept per process */
+    bool        reuse_address;          /*< SO_REUSEADDR on listening sockets */
+    bool        reuse_port;             /*< SO_REUSEPORT on listening sockets */
+    bool        tcp_nodelay;            /*< Disable Nagle on client sockets */
+    bool        tcp_cork;               /*< Cork client sockets while sending a response */
+    int         tcp_defer_accept;       /*< Seconds to wait for data before accept (0 = off) */
+    int         tcp_fastopen;           /*< TCP Fast Open queue length (0 = off) */
+    int         send_buffer;            /*< SO_SNDBUF in bytes (0 = kernel default) */
+    int         receive_buffer;         /*< SO_RCVBUF in bytes (0 = kernel default) */
+    int         busy_poll;              /*< SO_BUSY_POLL in microseconds (0 = off) */
+    int         slow_request_ms;        /*< Log phase timings of slower requests (0 = off) */
+    bool        cpu_affinity;           /*< Pin prefork workers to CPUs */
+    bool        node_listeners;         /*< Listening socket per NUMA node */
+    char       *cpu_topology;           /*< CPUs of each node (NULL = from sysfs) */
+} Config;
+
+extern const Config *Settings;          /**< Current configuration */
+
+Config *    config_load(int argc, char *argv[]);
+void        config_free(const Config *config);
+const VirtualHost *virtual_host(const char *name);
 
 /* Logging Macros */
 
@@ -41,62 +148,392 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
-/* HTTP Request */
+/* HTTP Status */
+
+typedef enum {
+    HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_MOVED_PERMANENTLY,	/* 301 Moved Permanently */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
+    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
+    HTTP_STATUS_FORBIDDEN,		/* 403 Forbidden */
+    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_METHOD_NOT_ALLOWED,	/* 405 Method Not Allowed */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
+    HTTP_STATUS_URI_TOO_LONG,		/* 414 URI Too Long */
+    HTTP_STATUS_RANGE_NOT_SATISFIABLE,	/* 416 Range Not Satisfiable */
+    HTTP_STATUS_TOO_MANY_REQUESTS,	/* 429 Too Many Requests */
+    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_GATEWAY_TIMEOUT,	/* 504 Gateway Timeout */
+    HTTP_STATUS_COUNT
+} Status;
+
+/* HTTP Request Headers */
 
-typedef struct header Header;
-struct header {
+typedef enum {
+    HEADER_ACCEPT = 0,                  /* Accept */
+    HEADER_ACCEPT_ENCODING,             /* Accept-Encoding */
+    HEADER_ACCEPT_LANGUAGE,             /* Accept-Language */
+    HEADER_AUTHORIZATION,               /* Authorization */
+    HEADER_CACHE_CONTROL,               /* Cache-Control */
+    HEADER_CONNECTION,                  /* Connection */
+    HEADER_CONTENT_LENGTH,              /* Content-Length */
+    HEADER_CONTENT_TYPE,                /* Content-Type */
+    HEADER_COOKIE,                      /* Cookie */
+    HEADER_EXPECT,                      /* Expect */
+    HEADER_HOST,                        /* Host */
+    HEADER_IF_MODIFIED_SINCE,           /* If-Modified-Since */
+    HEADER_IF_NONE_MATCH,               /* If-None-Match */
+    HEADER_IF_RANGE,                    /* If-Range */
+    HEADER_RANGE,                       /* Range */
+    HEADER_REFERER,                     /* Referer */
+    HEADER_TRANSFER_ENCODING,           /* Transfer-Encoding */
+    HEADER_UPGRADE,                     /* Upgrade */
+    HEADER_USER_AGENT,                  /* User-Agent */
+    HEADER_X_FORWARDED_FOR,             /* X-Forwarded-For */
+    HEADER_OTHER                        /* Any other header */
+} HeaderId;
+
+#define REQUEST_MAX_HEADERS 64
+
+typedef struct {
+    HeaderId id;                        /*< Well-known header (or HEADER_OTHER) */
     char    *name;                      /*< Name of header entry */
-    char    *value;                     /*< Value of header entry */
-    Header  *next;                      /*< Next header entry */
-};
+    char    *value;                     /*< Value of header entry (stored after name) */
+} Header;
+
+HeaderId    header_id(const char *name, size_t length);
+
+/* HTTP Request */
+
+/**
+ * Request phases timed when built with SPIDEY_TRACE
+ */
+typedef enum {
+    TRACE_ACCEPT,                       /**< Request began arriving */
+    TRACE_LOOKUP,                       /**< Client address looked up */
+    TRACE_PARSE,                        /**< Request line and headers parsed */
+    TRACE_ROUTE,                        /**< Host, rate limit and route checked */
+    TRACE_RESOLVE,                      /**< Request path resolved */
+    TRACE_MIMETYPE,                     /**< Mimetype determined */
+    TRACE_UPSTREAM,                     /**< Upstream connection ready */
+    TRACE_RESPONSE,                     /**< Response head sent */
+    TRACE_DONE,                         /**< Request handled */
+    TRACE_COUNT
+} TracePhase;
 
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
+    char    *input;                     /*< Received data (pooled, or NULL while idle) */
+    size_t   input_size;                /*< Size of input buffer */
+    size_t   input_start;               /*< Offset of first unread byte */
+    size_t   input_end;                 /*< Offset after last received byte */
+    int      input_error;               /*< errno of failed receive (0 = none) */
+    void    *strings;                   /*< Pooled blocks holding the strings below */
+    size_t   strings_used;              /*< Bytes used in newest block */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
+    char    *path;                      /*< Real path corrsponding to URI and root */
+    int      path_fd;                   /*< Descriptor opened on path (or -1) */
     char    *query;                     /*< HTTP query string */
+    int      http_minor;                /*< HTTP minor version (HTTP/1.x) */
+    bool     keep_alive;                /*< Whether connection can be reused */
+    long     accepted;                  /*< Time (ms) request began arriving */
 
     char     host[NI_MAXHOST];          /*< Host name of client */
     char     port[NI_MAXSERV];          /*< Port number of client */
+    char     server_port[NI_MAXSERV];   /*< Port number connection arrived on */
+    bool     tcp;                       /*< Whether client connected over TCP */
+    uint64_t client;                    /*< Rate limiting key of client address */
+    const VirtualHost *vhost;           /*< Virtual host selected by Host header */
 
-    Header  *headers;                   /*< List of name, value Header pairs */
+    Header   headers[REQUEST_MAX_HEADERS];  /*< Headers in order received */
+    int      nheaders;                  /*< Number of headers */
+    unsigned char known[HEADER_OTHER];  /*< Index + 1 of first header with each id */
+#ifdef SPIDEY_TRACE
+    uint64_t trace[TRACE_COUNT];        /*< Time (ns) each phase was reached (0 = not) */
+#endif
 } Request;
 
 Request *   accept_request(int sfd);
 void	    free_request(Request *request);
-int	    parse_request(Request *request);
+void        clear_request(Request *request);
+Status	    parse_request(Request *request);
+Status      parse_request_buffer(Request *request, const char *data, size_t length);
+int	    reset_request(Request *request);
+void        drop_request_input(Request *request);
+char *      request_gets(Request *request, char *buffer, int size);
+ssize_t     request_read(Request *request, void *buffer, size_t n);
+void *      request_alloc(Request *request, size_t size);
+const char *request_header(const Request *request, HeaderId id);
 
-/* HTTP Request Handlers */
+/* Request Tracing */
 
-typedef enum {
-    HTTP_STATUS_OK = 0,			/* 200 OK */
-    HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
-    HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
-    HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
-} Status;
+#ifdef SPIDEY_TRACE
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define trace_probe(r, phase)   DTRACE_PROBE3(spidey, phase, (r)->fd, (r)->uri, (r)->trace[TRACE_##phase])
+#endif
+#endif
+#ifndef trace_probe
+#define trace_probe(r, phase)
+#endif
+#define trace(r, phase) \
+    do { if (!(r)->trace[TRACE_##phase]) { (r)->trace[TRACE_##phase] = trace_clock(); trace_probe(r, phase); } } while (0)
+#define trace_reset(r)  memset((r)->trace, 0, sizeof((r)->trace))
+#define trace_report(r) trace_slow_request(r)
+#else
+#define trace(r, phase)
+#define trace_reset(r)
+#define trace_report(r)
+#endif
+
+uint64_t    trace_clock(void);
+void        trace_slow_request(const Request *request);
+
+/* HTTP Request Handlers */
 
 Status      handle_request(Request *request);
+Status      handle_error(Request *request, Status status);
+void        handle_connection(Request *request);
+
+/* Admission Control */
+
+int         admission_init(void);
+bool        admit_request(Request *request, bool dynamic);
+void        release_request(bool dynamic);
+void        reject_connection(Request *request);
+
+/* Rate Limiting */
+
+int         rate_limit_init(void);
+uint64_t    rate_limit_key(const struct sockaddr *addr);
+int         rate_limit_check(Request *request);
+
+/* Reverse Proxy */
+
+#define PROXY_POOL_MAX      256         /* Largest configurable proxy_pool_size */
+
+int         proxy_init(void);
+const ProxyRoute *proxy_route(const Request *request);
+Status      handle_proxy_request(Request *request, const ProxyRoute *route);
+
+/* Shared Cache */
+
+#define CACHE_MAX_KEY       256         /* Longest cached key */
+#define CACHE_MAX_VALUE     65536       /* Largest configurable cache_max_file */
+
+typedef struct {
+    uint64_t    generation;             /*< Configuration the value was derived with */
+    uint64_t    device;                 /*< Device of source file (0 = none) */
+    uint64_t    inode;                  /*< Inode of source file */
+    int64_t     size;                   /*< Size of source file */
+    int64_t     mtime;                  /*< Modification time of source file (ns) */
+} CacheStamp;
+
+int         cache_init(void);
+void        cache_stamp(CacheStamp *stamp, const struct stat *s);
+ssize_t     cache_get(const void *key, size_t key_length, const CacheStamp *stamp, void *value, size_t size);
+void        cache_put(const void *key, size_t key_length, const CacheStamp *stamp, const void *value, size_t length);
+
+/* Buffer Pool */
+
+#define POOL_MIN_SIZE       4096        /* Smallest buffer (one page) */
+#define POOL_MAX_IDLE       256         /* Largest configurable pool_idle_buffers */
+#define POOL_IDLE_MS        1000        /* Idle time before idle buffers are released */
+
+size_t      pool_size(size_t size);
+void *      pool_get(size_t size);
+void        pool_put(void *buffer, size_t size);
+bool        pool_dirty(void);
+void        pool_trim(void);
+
+/* HTTP Error Pages */
+
+typedef struct {
+    char   *head;                       /*< Preformatted entity headers */
+    size_t  head_length;                /*< Length of entity headers */
+    char   *body;                       /*< Error page body */
+    size_t  body_length;                /*< Length of error page body */
+} ErrorPage;
+
+void            load_error_pages(const char *root);
+const ErrorPage *error_page(Status status);
+
+/* HTTP Response */
+
+#define RESPONSE_MAX_IOV    48
+
+typedef struct {
+    Request     *request;               /*< Request being responded to */
+    struct iovec iov[RESPONSE_MAX_IOV]; /*< Gathered header and body fragments */
+    int          iovcnt;                /*< Number of fragments gathered */
+    char         length[48];            /*< Formatted Content-Length header */
+    bool         error;                 /*< Whether too many fragments were added */
+} Response;
+
+#define response_static(res, s)     response_append((res), (s), sizeof(s) - 1)
+
+void        response_init(Response *res, Request *request, Status status);
+void        response_init_text(Response *res, Request *request, const char *status);
+void        response_append(Response *res, const void *data, size_t n);
+void        response_header(Response *res, const char *name, const char *value);
+void        response_content_length(Response *res, size_t length);
+void        response_end_headers(Response *res);
+int         response_send(Response *res, bool more);
+
+/* HTTP Response Body Stream */
+
+#define STREAM_CHUNK_SIZE   65536       /* Largest configurable stream_chunk_size */
+#define STREAM_MAX_TRAILERS 4
+
+typedef struct {
+    Request  *request;                  /*< Request being responded to */
+    Response *response;                 /*< Response head not yet sent */
+    bool      chunked;                  /*< Whether chunked encoding is used */
+    bool      error;                    /*< Whether a write has failed */
+    char      buffer[STREAM_CHUNK_SIZE];/*< Pending body data */
+    size_t    length;                   /*< Number of bytes pending */
+    long      deadline;                 /*< Time (ms) pending data is flushed */
+    ssize_t   remaining;                /*< Bytes of known-length body left */
+    struct {
+        const char *name;
+        char        value[128];
+    }         trailers[STREAM_MAX_TRAILERS];
+    size_t    ntrailers;                /*< Number of trailers recorded */
+} Stream;
+
+void        stream_open(Stream *s, Response *res, ssize_t length);
+int         stream_write(Stream *s, const void *data, size_t n);
+int         stream_puts(Stream *s, const char *str);
+int         stream_flush(Stream *s);
+int         stream_timeout(Stream *s);
+void        stream_trailer(Stream *s, const char *name, const char *value);
+int         stream_close(Stream *s);
+
+/* Asset Bundles */
+
+#define BUNDLE_MAGIC        "SPIDEYB1"  /* First 8 bytes of a bundle (see bin/build_bundle.py) */
+
+typedef struct {
+    char        magic[8];               /*< BUNDLE_MAGIC */
+    uint32_t    count;                  /*< Number of entries */
+    uint32_t    reserved;               /*< Zero */
+    uint64_t    size;                   /*< Size of bundle in bytes */
+} BundleHeader;
+
+typedef struct {
+    uint32_t    path;                   /*< Offset of normalized path (NUL-terminated) */
+    uint32_t    etag;                   /*< Offset of ETag (NUL-terminated) */
+    uint32_t    head;                   /*< Offset of entity headers */
+    uint32_t    head_length;            /*< Length of entity headers */
+    uint64_t    body;                   /*< Offset of body */
+    uint64_t    body_length;            /*< Length of body */
+    uint64_t    gzip;                   /*< Offset of gzip encoded body */
+    uint64_t    gzip_length;            /*< Length of gzip encoded body (0 = none) */
+} BundleEntry;
+
+typedef struct {
+    const char        *data;            /*< Mapped bundle (NULL if none) */
+    size_t             size;            /*< Size of mapping */
+    const BundleEntry *entries;         /*< Entries sorted by path */
+    uint32_t           count;           /*< Number of entries */
+} Bundle;
+
+int         bundle_open(const char *path, Bundle *bundle);
+void        bundle_close(Bundle *bundle);
+const BundleEntry *bundle_lookup(const Bundle *bundle, const char *uri);
+Status      handle_bundle_request(Request *request, const Bundle *bundle, const BundleEntry *entry);
+
+/* Request Path Resolution */
+
+#define PATH_CACHE_URI      256         /* Longest URI that is cached */
+
+int         open_roots(const Config *config);
+const Bundle *root_bundle(const VirtualHost *host);
+int         normalize_uri(const char *uri, char *out, size_t size);
+int         match_uri_prefix(const char *path, const char *prefix);
+Status      resolve_request_path(Request *request);
 
 /* HTTP Server */
 
-int         single_server(int sfd);
-int         forking_server(int sfd);
+int         single_server(const int *sfds, int nsfds);
+int         forking_server(const int *sfds, int nsfds);
+int         prefork_server(const int *sfds, const int *nodes, int nsfds);
+
+/* Worker Processes */
+
+int         add_worker(pid_t pid, int cpu);
+void        reap_workers(void);
+size_t      worker_count(bool current);
+void        worker_load(int *load, int ncpus);
+void        retire_workers(void);
+void        drain_workers(void);
+
+/* CPU Topology */
+
+#define TOPOLOGY_MAX_CPUS   1024
+#define TOPOLOGY_MAX_NODES  64
+
+typedef struct {
+    int         cpus[TOPOLOGY_MAX_CPUS];    /*< CPUs workers may run on (by node) */
+    int         node[TOPOLOGY_MAX_CPUS];    /*< Node index of each CPU */
+    int         ncpus;                      /*< Number of CPUs */
+    int         numa[TOPOLOGY_MAX_NODES];   /*< NUMA node id of each node (-1 = unknown) */
+    int         nnodes;                     /*< Number of nodes with CPUs */
+} Topology;
+
+extern Topology Machine;                /**< CPUs and nodes of this machine */
+
+int         topology_parse(Topology *t, const char *nodes, const uint64_t *allowed);
+int         topology_load(Topology *t, const char *nodes);
+int         topology_place(const Topology *t, const int *load);
+void        topology_bind(const Topology *t, int cpu);
+int         topology_steer(const Topology *t, int fd);
+
+/* Server Control */
+
+extern volatile sig_atomic_t Draining;  /**< Set once SIGTERM is received */
+
+void        control_init(int argc, char *argv[]);
+void        control_worker(void);
+int         inherit_sockets(int *fds, int max);
+void        announce_ready(void);
+int         reload_server(void);
+pid_t       upgrade_server(const int *sfds, int nsfds);
+int         wait_for_connection(const int *sfds, int nsfds);
+int         wait_for_signal(const int *sfds, int nsfds);
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+int	    socket_listen(const char *address, int *inherited, int ninherited);
+int         socket_connect(const char *address, int timeout);
+int         socket_accept(int sfd, struct sockaddr *addr, socklen_t *addrlen);
+void        socket_cork(Request *request, bool cork);
+
+/* Delimiter Scanning */
+
+const char *scan_init(void);
+char *      scan_delimiter(const char *s, char a, char b);
+char *      scan_whitespace(const char *s);
+char *      scan_text(const char *s);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
+#define strieq(a, b) (strcasecmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+const char *determine_mimetype(const VirtualHost *host, const char *path, char *buffer, size_t size);
+char *	    determine_request_path(const char *root, const char *uri);
 const char *http_status_string(Status status);
+long        monotonic_ms(void);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
+size_t      format_unsigned(char *buffer, unsigned long long value, unsigned base);
+int         send_iovec(int fd, struct iovec *iov, int iovcnt, bool more);
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,124 @@
+/* admission.c: Admission Control and Load Shedding */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/* In-flight request counters shared by all worker processes */
+typedef struct {
+    atomic_int  requests;               /*< Requests being handled */
+    atomic_int  dynamic;                /*< CGI requests being handled */
+} AdmissionCounters;
+
+static AdmissionCounters *Counters = NULL;
+
+/**
+ * Allocate admission counters in memory shared with forked workers.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any worker processes are forked.
+ **/
+int admission_init(void) {
+    Counters = mmap(NULL, sizeof(AdmissionCounters), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Counters == MAP_FAILED) {
+        fprintf(stderr, "Error with mmap: %s\n", strerror(errno));
+        Counters = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Decide whether to dispatch request or shed it.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   dynamic     Whether request is for a CGI script or upstream.
+ * @return  true if the request was admitted (and must later be released with
+ *          release_request) and false if it should be rejected with 503.
+ *
+ * Requests are shed when they waited longer than max_queue_time between
+ * arriving and being dispatched, or when max_requests are already in flight.
+ * A request arrives when it is accepted, or when its first byte is received
+ * if the client only sent it later (see request_fill).  CGI and proxied
+ * requests form a lower priority class limited to max_dynamic_requests so
+ * that static files keep being served while scripts and upstreams are shed
+ * first.
+ **/
+bool admit_request(Request *r, bool dynamic) {
+    long queued = monotonic_ms() - r->accepted;
+    debug("Queue time: %ld ms", queued);
+
+    if (Settings->max_queue_time > 0 && queued > Settings->max_queue_time) {
+        log("Shedding request queued for %ld ms", queued);
+        goto shed;
+    }
+
+    if (!Counters)
+        return true;
+
+    int requests = atomic_fetch_add(&Counters->requests, 1) + 1;
+    if (Settings->max_requests > 0 && requests > Settings->max_requests) {
+        atomic_fetch_sub(&Counters->requests, 1);
+        log("Shedding request: %d requests in flight", requests - 1);
+        goto shed;
+    }
+
+    if (dynamic) {
+        int active = atomic_fetch_add(&Counters->dynamic, 1) + 1;
+        if (Settings->max_dynamic_requests > 0 && active > Settings->max_dynamic_requests) {
+            atomic_fetch_sub(&Counters->dynamic, 1);
+            atomic_fetch_sub(&Counters->requests, 1);
+            log("Shedding CGI request: %d CGI requests in flight", active - 1);
+            goto shed;
+        }
+    }
+
+    return true;
+
+shed:
+    r->keep_alive = false;
+    return false;
+}
+
+/**
+ * Release request previously admitted by admit_request.
+ *
+ * @param   dynamic     Whether request was for a CGI script or upstream.
+ **/
+void release_request(bool dynamic) {
+    if (!Counters)
+        return;
+
+    atomic_fetch_sub(&Counters->requests, 1);
+    if (dynamic)
+        atomic_fetch_sub(&Counters->dynamic, 1);
+}
+
+/**
+ * Reject connection immediately with 503 Service Unavailable.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * This is used when a connection cannot be handed to a worker at all.  Any
+ * request data that has already arrived is discarded without waiting so the
+ * response is not lost to a reset, and the request is not parsed.
+ **/
+void reject_connection(Request *r) {
+    char buffer[BUFSIZ];
+
+    while (recv(r->fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+
+    r->keep_alive = false;
+    handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+    shutdown(r->fd, SHUT_WR);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
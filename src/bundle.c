@@ -0,0 +1,241 @@
+/* bundle.c: Memory-mapped Asset Bundles */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Check that a NUL-terminated string lies within the bundle.
+ *
+ * @param   bundle      Bundle being opened.
+ * @param   offset      Offset of string.
+ * @return  Whether string and its terminator are inside the mapping.
+ **/
+static bool bundle_string(const Bundle *bundle, uint64_t offset) {
+    return offset < bundle->size && memchr(bundle->data + offset, '\0', bundle->size - offset);
+}
+
+/**
+ * Check that a range of bytes lies within the bundle.
+ *
+ * @param   bundle      Bundle being opened.
+ * @param   offset      Offset of range.
+ * @param   length      Length of range.
+ * @return  Whether range is inside the mapping.
+ **/
+static bool bundle_range(const Bundle *bundle, uint64_t offset, uint64_t length) {
+    return offset <= bundle->size && length <= bundle->size - offset;
+}
+
+/**
+ * Map asset bundle built by bin/build_bundle.py.
+ *
+ * @param   path        Path to bundle.
+ * @param   bundle      Bundle structure to fill in.
+ * @return  -1 on error and 0 on success.
+ *
+ * The whole index is validated here (offsets inside the file, paths in
+ * sorted order), so requests can be served from the mapping without any
+ * further checks.  The mapping is read-only and shared with forked workers
+ * through the page cache.
+ **/
+int bundle_open(const char *path, Bundle *bundle) {
+    struct stat s;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    *bundle = (Bundle){0};
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        fprintf(stderr, "Error opening bundle %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if ((size_t)s.st_size < sizeof(BundleHeader)) {
+        fprintf(stderr, "Invalid bundle %s: too short\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error with mmap: %s\n", strerror(errno));
+        return -1;
+    }
+    madvise(data, s.st_size, MADV_WILLNEED);
+
+    const BundleHeader *header = data;
+    bundle->data    = data;
+    bundle->size    = s.st_size;
+    bundle->entries = (const BundleEntry *)(header + 1);
+    bundle->count   = header->count;
+
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || header->size != bundle->size ||
+        !bundle_range(bundle, sizeof(BundleHeader), (uint64_t)bundle->count * sizeof(BundleEntry)))
+        goto invalid;
+
+    for (uint32_t i = 0; i < bundle->count; i++) {
+        const BundleEntry *entry = &bundle->entries[i];
+        if (!bundle_string(bundle, entry->path) || !bundle_string(bundle, entry->etag) ||
+            !bundle_range(bundle, entry->head, entry->head_length) ||
+            !bundle_range(bundle, entry->body, entry->body_length) ||
+            !bundle_range(bundle, entry->gzip, entry->gzip_length))
+            goto invalid;
+        if (i > 0 && strcmp(bundle->data + bundle->entries[i - 1].path, bundle->data + entry->path) >= 0)
+            goto invalid;
+    }
+
+    log("Mapped bundle %s (%u assets, %zu bytes)", path, bundle->count, bundle->size);
+    return 0;
+
+invalid:
+    fprintf(stderr, "Invalid bundle %s: bad header or index\n", path);
+    bundle_close(bundle);
+    return -1;
+}
+
+/**
+ * Unmap asset bundle.
+ *
+ * @param   bundle      Bundle structure (cleared).
+ **/
+void bundle_close(Bundle *bundle) {
+    if (bundle->data)
+        munmap((void *)bundle->data, bundle->size);
+    *bundle = (Bundle){0};
+}
+
+/**
+ * Find asset for request URI.
+ *
+ * @param   bundle      Mapped bundle.
+ * @param   uri         Request URI (without query).
+ * @return  Entry for the URI (or NULL if the bundle does not have it).
+ *
+ * The URI is normalized as for files (see normalize_uri), and then found by
+ * binary search over the sorted paths.
+ **/
+const BundleEntry * bundle_lookup(const Bundle *bundle, const char *uri) {
+    char path[PATH_MAX];
+
+    if (normalize_uri(uri, path, sizeof(path)) < 0)
+        return NULL;
+
+    uint32_t low  = 0;
+    uint32_t high = bundle->count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        int      order  = strcmp(path, bundle->data + bundle->entries[middle].path);
+        if (order == 0)
+            return &bundle->entries[middle];
+        if (order < 0)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return NULL;
+}
+
+/**
+ * Check whether If-None-Match header matches ETag.
+ *
+ * @param   list        If-None-Match header value (or NULL).
+ * @param   etag        ETag of asset.
+ * @return  Whether the client already has the asset.
+ *
+ * ETags are compared weakly, ignoring any W/ prefix.
+ **/
+static bool bundle_etag_matches(const char *list, const char *etag) {
+    if (!list)
+        return false;
+    if (strncmp(etag, "W/", 2) == 0)
+        etag += 2;
+
+    size_t length = strlen(etag);
+    while (*list) {
+        list += strspn(list, ", \t");
+        if (*list == '*')
+            return true;
+        if (strncmp(list, "W/", 2) == 0)
+            list += 2;
+        size_t n = strcspn(list, ", \t");
+        if (n == length && strncmp(list, etag, length) == 0)
+            return true;
+        list += n;
+    }
+    return false;
+}
+
+/**
+ * Check whether Accept-Encoding header allows gzip.
+ *
+ * @param   list        Accept-Encoding header value (or NULL).
+ * @return  Whether gzip is listed without q=0.
+ **/
+static bool bundle_accepts_gzip(const char *list) {
+    while (list && *list) {
+        list += strspn(list, ", \t");
+        size_t n = strcspn(list, ",; \t");
+        if (n == 4 && strncasecmp(list, "gzip", 4) == 0) {
+            const char *q = strstr(list, "q=");
+            const char *end = list + strcspn(list, ",");
+            return !q || q > end || strtod(q + 2, NULL) > 0;
+        }
+        list += strcspn(list, ",");
+    }
+    return false;
+}
+
+/**
+ * Handle request for asset in bundle.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   bundle      Mapped bundle.
+ * @param   entry       Asset found by bundle_lookup.
+ * @return  Status of the HTTP bundle request.
+ *
+ * The status line, precomputed entity headers, and body (gzip encoded if the
+ * client accepts it and the bundle has that variant) are sent straight from
+ * the mapping in a single system call.  Requests with a matching
+ * If-None-Match get 304 Not Modified.
+ **/
+Status handle_bundle_request(Request *r, const Bundle *bundle, const BundleEntry *entry) {
+    log("HANDLE BUNDLE REQUEST");
+    const char *etag = bundle->data + entry->etag;
+    Response response;
+
+    if (bundle_etag_matches(request_header(r, HEADER_IF_NONE_MATCH), etag)) {
+        response_init(&response, r, HTTP_STATUS_NOT_MODIFIED);
+        response_header(&response, "ETag", etag);
+        response_end_headers(&response);
+        response_send(&response, false);
+        return HTTP_STATUS_NOT_MODIFIED;
+    }
+
+    bool gzip = entry->gzip_length > 0 && bundle_accepts_gzip(request_header(r, HEADER_ACCEPT_ENCODING));
+    const char *body   = bundle->data + (gzip ? entry->gzip : entry->body);
+    size_t      length = gzip ? entry->gzip_length : entry->body_length;
+
+    response_init(&response, r, HTTP_STATUS_OK);
+    response_append(&response, bundle->data + entry->head, entry->head_length);
+    if (gzip)
+        response_static(&response, "Content-Encoding: gzip\r\n");
+    response_content_length(&response, length);
+    response_end_headers(&response);
+    if (!streq(r->method, "HEAD"))
+        response_append(&response, body, length);
+    response_send(&response, false);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
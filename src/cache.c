@@ -0,0 +1,279 @@
+/* cache.c: Shared Metadata and Small File Cache */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Index entries per set (one set fills a cache line) */
+#define CACHE_WAYS          8
+
+/* Index entries are a tag from the key hash above the size class and slot */
+#define CACHE_INDEX_BITS    22
+#define CACHE_CLASS_BITS    2
+#define CACHE_REF_MASK      ((1ULL << (CACHE_INDEX_BITS + CACHE_CLASS_BITS)) - 1)
+#define CACHE_CLASSES       (1 << CACHE_CLASS_BITS)
+
+typedef struct {
+    _Atomic uint64_t seq;               /*< Odd while the slot is being written */
+    uint64_t    hash;                   /*< Hash of key */
+    CacheStamp  stamp;                  /*< Validator of value */
+    _Atomic uint32_t key_length;        /*< Length of key */
+    _Atomic uint32_t length;            /*< Length of value */
+    char        data[];                 /*< Key followed by value */
+} CacheSlot;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t entries[CACHE_WAYS];
+} CacheSet;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t cursor;   /*< Next slot to be reused */
+} CacheCursor;
+
+typedef struct {
+    char       *slots;                  /*< Slab of equally sized slots */
+    size_t      size;                   /*< Size of each slot */
+    size_t      count;                  /*< Number of slots */
+} CacheClass;
+
+/* Slot sizes of the slabs (the largest holds any value up to CACHE_MAX_VALUE) */
+static const size_t CacheSizes[CACHE_CLASSES] = {
+    1024, 4096, 16384, sizeof(CacheSlot) + CACHE_MAX_KEY + CACHE_MAX_VALUE,
+};
+
+/* Index, cursors, and slabs shared by all worker processes */
+static CacheSet    *Sets     = NULL;
+static size_t       SetsMask = 0;
+static CacheCursor *Cursors  = NULL;
+static CacheClass   Classes[CACHE_CLASSES];
+
+/**
+ * Hash key (FNV-1a followed by the splitmix64 finalizer).
+ *
+ * @param   key         Key bytes.
+ * @param   length      Length of key.
+ * @return  Well-distributed hash of key.
+ **/
+static uint64_t cache_hash(const unsigned char *key, size_t length) {
+    uint64_t x = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++)
+        x = (x ^ key[i]) * 0x100000001b3ULL;
+
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * Compute index tag of hash (never 0, which marks an unused entry).
+ **/
+static inline uint64_t cache_tag(uint64_t hash) {
+    return (hash | 1ULL << 63) & ~CACHE_REF_MASK;
+}
+
+/**
+ * Find slot referenced by index entry.
+ **/
+static inline CacheSlot * cache_slot(uint64_t entry, size_t *size) {
+    const CacheClass *class = &Classes[(entry >> CACHE_INDEX_BITS) & (CACHE_CLASSES - 1)];
+    size_t index = entry & ((1ULL << CACHE_INDEX_BITS) - 1);
+
+    if (index >= class->count)
+        return NULL;
+    *size = class->size;
+    return (CacheSlot *)(class->slots + index * class->size);
+}
+
+/**
+ * Allocate cache in memory shared with forked workers.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The cache_size bytes are split evenly between slabs of 1K, 4K, 16K and 64K
+ * slots, plus an index with two entries for every slot.  Pages are only
+ * touched as the cache fills.  Like the rate limiting table, the cache is
+ * allocated once before forking, so a change of cache_size takes effect on
+ * upgrade.
+ **/
+int cache_init(void) {
+    size_t share = (size_t)Settings->cache_size / CACHE_CLASSES;
+    size_t slots = 0;
+    size_t sets  = 1;
+
+    if (share == 0)
+        return 0;
+
+    for (int c = 0; c < CACHE_CLASSES; c++) {
+        Classes[c].size  = (CacheSizes[c] + 63) & ~(size_t)63;
+        Classes[c].count = share / Classes[c].size;
+        if (Classes[c].count > 1ULL << CACHE_INDEX_BITS)
+            Classes[c].count = 1ULL << CACHE_INDEX_BITS;
+        slots += Classes[c].count;
+    }
+    while (sets * CACHE_WAYS < slots * 2)
+        sets <<= 1;
+
+    size_t size = sets * sizeof(CacheSet) + CACHE_CLASSES * sizeof(CacheCursor);
+    for (int c = 0; c < CACHE_CLASSES; c++)
+        size += Classes[c].count * Classes[c].size;
+
+    char *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "Error with mmap: %s\n", strerror(errno));
+        return -1;
+    }
+
+    Sets     = (CacheSet *)region;
+    SetsMask = sets - 1;
+    Cursors  = (CacheCursor *)(region + sets * sizeof(CacheSet));
+    region   = (char *)(Cursors + CACHE_CLASSES);
+    for (int c = 0; c < CACHE_CLASSES; c++) {
+        Classes[c].slots = region;
+        region += Classes[c].count * Classes[c].size;
+    }
+
+    debug("Cache: %zu slots, %zu sets", slots, sets);
+    return 0;
+}
+
+/**
+ * Make validator for value derived from file.
+ *
+ * @param   stamp       Validator to fill in.
+ * @param   s           Status of file (or NULL for values derived only from
+ *                      the configuration).
+ **/
+void cache_stamp(CacheStamp *stamp, const struct stat *s) {
+    memset(stamp, 0, sizeof(CacheStamp));
+    stamp->generation = Settings->generation;
+    if (s) {
+        stamp->device = s->st_dev;
+        stamp->inode  = s->st_ino;
+        stamp->size   = s->st_size;
+        stamp->mtime  = (int64_t)s->st_mtim.tv_sec * 1000000000 + s->st_mtim.tv_nsec;
+    }
+}
+
+/**
+ * Copy value of key out of cache.
+ *
+ * @param   key         Key bytes.
+ * @param   key_length  Length of key.
+ * @param   stamp       Validator the value must have been stored with.
+ * @param   value       Buffer for value.
+ * @param   size        Size of buffer.
+ * @return  Length of value (or -1 if it is not cached, is stale, or does
+ *          not fit).
+ *
+ * Slots are protected by sequence numbers: the value is copied without
+ * locking and discarded if a writer reused the slot in the meantime.
+ **/
+ssize_t cache_get(const void *key, size_t key_length, const CacheStamp *stamp, void *value, size_t size) {
+    if (!Sets || key_length > CACHE_MAX_KEY)
+        return -1;
+
+    uint64_t  hash = cache_hash(key, key_length);
+    uint64_t  tag  = cache_tag(hash);
+    CacheSet *set  = &Sets[hash & SetsMask];
+
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        uint64_t entry = atomic_load_explicit(&set->entries[i], memory_order_acquire);
+        size_t   slot_size;
+
+        if ((entry & ~CACHE_REF_MASK) != tag)
+            continue;
+
+        CacheSlot *slot = cache_slot(entry, &slot_size);
+        if (!slot)
+            continue;
+
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq & 1)
+            return -1;
+
+        size_t length = atomic_load_explicit(&slot->length, memory_order_relaxed);
+        bool   valid  = slot->hash == hash && length <= size &&
+                        atomic_load_explicit(&slot->key_length, memory_order_relaxed) == key_length &&
+                        sizeof(CacheSlot) + key_length + length <= slot_size &&
+                        memcmp(&slot->stamp, stamp, sizeof(CacheStamp)) == 0 &&
+                        memcmp(slot->data, key, key_length) == 0;
+        if (valid)
+            memcpy(value, slot->data + key_length, length);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (!valid || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue;
+        return length;
+    }
+    return -1;
+}
+
+/**
+ * Store value of key in cache.
+ *
+ * @param   key         Key bytes.
+ * @param   key_length  Length of key.
+ * @param   stamp       Validator of value.
+ * @param   value       Value bytes.
+ * @param   length      Length of value.
+ *
+ * The value is written to the next slot of the smallest size class that
+ * holds it, so each slab is reused in turn, oldest first.  If another process
+ * is writing that slot, the value is simply not cached.  The index entry then
+ * replaces an older entry for the same key, an unused entry, or an arbitrary
+ * one; entries left pointing to reused slots no longer match their key.
+ **/
+void cache_put(const void *key, size_t key_length, const CacheStamp *stamp, const void *value, size_t length) {
+    size_t needed = sizeof(CacheSlot) + key_length + length;
+    int    c      = 0;
+
+    if (!Sets || key_length > CACHE_MAX_KEY || length > CACHE_MAX_VALUE)
+        return;
+
+    while (c < CACHE_CLASSES && (Classes[c].count == 0 || Classes[c].size < needed))
+        c++;
+    if (c == CACHE_CLASSES)
+        return;
+
+    /* Claim slot by making its sequence number odd */
+    size_t     index = atomic_fetch_add_explicit(&Cursors[c].cursor, 1, memory_order_relaxed) % Classes[c].count;
+    CacheSlot *slot  = (CacheSlot *)(Classes[c].slots + index * Classes[c].size);
+    uint64_t   seq   = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    if ((seq & 1) || !atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1))
+        return;
+
+    uint64_t hash = cache_hash(key, key_length);
+    slot->hash  = hash;
+    slot->stamp = *stamp;
+    atomic_store_explicit(&slot->key_length, key_length, memory_order_relaxed);
+    atomic_store_explicit(&slot->length, length, memory_order_relaxed);
+    memcpy(slot->data, key, key_length);
+    memcpy(slot->data + key_length, value, length);
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+
+    /* Publish slot in index */
+    uint64_t  tag    = cache_tag(hash);
+    CacheSet *set    = &Sets[hash & SetsMask];
+    int       victim = index % CACHE_WAYS;
+
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        uint64_t entry = atomic_load_explicit(&set->entries[i], memory_order_relaxed);
+        if (entry == 0 || (entry & ~CACHE_REF_MASK) == tag) {
+            victim = i;
+            break;
+        }
+    }
+    atomic_store_explicit(&set->entries[victim], tag | (uint64_t)c << CACHE_INDEX_BITS | index, memory_order_release);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,743 @@
+/* config.c: Server Configuration */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#include <time.h>
+#include <unistd.h>
+
+/* Current configuration (never modified, only replaced as a whole) */
+const Config *Settings = NULL;
+
+/* Configuration option types */
+typedef enum {
+    CONFIG_INTEGER,
+    CONFIG_BOOLEAN,
+    CONFIG_STRING,
+    CONFIG_MODE,
+    CONFIG_LISTEN,
+    CONFIG_RATE_LIMIT,
+    CONFIG_MIME_TYPE,
+    CONFIG_PROXY,
+    CONFIG_BALANCE,
+} ConfigType;
+
+typedef struct {
+    const char *name;                   /*< Name of option in configuration file */
+    ConfigType  type;                   /*< Type of option value */
+    size_t      offset;                 /*< Offset of field in Config */
+    int         min;                    /*< Smallest integer value */
+    int         max;                    /*< Largest integer value */
+    bool        host;                   /*< Whether option is set per virtual host */
+} ConfigOption;
+
+#define OPTION(name, type, min, max)        {#name, type, offsetof(Config, name), min, max, false}
+#define HOST_OPTION(name, type, min, max)   {#name, type, offsetof(VirtualHost, name), min, max, true}
+
+static const ConfigOption Options[] = {
+    OPTION(mode,                 CONFIG_MODE,    0,   0),
+    OPTION(workers,              CONFIG_INTEGER, 1,   4096),
+    {"listen", CONFIG_LISTEN, offsetof(Config, listeners), 0, 0, false},
+    OPTION(backlog,              CONFIG_INTEGER, 1,   65535),
+    HOST_OPTION(root,            CONFIG_STRING,  0,   0),
+    HOST_OPTION(bundle,          CONFIG_STRING,  0,   0),
+    OPTION(mime_types,           CONFIG_STRING,  0,   0),
+    HOST_OPTION(default_mime_type, CONFIG_STRING, 0,  0),
+    {"mime_type", CONFIG_MIME_TYPE, offsetof(VirtualHost, mime_types), 0, 0, true},
+    OPTION(keepalive_timeout,    CONFIG_INTEGER, 1,   3600),
+    OPTION(request_buffer,       CONFIG_INTEGER, 256, 65536),
+    OPTION(stream_chunk_size,    CONFIG_INTEGER, 512, STREAM_CHUNK_SIZE),
+    OPTION(stream_flush_ms,      CONFIG_INTEGER, 0,   60000),
+    OPTION(path_cache_size,      CONFIG_INTEGER, 0,   1 << 20),
+    OPTION(max_connections,      CONFIG_INTEGER, 0,   INT_MAX),
+    OPTION(max_requests,         CONFIG_INTEGER, 0,   INT_MAX),
+    OPTION(max_dynamic_requests, CONFIG_INTEGER, 0,   INT_MAX),
+    OPTION(max_queue_time,       CONFIG_INTEGER, 0,   INT_MAX),
+    OPTION(retry_after,          CONFIG_INTEGER, 0,   86400),
+    OPTION(drain_timeout,        CONFIG_INTEGER, 0,   86400),
+    {"rate_limit", CONFIG_RATE_LIMIT, offsetof(VirtualHost, rate_limits), 1, 1000000, true},
+    OPTION(rate_limit_table,     CONFIG_INTEGER, 4,   1 << 24),
+    OPTION(cache_size,           CONFIG_INTEGER, 0,   1 << 30),
+    OPTION(cache_max_file,       CONFIG_INTEGER, 0,   CACHE_MAX_VALUE),
+    {"proxy", CONFIG_PROXY, offsetof(VirtualHost, proxies), 0, 0, true},
+    OPTION(proxy_balance,        CONFIG_BALANCE, 0,   0),
+    OPTION(proxy_timeout,        CONFIG_INTEGER, 1,   3600),
+    OPTION(proxy_fail_timeout,   CONFIG_INTEGER, 0,   3600),
+    OPTION(proxy_idle_timeout,   CONFIG_INTEGER, 0,   3600),
+    OPTION(proxy_pool_size,      CONFIG_INTEGER, 0,   PROXY_POOL_MAX),
+    OPTION(pool_idle_buffers,    CONFIG_INTEGER, 0,   POOL_MAX_IDLE),
+    OPTION(reuse_address,        CONFIG_BOOLEAN, 0,   0),
+    OPTION(reuse_port,           CONFIG_BOOLEAN, 0,   0),
+    OPTION(tcp_nodelay,          CONFIG_BOOLEAN, 0,   0),
+    OPTION(tcp_cork,             CONFIG_BOOLEAN, 0,   0),
+    OPTION(tcp_defer_accept,     CONFIG_INTEGER, 0,   3600),
+    OPTION(tcp_fastopen,         CONFIG_INTEGER, 0,   65535),
+    OPTION(send_buffer,          CONFIG_INTEGER, 0,   1 << 30),
+    OPTION(receive_buffer,       CONFIG_INTEGER, 0,   1 << 30),
+    OPTION(busy_poll,            CONFIG_INTEGER, 0,   1000000),
+    OPTION(slow_request_ms,      CONFIG_INTEGER, 0,   INT_MAX),
+    OPTION(cpu_affinity,         CONFIG_BOOLEAN, 0,   0),
+    OPTION(node_listeners,       CONFIG_BOOLEAN, 0,   0),
+    OPTION(cpu_topology,         CONFIG_STRING,  0,   0),
+};
+
+/**
+ * Allocate configuration with default values.
+ *
+ * @return  Newly allocated Config structure (or NULL on error).
+ **/
+static Config * config_create(void) {
+    Config *config = calloc(1, sizeof(Config));
+    if (!config) {
+        fprintf(stderr, "Error with allocation (Config): %s\n", strerror(errno));
+        return NULL;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    config->mode                 = SINGLE;
+    config->workers              = cpus > 0 ? cpus : 1;
+    config->backlog              = SOMAXCONN;
+    config->nhosts               = 1;
+    config->hosts[0].root        = strdup("www");
+    config->hosts[0].default_mime_type = strdup("text/plain");
+    config->mime_types           = strdup("/etc/mime.types");
+    config->keepalive_timeout    = 5;
+    config->request_buffer       = BUFSIZ;
+    config->stream_chunk_size    = 8192;
+    config->stream_flush_ms      = 50;
+    config->path_cache_size      = 256;
+    config->max_connections      = 1024;
+    config->max_requests         = 512;
+    config->max_dynamic_requests = 64;
+    config->max_queue_time       = 2000;
+    config->retry_after          = 1;
+    config->drain_timeout        = 30;
+    config->rate_limit_table     = 65536;
+    config->cache_size           = 16 << 20;
+    config->cache_max_file       = CACHE_MAX_VALUE;
+    config->proxy_balance        = BALANCE_ROUND_ROBIN;
+    config->proxy_timeout        = 30;
+    config->proxy_fail_timeout   = 10;
+    config->proxy_idle_timeout   = 30;
+    config->proxy_pool_size      = 32;
+    config->pool_idle_buffers    = 16;
+    config->reuse_address        = true;
+    config->tcp_nodelay          = true;
+
+    if (!config->hosts[0].root || !config->mime_types || !config->hosts[0].default_mime_type) {
+        config_free(config);
+        return NULL;
+    }
+    return config;
+}
+
+/**
+ * Set configuration option.
+ *
+ * @param   config      Config structure.
+ * @param   host        Virtual host being configured (hosts[0] for the
+ *                      server and its default host).
+ * @param   name        Name of option.
+ * @param   value       Value of option.
+ * @return  -1 on error and 0 on success.
+ *
+ * Each listen option adds another listen address, and each rate_limit option
+ * adds another route limit of the form
+ *
+ *  <PREFIX> <RATE> [<BURST>]
+ *
+ * where RATE is requests per second and BURST defaults to RATE.  Each
+ * mime_type option adds a mimetype override of the form
+ *
+ *  <EXTENSION> <MIMETYPE>
+ *
+ * and each proxy option adds a route forwarded to upstream servers of the form
+ *
+ *  <PREFIX> <ADDRESS> [<ADDRESS> ...]
+ *
+ * where each ADDRESS has one of the forms accepted by socket_connect.
+ *
+ * Only root, bundle, default_mime_type, mime_type, rate_limit, and proxy may
+ * be set for a virtual host other than the default.
+ **/
+static int config_set(Config *config, VirtualHost *host, const char *name, const char *value) {
+    const ConfigOption *option = NULL;
+
+    for (size_t i = 0; i < sizeof(Options) / sizeof(Options[0]); i++) {
+        if (streq(Options[i].name, name)) {
+            option = &Options[i];
+            break;
+        }
+    }
+
+    if (!option) {
+        fprintf(stderr, "Unknown option: %s\n", name);
+        return -1;
+    }
+    if (!value || !*value) {
+        fprintf(stderr, "Missing value for option: %s\n", name);
+        return -1;
+    }
+
+    if (!option->host && host != &config->hosts[0]) {
+        fprintf(stderr, "Option cannot be set for a virtual host: %s\n", name);
+        return -1;
+    }
+
+    void *field = (char *)(option->host ? (void *)host : (void *)config) + option->offset;
+    char *end;
+    long  number;
+    char *copy;
+    char *type;
+    RateLimit limit;
+    ProxyRoute *route;
+
+    switch (option->type) {
+        case CONFIG_INTEGER:
+            errno  = 0;
+            number = strtol(value, &end, 10);
+            if (errno || *end || number < option->min || number > option->max) {
+                fprintf(stderr, "Invalid value for %s: %s (expected %d to %d)\n",
+                        name, value, option->min, option->max);
+                return -1;
+            }
+            *(int *)field = number;
+            break;
+        case CONFIG_BOOLEAN:
+            if (strieq(value, "on") || strieq(value, "yes") || strieq(value, "true") || streq(value, "1"))
+                *(bool *)field = true;
+            else if (strieq(value, "off") || strieq(value, "no") || strieq(value, "false") || streq(value, "0"))
+                *(bool *)field = false;
+            else {
+                fprintf(stderr, "Invalid value for %s: %s (expected on or off)\n", name, value);
+                return -1;
+            }
+            break;
+        case CONFIG_MODE:
+            if (strieq(value, "single"))
+                config->mode = SINGLE;
+            else if (strieq(value, "forking"))
+                config->mode = FORKING;
+            else if (strieq(value, "prefork"))
+                config->mode = PREFORK;
+            else {
+                fprintf(stderr, "Invalid value for %s: %s (expected single, forking, or prefork)\n", name, value);
+                return -1;
+            }
+            break;
+        case CONFIG_BALANCE:
+            if (strieq(value, "round-robin"))
+                *(Balance *)field = BALANCE_ROUND_ROBIN;
+            else if (strieq(value, "least-connections"))
+                *(Balance *)field = BALANCE_LEAST_CONNECTIONS;
+            else {
+                fprintf(stderr, "Invalid value for %s: %s (expected round-robin or least-connections)\n", name, value);
+                return -1;
+            }
+            break;
+        case CONFIG_STRING:
+            if (!(copy = strdup(value)))
+                return -1;
+            free(*(char **)field);
+            *(char **)field = copy;
+            break;
+        case CONFIG_LISTEN:
+            if (config->nlisteners >= CONFIG_MAX_LISTENERS) {
+                fprintf(stderr, "Too many listen addresses (at most %d)\n", CONFIG_MAX_LISTENERS);
+                return -1;
+            }
+            if (!(copy = strdup(value)))
+                return -1;
+            config->listeners[config->nlisteners++] = copy;
+            break;
+        case CONFIG_RATE_LIMIT:
+            if (host->nrate_limits >= CONFIG_MAX_RATE_LIMITS) {
+                fprintf(stderr, "Too many rate limits (at most %d)\n", CONFIG_MAX_RATE_LIMITS);
+                return -1;
+            }
+            limit.burst = 0;
+            if (!(copy = strdup(value)))
+                return -1;
+            number = sscanf(value, "%s %d %d", copy, &limit.rate, &limit.burst);
+            if (number < 2 || copy[0] != '/' || limit.rate < option->min || limit.rate > option->max ||
+                (number == 3 && (limit.burst < option->min || limit.burst > option->max))) {
+                fprintf(stderr, "Invalid value for %s: %s (expected <prefix> <rate> [<burst>])\n", name, value);
+                free(copy);
+                return -1;
+            }
+            limit.prefix = copy;
+            if (number == 2)
+                limit.burst = limit.rate;
+            host->rate_limits[host->nrate_limits++] = limit;
+            break;
+        case CONFIG_MIME_TYPE:
+            if (host->nmime_types >= CONFIG_MAX_MIME_TYPES) {
+                fprintf(stderr, "Too many mimetypes (at most %d)\n", CONFIG_MAX_MIME_TYPES);
+                return -1;
+            }
+            if (!(copy = strdup(value)))
+                return -1;
+            type = skip_whitespace(skip_nonwhitespace(copy));
+            if (!*type || *skip_nonwhitespace(type)) {
+                fprintf(stderr, "Invalid value for %s: %s (expected <extension> <mimetype>)\n", name, value);
+                free(copy);
+                return -1;
+            }
+            *skip_nonwhitespace(copy) = '\0';
+            host->mime_types[host->nmime_types].extension = copy;
+            host->mime_types[host->nmime_types].type      = type;
+            host->nmime_types++;
+            break;
+        case CONFIG_PROXY:
+            if (host->nproxies >= CONFIG_MAX_PROXIES) {
+                fprintf(stderr, "Too many proxied routes (at most %d)\n", CONFIG_MAX_PROXIES);
+                return -1;
+            }
+            if (!(copy = strdup(value)))
+                return -1;
+            route = &host->proxies[host->nproxies];
+            route->prefix     = copy;
+            route->nupstreams = 0;
+            for (char *address = skip_whitespace(skip_nonwhitespace(copy)); *address; ) {
+                end = skip_nonwhitespace(address);
+                if (route->nupstreams >= CONFIG_MAX_UPSTREAMS) {
+                    fprintf(stderr, "Too many upstreams for %s (at most %d)\n", copy, CONFIG_MAX_UPSTREAMS);
+                    free(copy);
+                    return -1;
+                }
+                route->upstreams[route->nupstreams++] = address;
+                address = skip_whitespace(end);
+                *end = '\0';
+            }
+            if (copy[0] != '/' || route->nupstreams == 0) {
+                fprintf(stderr, "Invalid value for %s: %s (expected <prefix> <address> ...)\n", name, value);
+                free(copy);
+                return -1;
+            }
+            *skip_nonwhitespace(copy) = '\0';
+            host->nproxies++;
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Read configuration file.
+ *
+ * @param   config      Config structure.
+ * @param   path        Path to configuration file.
+ * @return  -1 on error and 0 on success.
+ *
+ * Each line of the configuration file has the form
+ *
+ *  <NAME> = <VALUE>
+ *
+ * Blank lines and lines starting with '#' are ignored.  A line of the form
+ *
+ *  [<HOST> <HOST> ...]
+ *
+ * starts a virtual host section: the options that follow (up to the next
+ * section) apply to requests whose Host header names one of its hosts.
+ * Options before the first section configure the server and its default
+ * host, which serves requests for any other host.
+ **/
+static int config_read(Config *config, const char *path) {
+    char buffer[BUFSIZ];
+    int  line = 0;
+    FILE *fs = fopen(path, "r");
+    VirtualHost *host = &config->hosts[0];
+
+    if (!fs) {
+        fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(buffer, BUFSIZ, fs)) {
+        line++;
+
+        /* Strip comment and trailing whitespace */
+        char *comment = strchr(buffer, '#');
+        if (comment)
+            *comment = '\0';
+        size_t length = strlen(buffer);
+        while (length > 0 && strchr(WHITESPACE "\r", buffer[length - 1]))
+            buffer[--length] = '\0';
+
+        char *name = skip_whitespace(buffer);
+        if (!*name)
+            continue;
+
+        /* Start virtual host section */
+        if (*name == '[') {
+            if (buffer[length - 1] != ']' || config->nhosts >= CONFIG_MAX_HOSTS) {
+                fprintf(stderr, "%s:%d: expected [<host> ...] (at most %d hosts)\n", path, line, CONFIG_MAX_HOSTS - 1);
+                goto fail;
+            }
+            buffer[length - 1] = '\0';
+            host = &config->hosts[config->nhosts];
+            host->index = config->nhosts++;
+            host->names = strdup(skip_whitespace(name + 1));
+            if (!host->names || !*host->names) {
+                fprintf(stderr, "%s:%d: virtual host has no names\n", path, line);
+                goto fail;
+            }
+            for (char *c = host->names; *c; c++)
+                *c = (*c >= 'A' && *c <= 'Z') ? *c + ('a' - 'A') : *c;
+            continue;
+        }
+
+        /* Split name and value */
+        char *value = strchr(name, '=');
+        if (!value) {
+            fprintf(stderr, "%s:%d: expected <name> = <value>\n", path, line);
+            goto fail;
+        }
+        *value++ = '\0';
+        value = skip_whitespace(value);
+
+        length = strlen(name);
+        while (length > 0 && strchr(WHITESPACE, name[length - 1]))
+            name[--length] = '\0';
+
+        if (config_set(config, host, name, value) < 0) {
+            fprintf(stderr, "%s:%d: invalid option\n", path, line);
+            goto fail;
+        }
+    }
+
+    fclose(fs);
+    return 0;
+
+fail:
+    fclose(fs);
+    return -1;
+}
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hbcfmMnNprtw]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -b path       Asset bundle to serve before root\n");
+    fprintf(stderr, "    -c mode       Single, Forking, or Prefork mode\n");
+    fprintf(stderr, "    -f path       Path to configuration file\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -n count      Maximum concurrent connections\n");
+    fprintf(stderr, "    -N count      Maximum in-flight requests\n");
+    fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -t seconds    Drain timeout on SIGTERM\n");
+    fprintf(stderr, "    -w count      Worker processes in prefork mode\n");
+    exit(status);
+}
+
+/**
+ * Parse command-line options.
+ *
+ * @param   argc        Number of arguments.
+ * @param   argv        Array of argument strings.
+ * @param   config      Config structure.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Options given on the command line override the configuration file.  A port
+ * given with -p replaces all configured listen addresses.
+ */
+static bool parse_options(int argc, char *argv[], Config *config) {
+    int argind = 1;
+    int status = 0;
+    bool listening = false;
+    VirtualHost *defaults = &config->hosts[0];
+
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-' && status == 0) {
+        char *arg = argv[argind++];
+        char *value = argind < argc ? argv[argind] : NULL;
+    	switch (arg[1]) {
+	    case 'b':
+	    	status = config_set(config, defaults, "bundle", value);
+	    	argind++;
+	    	break;
+	    case 'c':
+	    	status = config_set(config, defaults, "mode", value);
+	    	argind++;
+	    	break;
+	    case 'f':
+	    	argind++;
+	    	break;
+	    case 'h':
+	    	usage(argv[0], EXIT_SUCCESS);
+	    	break;
+	    case 'm':
+	    	status = config_set(config, defaults, "mime_types", value);
+	    	argind++;
+	    	break;
+	    case 'M':
+	    	status = config_set(config, defaults, "default_mime_type", value);
+	    	argind++;
+	    	break;
+	    case 'n':
+	    	status = config_set(config, defaults, "max_connections", value);
+	    	argind++;
+	    	break;
+	    case 'N':
+	    	status = config_set(config, defaults, "max_requests", value);
+	    	argind++;
+	    	break;
+	    case 'p':
+	    	if (!listening) {
+	    	    while (config->nlisteners > 0)
+	    	    	free(config->listeners[--config->nlisteners]);
+	    	    listening = true;
+	    	}
+	    	status = config_set(config, defaults, "listen", value);
+	    	argind++;
+	    	break;
+	    case 'r':
+	    	status = config_set(config, defaults, "root", value);
+	    	argind++;
+	    	break;
+	    case 't':
+	    	status = config_set(config, defaults, "drain_timeout", value);
+	    	argind++;
+	    	break;
+	    case 'w':
+	    	status = config_set(config, defaults, "workers", value);
+	    	argind++;
+	    	break;
+	    default:
+	        usage(argv[0], EXIT_FAILURE);
+	    	break;
+	}
+    }
+
+    return status == 0;
+}
+
+/**
+ * Complete virtual host with settings inherited from the default host.
+ *
+ * @param   config      Config structure.
+ * @param   host        Virtual host.
+ * @return  -1 on error and 0 on success.
+ *
+ * Every virtual host needs its own root.  The default mimetype and rate
+ * limits are inherited unless the host sets its own, while mimetype
+ * overrides of the default host apply after the host's own (see
+ * determine_mimetype).  Proxied routes are never inherited, since they
+ * usually belong to a single site.
+ **/
+static int config_host(Config *config, VirtualHost *host) {
+    const VirtualHost *defaults = &config->hosts[0];
+
+    if (!host->root) {
+        fprintf(stderr, "Virtual host %s has no root\n", host->names);
+        return -1;
+    }
+    if (!host->default_mime_type && !(host->default_mime_type = strdup(defaults->default_mime_type)))
+        return -1;
+
+    if (host->nrate_limits == 0 && host != defaults) {
+        for (int i = 0; i < defaults->nrate_limits; i++) {
+            host->rate_limits[i] = defaults->rate_limits[i];
+            if (!(host->rate_limits[i].prefix = strdup(defaults->rate_limits[i].prefix)))
+                return -1;
+            host->nrate_limits++;
+        }
+    }
+
+    host->root_path = realpath(host->root, NULL);
+    if (!host->root_path) {
+        fprintf(stderr, "Error with root directory %s: %s\n", host->root, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compute hash of host name (ignoring case).
+ *
+ * @param   name        Host name (need not be NUL-terminated).
+ * @param   length      Length of host name.
+ * @return  FNV-1a hash of lower case host name.
+ **/
+static unsigned host_hash(const char *name, size_t length) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = name[i];
+        hash = (hash ^ (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c)) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Build hash table of virtual host names.
+ *
+ * @param   config      Config structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * The table is open addressed with linear probing and at most half full.
+ * Names point into the names of each host, so they are not NUL-terminated.
+ **/
+static int config_host_names(Config *config) {
+    size_t count = 0;
+
+    for (int h = 1; h < config->nhosts; h++) {
+        for (char *name = config->hosts[h].names; *name; name = skip_whitespace(skip_nonwhitespace(name)))
+            count++;
+    }
+
+    config->host_names_size = 8;
+    while (config->host_names_size < 2 * count)
+        config->host_names_size <<= 1;
+    config->host_names = calloc(config->host_names_size, sizeof(HostName));
+    if (!config->host_names) {
+        fprintf(stderr, "Error with allocation (HostName): %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int h = 1; h < config->nhosts; h++) {
+        for (char *name = config->hosts[h].names; *name; name = skip_whitespace(skip_nonwhitespace(name))) {
+            size_t length = skip_nonwhitespace(name) - name;
+            size_t mask   = config->host_names_size - 1;
+            size_t slot   = host_hash(name, length) & mask;
+
+            for (; config->host_names[slot].name; slot = (slot + 1) & mask) {
+                if (config->host_names[slot].length == length &&
+                    strncmp(config->host_names[slot].name, name, length) == 0) {
+                    fprintf(stderr, "Duplicate virtual host: %.*s\n", (int)length, name);
+                    return -1;
+                }
+            }
+            config->host_names[slot] = (HostName){name, length, h};
+        }
+    }
+    return 0;
+}
+
+/**
+ * Load configuration from defaults, configuration file, and command line.
+ *
+ * @param   argc        Number of arguments.
+ * @param   argv        Array of argument strings.
+ * @return  Newly allocated Config structure (or NULL on error).
+ *
+ * The configuration file is given with -f.  Once loaded, a configuration is
+ * never modified: reloading builds a new one that replaces Settings as a
+ * whole, so a failed reload leaves the current configuration in place.
+ **/
+Config * config_load(int argc, char *argv[]) {
+    Config *config = config_create();
+    if (!config)
+        return NULL;
+
+    /* Read configuration file */
+    for (int i = 1; i < argc - 1; i++) {
+        if (streq(argv[i], "-f") && config_read(config, argv[i + 1]) < 0)
+            goto fail;
+    }
+
+    /* Apply command line overrides */
+    if (!parse_options(argc, argv, config))
+        goto fail;
+
+    if (config->nlisteners == 0 && config_set(config, &config->hosts[0], "listen", "9898") < 0)
+        goto fail;
+
+    /* Complete virtual hosts and determine real root paths */
+    for (int i = 0; i < config->nhosts; i++) {
+        if (config_host(config, &config->hosts[i]) < 0)
+            goto fail;
+    }
+
+    if (config_host_names(config) < 0)
+        goto fail;
+
+    /* Tell cached values derived from previous configurations apart */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    config->generation = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    return config;
+
+fail:
+    config_free(config);
+    return NULL;
+}
+
+/**
+ * Deallocate configuration.
+ *
+ * @param   config      Config structure.
+ **/
+void config_free(const Config *config) {
+    Config *c = (Config *)config;
+
+    if (!c)
+        return;
+
+    for (int i = 0; i < c->nlisteners; i++)
+        free(c->listeners[i]);
+    for (int h = 0; h < c->nhosts; h++) {
+        VirtualHost *host = &c->hosts[h];
+        for (int i = 0; i < host->nrate_limits; i++)
+            free(host->rate_limits[i].prefix);
+        for (int i = 0; i < host->nmime_types; i++)
+            free(host->mime_types[i].extension);
+        for (int i = 0; i < host->nproxies; i++)
+            free(host->proxies[i].prefix);
+        free(host->names);
+        free(host->root);
+        free(host->root_path);
+        free(host->bundle);
+        free(host->default_mime_type);
+    }
+    free(c->host_names);
+    free(c->mime_types);
+    free(c->cpu_topology);
+    free(c);
+}
+
+/**
+ * Find virtual host for Host header.
+ *
+ * @param   name        Value of Host header (or NULL).
+ * @return  Virtual host with the name, or the default host if there is none.
+ *
+ * The port and any trailing dot are ignored, and names are compared without
+ * regard to case.
+ **/
+const VirtualHost * virtual_host(const char *name) {
+    const Config *config = Settings;
+
+    if (!name || config->nhosts == 1)
+        return &config->hosts[0];
+
+    /* Strip port (after an IPv6 literal) and trailing dot */
+    const char *end = name[0] == '[' ? strchr(name, ']') : name;
+    size_t length   = end ? strcspn(end, ":") + (end - name) : strlen(name);
+    if (length > 0 && name[length - 1] == '.')
+        length--;
+
+    size_t mask = config->host_names_size - 1;
+    for (size_t slot = host_hash(name, length) & mask; config->host_names[slot].name; slot = (slot + 1) & mask) {
+        const HostName *entry = &config->host_names[slot];
+        if (entry->length == length && strncasecmp(entry->name, name, length) == 0)
+            return &config->hosts[entry->host];
+    }
+    return &config->hosts[0];
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,325 @@
+/* control.c: Signal-driven Server Control */
+
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Environment used to hand the listening sockets to an upgraded binary */
+#define LISTEN_FDS_ENV  "SPIDEY_LISTEN_FDS"
+#define PARENT_PID_ENV  "SPIDEY_PARENT_PID"
+
+/* Control flags set by signal handlers */
+volatile sig_atomic_t Draining = 0;
+static volatile sig_atomic_t ReloadPending  = 0;
+static volatile sig_atomic_t UpgradePending = 0;
+static volatile sig_atomic_t ChildExited    = 0;
+
+/* Original command line (for reload and re-exec) */
+static int    ArgumentsCount = 0;
+static char **Arguments      = NULL;
+
+/**
+ * Record control signal in the corresponding flag.
+ *
+ * @param   signum      Signal number.
+ **/
+static void control_signal(int signum) {
+    switch (signum) {
+        case SIGTERM: Draining       = 1; break;
+        case SIGHUP:  ReloadPending  = 1; break;
+        case SIGUSR2: UpgradePending = 1; break;
+        case SIGCHLD: ChildExited    = 1; break;
+    }
+}
+
+/**
+ * Install control signal handlers.
+ *
+ * @param   argc        Number of command line arguments.
+ * @param   argv        Command line arguments (used to reload and re-exec).
+ *
+ *  SIGTERM     Stop accepting and drain existing connections.
+ *  SIGHUP      Reload configuration.
+ *  SIGUSR2     Start a new binary that inherits the listening sockets.
+ *
+ * SIGCHLD only interrupts waiting so that exited workers are noticed; it
+ * does not reap them.
+ **/
+void control_init(int argc, char *argv[]) {
+    struct sigaction action = {
+        .sa_handler = control_signal,
+        .sa_flags   = SA_RESTART | SA_NOCLDSTOP,
+    };
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGHUP,  &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    sigaction(SIGCHLD, &action, NULL);
+
+    ArgumentsCount = argc;
+    Arguments      = argv;
+}
+
+/**
+ * Restrict control signals in a worker process.
+ *
+ * Workers only respond to SIGTERM (by draining); reloads and upgrades are
+ * performed by the server process that started them.
+ **/
+void control_worker(void) {
+    signal(SIGHUP,  SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+}
+
+/**
+ * Return listening sockets inherited from a previous server process.
+ *
+ * @param   fds         Array to store socket file descriptors.
+ * @param   max         Size of array.
+ * @return  Number of sockets inherited.
+ **/
+int inherit_sockets(int *fds, int max) {
+    char *value = getenv(LISTEN_FDS_ENV);
+    int   count = 0;
+
+    if (!value)
+        return 0;
+
+    for (char *fd = strtok(value, ","); fd && count < max; fd = strtok(NULL, ",")) {
+        fds[count] = atoi(fd);
+        if (fds[count] < 0 || fcntl(fds[count], F_SETFD, FD_CLOEXEC) < 0)
+            continue;
+        log("Inherited listening socket %d", fds[count]);
+        count++;
+    }
+
+    unsetenv(LISTEN_FDS_ENV);
+    return count;
+}
+
+/**
+ * Tell the server process that started this one (if any) to drain.
+ *
+ * This is called by an upgraded binary once it is ready to accept, so the
+ * listening sockets are never left without a process accepting on them.
+ **/
+void announce_ready(void) {
+    char *value = getenv(PARENT_PID_ENV);
+    if (!value)
+        return;
+
+    pid_t parent = atoi(value);
+    unsetenv(PARENT_PID_ENV);
+    if (parent > 1 && parent == getppid()) {
+        log("Asking previous server %d to drain", parent);
+        kill(parent, SIGTERM);
+    }
+}
+
+/**
+ * Reload configuration.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The configuration file and command line are loaded into a new Config that
+ * replaces Settings only if it is valid and all of its root directories can
+ * be opened (so a symbolic link to the current release can be switched).
+ * Error pages are then rebuilt.  On error the current configuration is kept.
+ *
+ * Listen addresses and the concurrency mode take effect on the next upgrade
+ * (SIGUSR2).  Workers that are already running keep the configuration they
+ * were started with.
+ **/
+int reload_server(void) {
+    Config *config = config_load(ArgumentsCount, Arguments);
+    if (!config) {
+        fprintf(stderr, "Error reloading configuration\n");
+        return -1;
+    }
+
+    if (open_roots(config) < 0) {
+        fprintf(stderr, "Error reloading root directories\n");
+        config_free(config);
+        return -1;
+    }
+
+    const Config *previous = Settings;
+    Settings = config;
+    load_error_pages(Settings->hosts[0].root_path);
+    config_free(previous);
+    log("Reloaded configuration (root = %s, %d virtual hosts)", Settings->hosts[0].root_path, Settings->nhosts - 1);
+    return 0;
+}
+
+/**
+ * Start new server binary that inherits the listening sockets.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
+ * @return  Process id of the new server, or -1 on error.
+ *
+ * The new binary is started with the original command line.  Both servers
+ * accept on the same sockets until the new one calls announce_ready, which
+ * makes this one drain, so no connection is refused during the upgrade.  If
+ * the new binary fails to start, this server simply keeps running.
+ **/
+pid_t upgrade_server(const int *sfds, int nsfds) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error with forking: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        char fds[CONFIG_MAX_SOCKETS * 12] = "", parent[16];
+        size_t length = 0;
+
+        for (int i = 0; i < nsfds; i++) {
+            length += snprintf(fds + length, sizeof(fds) - length, "%s%d", i ? "," : "", sfds[i]);
+            fcntl(sfds[i], F_SETFD, 0);
+        }
+        snprintf(parent, sizeof(parent), "%d", getppid());
+        setenv(LISTEN_FDS_ENV, fds, 1);
+        setenv(PARENT_PID_ENV, parent, 1);
+
+        execvp(Arguments[0], Arguments);
+        fprintf(stderr, "Error with exec %s: %s\n", Arguments[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    log("Started upgraded server %d", pid);
+    return pid;
+}
+
+/**
+ * Handle pending reload and upgrade requests.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
+ * @return  Whether the configuration was reloaded.
+ **/
+static bool handle_pending(const int *sfds, int nsfds) {
+    bool reloaded = false;
+
+    if (ReloadPending) {
+        ReloadPending = 0;
+        reloaded = reload_server() == 0;
+    }
+    if (UpgradePending) {
+        UpgradePending = 0;
+        upgrade_server(sfds, nsfds);
+    }
+    return reloaded;
+}
+
+/**
+ * Block control signals, returning the original signal mask.
+ *
+ * @param   original    Pointer to store original signal mask.
+ **/
+static void block_signals(sigset_t *original) {
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, original);
+}
+
+/**
+ * Handle pending control signals and wait for a connection.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
+ * @return  Server socket with a connection ready to be accepted, or -1 once
+ *          the server is draining.
+ *
+ * Control signals are blocked except while waiting in ppoll(2), so a signal
+ * that arrives just before the wait still interrupts it.  Ready sockets are
+ * served in turn so that one busy listener cannot starve the others.  After
+ * POOL_IDLE_MS without a connection, idle buffers are released (see
+ * pool_trim).
+ **/
+int wait_for_connection(const int *sfds, int nsfds) {
+    static int next = 0;
+    struct pollfd pfds[CONFIG_MAX_SOCKETS];
+    sigset_t original;
+
+    for (int i = 0; i < nsfds; i++) {
+        pfds[i].fd     = sfds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    while (true) {
+        handle_pending(sfds, nsfds);
+
+        block_signals(&original);
+        if (Draining || ReloadPending || UpgradePending) {
+            sigprocmask(SIG_SETMASK, &original, NULL);
+            if (Draining)
+                return -1;
+            continue;
+        }
+
+        /* Release idle buffers if no connection arrives for a while */
+        struct timespec idle = {POOL_IDLE_MS / 1000, POOL_IDLE_MS % 1000 * 1000000L};
+        int ready = ppoll(pfds, nsfds, pool_dirty() ? &idle : NULL, &original);
+        sigprocmask(SIG_SETMASK, &original, NULL);
+
+        if (ready == 0)
+            pool_trim();
+
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "Error with ppoll: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; ready > 0 && i < nsfds; i++) {
+            int index = (next + i) % nsfds;
+            if (pfds[index].revents & POLLIN) {
+                next = (index + 1) % nsfds;
+                return sfds[index];
+            }
+        }
+    }
+}
+
+/**
+ * Handle pending control signals and wait for the next one.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
+ * @return  -1 once the server is draining, 1 if the configuration was
+ *          reloaded, and 0 otherwise (ie. a child exited).
+ *
+ * This is used by server processes that supervise workers instead of
+ * accepting connections themselves.
+ **/
+int wait_for_signal(const int *sfds, int nsfds) {
+    sigset_t original;
+
+    block_signals(&original);
+    if (!Draining && !ReloadPending && !UpgradePending && !ChildExited)
+        sigsuspend(&original);
+    sigprocmask(SIG_SETMASK, &original, NULL);
+
+    ChildExited = 0;
+    if (Draining)
+        return -1;
+    return handle_pending(sfds, nsfds) ? 1 : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,114 @@
+/* errors.c: Precomputed HTTP Error Pages */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+/* Error pages indexed by Status, built once by load_error_pages */
+static ErrorPage ErrorPages[HTTP_STATUS_COUNT];
+static bool      ErrorPagesLoaded = false;
+
+/**
+ * Read error page template for status from root directory.
+ *
+ * @param   root        Root directory.
+ * @param   status      HTTP Status.
+ * @param   length      Pointer to store length of template.
+ * @return  Newly allocated template contents (or NULL if there is none).
+ *
+ * Templates are named after the status code, for example <root>/404.html.
+ **/
+static char * read_error_template(const char *root, Status status, size_t *length) {
+    char path[BUFSIZ];
+    struct stat s;
+    char *body;
+    FILE *fs;
+
+    if (!root)
+        return NULL;
+
+    snprintf(path, sizeof(path), "%s/%.3s.html", root, http_status_string(status));
+    fs = fopen(path, "r");
+    if (!fs)
+        return NULL;
+
+    if (fstat(fileno(fs), &s) < 0 || !S_ISREG(s.st_mode) || !(body = malloc(s.st_size + 1))) {
+        fclose(fs);
+        return NULL;
+    }
+
+    *length = fread(body, 1, s.st_size, fs);
+    fclose(fs);
+    log("Loaded error page %s", path);
+    return body;
+}
+
+/**
+ * Build complete error pages for every error status.
+ *
+ * @param   root        Root directory containing optional templates.
+ *
+ * This should be called once at startup (before forking) so that errors can
+ * be sent without any formatting or file access.  A template such as
+ * <root>/404.html replaces the built-in page for that status.
+ **/
+void load_error_pages(const char *root) {
+    for (Status status = HTTP_STATUS_BAD_REQUEST; status < HTTP_STATUS_COUNT; status++) {
+        ErrorPage *page = &ErrorPages[status];
+        const char *status_string = http_status_string(status);
+        char buffer[BUFSIZ];
+        int n;
+
+        /* Release pages from a previous configuration */
+        free(page->head);
+        free(page->body);
+
+        /* Body from template or built-in page */
+        page->body = read_error_template(root, status, &page->body_length);
+        if (!page->body) {
+            n = snprintf(buffer, sizeof(buffer),
+                "<html><head><title>%s</title></head><body>"
+                "<h1><strong>%s</strong></h1><h2>I bet you tried to use sudo</h2>"
+                "</body></html>\n", status_string, status_string);
+            page->body        = strdup(buffer);
+            page->body_length = n;
+        }
+
+        /* Entity headers (and when to retry if the server is overloaded) */
+        n = snprintf(buffer, sizeof(buffer),
+            "Content-Type: text/html\r\n"
+            "Content-Length: %zu\r\n", page->body_length);
+        if (status == HTTP_STATUS_SERVICE_UNAVAILABLE)
+            n += snprintf(buffer + n, sizeof(buffer) - n, "Retry-After: %d\r\n", Settings->retry_after);
+        page->head        = strdup(buffer);
+        page->head_length = n;
+
+        if (!page->head || !page->body) {
+            fatal("Unable to allocate error page: %s", strerror(errno));
+        }
+    }
+
+    ErrorPagesLoaded = true;
+}
+
+/**
+ * Return error page for status.
+ *
+ * @param   status      HTTP Status (400 or greater).
+ * @return  Precomputed error page.
+ **/
+const ErrorPage * error_page(Status status) {
+    if (!ErrorPagesLoaded)
+        load_error_pages(Settings->hosts[0].root_path);
+
+    if (status < HTTP_STATUS_BAD_REQUEST || status >= HTTP_STATUS_COUNT)
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    return &ErrorPages[status];
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
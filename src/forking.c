@@ -4,7 +4,6 @@
 #include "spidey.h"
 
 #include <errno.h>
-#include <signal.h>
 #include <string.h>
 
 #include <unistd.h>
@@ -12,47 +11,68 @@
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * Once max_connections children are active (or fork fails), new connections
+ * are rejected immediately with 503 Service Unavailable instead of forking.
+ *
+ * On SIGTERM the parent stops accepting and waits for the children to drain.
  **/
-int forking_server(int sfd) {
+int forking_server(const int *sfds, int nsfds) {
     log("Forking Server");
     /* Accept and handle HTTP request */
     Request *r;
     pid_t pid;
-    while (true) {
+    int sfd;
+
+    while ((sfd = wait_for_connection(sfds, nsfds)) >= 0) {
     	/* Accept request */
         r = accept_request(sfd);
         if (!r)
             continue;
 
-	/* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
+	/* Shed load once the connection limit is reached */
+        reap_workers();
+        size_t active = worker_count(false);
+        if (Settings->max_connections > 0 && active >= (size_t)Settings->max_connections) {
+            log("Rejecting connection: %zu connections active", active);
+            reject_connection(r);
+            free_request(r);
+            continue;
+        }
 
 	/* Fork off child process to handle request */
         pid = fork();
 
         if (pid < 0) {
             fprintf(stderr, "Error with forking: %s\n", strerror(errno));
+            reject_connection(r);
             free_request(r);
-            exit(EXIT_FAILURE);
         }
         else if (pid == 0) {
-            handle_request(r);
+            control_worker();
+            for (int i = 0; i < nsfds; i++)
+                close(sfds[i]);
+            handle_connection(r);
             free_request(r);
-            close(sfd);
             exit(EXIT_SUCCESS);
         }
         else {
+            add_worker(pid, -1);
             free_request(r);
         }
     }
 
-    /* Close server socket */
-    close(sfd);
+    /* Close server sockets and let children finish */
+    for (int i = 0; i < nsfds; i++)
+        close(sfds[i]);
+    drain_workers();
+    log("Server drained");
     return EXIT_SUCCESS;
 }
 
@@ -1,21 +1,63 @@
 /* handler.c: HTTP Request Handlers */
 
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
-Status handle_error(Request *request, Status status);
+static Status handle_rate_limited(Request *request, int retry_after);
+
+/**
+ * Check accessibility of the request path.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   mode        Accessibility mode (ie. R_OK, X_OK).
+ * @return  0 if access is permitted and -1 otherwise.
+ *
+ * The descriptor from path resolution is used when available so the path is
+ * not walked again.
+ **/
+static int check_access(Request *r, int mode) {
+    if (r->path_fd >= 0 && faccessat(r->path_fd, "", mode, AT_EMPTY_PATH | AT_EACCESS) == 0)
+        return 0;
+    if (r->path_fd >= 0 && errno != EINVAL && errno != ENOSYS)
+        return -1;
+    return access(r->path, mode);
+}
+
+/**
+ * Handle HTTP Connection.
+ *
+ * @param   r           HTTP Request structure
+ *
+ * This handles requests on the client connection until the client closes it,
+ * a response cannot be framed, or the connection is idle for longer than
+ * keepalive_timeout seconds.  Once the server is draining, the request in
+ * progress is completed and the connection is closed.
+ **/
+void    handle_connection(Request *r) {
+    do {
+        handle_request(r);
+        trace(r, DONE);
+        trace_report(r);
+    } while (r->keep_alive && !Draining && reset_request(r) == 0);
+}
 
 /**
  * Handle HTTP Request.
@@ -23,8 +65,12 @@ Status handle_error(Request *request, Status status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request, checks the client's rate limit (see
+ * rate_limit_check), forwards requests for proxied routes upstream (see
+ * handle_proxy_request), serves assets from the host's bundle (see
+ * handle_bundle_request), and otherwise determines the request path,
+ * determines the request type, and then dispatches to the appropriate handler
+ * type if the request is admitted (see admit_request).
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
@@ -34,37 +80,102 @@ Status  handle_request(Request *r) {
     struct stat s;
 
     /* Parse request */
-    if (parse_request(r) < 0) {
+    result = parse_request(r);
+    if (result != HTTP_STATUS_OK) {
         log("Parse request failed");
-        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        return handle_error(r, result);
+    }
+    trace(r, PARSE);
+
+    /* Tell the client not to reuse the connection while draining */
+    if (Draining)
+        r->keep_alive = false;
+
+    /* Select virtual host named by Host header */
+    r->vhost = virtual_host(request_header(r, HEADER_HOST));
+
+    /* Turn away clients that exceed the rate limit of the route */
+    int retry_after = rate_limit_check(r);
+    if (retry_after > 0) {
+        return handle_rate_limited(r, retry_after);
+    }
+
+    /* Forward requests for proxied routes (admitted like CGI requests) */
+    const ProxyRoute *route = proxy_route(r);
+    trace(r, ROUTE);
+    if (route) {
+        if (!admit_request(r, true)) {
+            result = handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        else {
+            log("REQUEST PROXY");
+            result = handle_proxy_request(r, route);
+            release_request(true);
+        }
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
         return result;
     }
-    /* Determine request path */
-    r->path = determine_request_path(r->uri);
-    if(!r->path) {
-        result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+
+    /* Serve bundled assets straight from the mapping (without the filesystem) */
+    const Bundle *bundle = root_bundle(r->vhost);
+    const BundleEntry *asset = NULL;
+    if (bundle && (streq(r->method, "GET") || streq(r->method, "HEAD")))
+        asset = bundle_lookup(bundle, r->uri);
+    if (asset) {
+        trace(r, RESOLVE);
+        if (!admit_request(r, false)) {
+            result = handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        else {
+            log("REQUEST BUNDLE");
+            result = handle_bundle_request(r, bundle, asset);
+            release_request(false);
+        }
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
         return result;
     }
+
+    /* Determine request path */
+    result = resolve_request_path(r);
+    if (result != HTTP_STATUS_OK) {
+        return handle_error(r, result);
+    }
+    trace(r, RESOLVE);
     debug("HTTP REQUEST PATH: %s", r->path);
 
     /* Dispatch to appropriate request handler type based on file type */
-    if (stat(r->path, &s) < 0) {
+    if ((r->path_fd >= 0 ? fstat(r->path_fd, &s) : stat(r->path, &s)) < 0) {
         log("HANDLE ERROR");
         result = handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
     else if (S_ISREG(s.st_mode)) {
-        if (!access(r->path, X_OK)) {
+        bool dynamic = !check_access(r, X_OK);
+        if (!dynamic && check_access(r, R_OK)) {
+            result = handle_error(r, HTTP_STATUS_FORBIDDEN);
+        }
+        else if (!admit_request(r, dynamic)) {
+            result = handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        else if (dynamic) {
             log("REQUEST CGI");
             result = handle_cgi_request(r);
+            release_request(dynamic);
         }
-        else if (!access(r->path, R_OK)) {
+        else {
             log("REQUEST FILE");
             result = handle_file_request(r);
+            release_request(dynamic);
         }
     }
     else if ((s.st_mode & S_IFMT) == S_IFDIR){
         log("REQUEST_BROWSE");
-        result = handle_browse_request(r);
+        if (!admit_request(r, false)) {
+            result = handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        else {
+            result = handle_browse_request(r);
+            release_request(false);
+        }
     }
     else {
         log("HANDLE ERROR");
@@ -75,13 +186,37 @@ Status  handle_request(Request *r) {
     return result;
 }
 
+/**
+ * Append HTML to directory listing.
+ *
+ * @param   stream      Stream the listing is written to.
+ * @param   copy        Copy of listing kept for the cache.
+ * @param   length      Length of copy (or -1 once it no longer fits).
+ * @param   html        HTML to append.
+ **/
+static void browse_puts(Stream *stream, char *copy, ssize_t *length, const char *html) {
+    size_t n = strlen(html);
+
+    stream_write(stream, html, n);
+    if (*length >= 0 && *length + n <= (size_t)Settings->cache_max_file) {
+        memcpy(copy + *length, html, n);
+        *length += n;
+    }
+    else {
+        *length = -1;
+    }
+}
+
 /**
  * Handle browse request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP browse request.
  *
- * This lists the contents of a directory in HTML.
+ * This lists the contents of a directory in HTML, streamed to HTTP/1.1
+ * clients with chunked transfer encoding.  Listings that fit in the shared
+ * cache are kept there (by directory and URI) until the directory changes,
+ * and then sent with a Content-Length.
  *
  * If the path cannot be opened or scanned as a directory, then handle error
  * with HTTP_STATUS_NOT_FOUND.
@@ -89,35 +224,128 @@ Status  handle_request(Request *r) {
 Status  handle_browse_request(Request *r) {
     log("HANDLE BROWSE REQUEST\n");
     struct dirent **entries;
+    char key[CACHE_MAX_KEY];
+    char listing[CACHE_MAX_VALUE];
+    ssize_t length = -1;
+    CacheStamp stamp;
+    struct stat s;
+    Response response;
+    Stream stream;
+    int key_length = -1;
     int n;
 
+    /* Send listing from the cache while the directory is unchanged */
+    if ((r->path_fd >= 0 ? fstat(r->path_fd, &s) : stat(r->path, &s)) == 0) {
+        uint64_t id[2] = {s.st_dev, s.st_ino};
+        key_length = snprintf(key, sizeof(key), "D%016jx%016jx%s", (uintmax_t)id[0], (uintmax_t)id[1], r->uri);
+        if (key_length >= (int)sizeof(key))
+            key_length = -1;
+        cache_stamp(&stamp, &s);
+    }
+    if (key_length > 0 && (length = cache_get(key, key_length, &stamp, listing, Settings->cache_max_file)) >= 0) {
+        debug("Cache hit for listing %s", r->uri);
+        response_init(&response, r, HTTP_STATUS_OK);
+        response_static(&response, "Content-Type: text/html\r\n");
+        stream_open(&stream, &response, length);
+        stream_write(&stream, listing, length);
+        stream_close(&stream);
+        return HTTP_STATUS_OK;
+    }
+
     /* Open a directory for reading or scanning */
-    n = scandir(r->path, &entries, NULL, alphasort);
+    if (r->path_fd >= 0)
+        n = scandirat(r->path_fd, ".", &entries, NULL, alphasort);
+    else
+        n = scandir(r->path, &entries, NULL, alphasort);
     if (n < 0) {
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
     /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\n");
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    response_init(&response, r, HTTP_STATUS_OK);
+    response_static(&response, "Content-Type: text/html\r\n");
+    stream_open(&stream, &response, -1);
 
     /* For each entry in directory, emit HTML list item */
-    fprintf(r->file, "<html><body bgcolor=#9aa1ad><ul class=\'list-group\'>\n");
+    const char *prefix = streq(r->uri, "/") ? "" : r->uri;
+    length = key_length > 0 ? 0 : -1;
+    browse_puts(&stream, listing, &length, "<html><body bgcolor=#9aa1ad><ul class=\'list-group\'>\n");
     for (int i = 0; i < n; i++) {
         if (!streq(entries[i]->d_name, ".")) {
-            fprintf(r->file, "<li style=\"font-family:courier new;font-size:32px;font-color=green;\"><a href=\"%s/%s\">%s</a></li>\n", streq(r->uri, "/") ? "" : r->uri, entries[i]->d_name, entries[i]->d_name);
+            browse_puts(&stream, listing, &length, "<li style=\"font-family:courier new;font-size:32px;font-color=green;\"><a href=\"");
+            browse_puts(&stream, listing, &length, prefix);
+            browse_puts(&stream, listing, &length, "/");
+            browse_puts(&stream, listing, &length, entries[i]->d_name);
+            browse_puts(&stream, listing, &length, "\">");
+            browse_puts(&stream, listing, &length, entries[i]->d_name);
+            browse_puts(&stream, listing, &length, "</a></li>\n");
         }
         free(entries[i]);
     }
-    fprintf(r->file, "</ul></body></html>\n");
+    browse_puts(&stream, listing, &length, "</ul></body></html>\n");
 
-    /* Flush socket, return OK */
+    /* Keep listing for other requests, terminate stream, return OK */
+    if (length >= 0)
+        cache_put(key, key_length, &stamp, listing, length);
     free(entries);
-    fflush(r->file);
+    stream_close(&stream);
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Read from file, retrying if interrupted.
+ *
+ * @param   fd          Open file descriptor.
+ * @param   buffer      Output buffer.
+ * @param   size        Number of bytes to read.
+ * @return  Number of bytes read (less than size only at end of file), or -1
+ *          on error.
+ **/
+static ssize_t read_file(int fd, char *buffer, size_t size) {
+    size_t length = 0;
+
+    while (length < size) {
+        ssize_t nread = read(fd, buffer + length, size - length);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread < 0)
+            return -1;
+        if (nread == 0)
+            break;
+        length += nread;
+    }
+    return length;
+}
+
+/**
+ * Read small file, copying it from the shared cache if it is there.
+ *
+ * @param   fd          Open file descriptor.
+ * @param   s           Status of open file.
+ * @param   body        Buffer for contents (of at least s->st_size bytes).
+ * @return  Number of bytes read (or -1 on error).
+ *
+ * Files are cached by device and inode, and are only used while their size
+ * and modification time are unchanged.
+ **/
+static ssize_t read_small_file(int fd, const struct stat *s, char *body) {
+    uint64_t key[3] = {'F', s->st_dev, s->st_ino};
+    CacheStamp stamp;
+    ssize_t length;
+
+    cache_stamp(&stamp, s);
+    if ((length = cache_get(key, sizeof(key), &stamp, body, s->st_size)) == s->st_size) {
+        debug("Cache hit for file %ju", (uintmax_t)s->st_ino);
+        return length;
+    }
+
+    length = read_file(fd, body, s->st_size);
+    if (length < s->st_size)
+        return -1;
+    cache_put(key, sizeof(key), &stamp, body, length);
+    return length;
+}
+
 /**
  * Handle file request.
  *
@@ -125,20 +353,27 @@ Status  handle_browse_request(Request *r) {
  * @return  Status of the HTTP file request.
  *
  * This opens and streams the contents of the specified file to the socket.
+ * The file is read directly from its descriptor into buffers on the stack, so
+ * serving it allocates nothing.
  *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_file_request(Request *r) {
     log("HANDLE FILE REQUEST");
-    FILE *fs;
     char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
+    char type[BUFSIZ];
+    const char *mimetype;
+    ssize_t nread;
+    struct stat s;
+    Response response;
+    Stream stream;
 
-    /* Open file for reading */
-    fs = fopen(r->path, "r");
-    if (!fs) {
+    /* Open file for reading (reusing the descriptor from path resolution,
+     * which clear_request closes) */
+    if (r->path_fd < 0)
+        r->path_fd = open(r->path, O_RDONLY);
+    if (r->path_fd < 0 || fstat(r->path_fd, &s) < 0) {
         fprintf(stderr, "File oepn failed: %s\n", strerror(errno));
         log("FILE OPEN FAIlED\n");
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
@@ -146,32 +381,37 @@ Status  handle_file_request(Request *r) {
 
     /* Determine mimetype */
     debug("Determine mimetype");
-    mimetype = determine_mimetype(r->path);
-
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\n");
-    fprintf(r->file, "Content type: %s\n", mimetype);
-    fprintf(r->file, "\r\n");
-
-    /* Read from file and write to socket in chunks */
-    int filewrite;
-    while ((nread = fread(buffer, 1, BUFSIZ, fs)) > 0) {
-        filewrite = fwrite(buffer, 1, nread, r->file);
-        if (filewrite < 0)
+    mimetype = determine_mimetype(r->vhost, r->path, type, sizeof(type));
+    trace(r, MIMETYPE);
+
+    /* Write HTTP Headers with OK status, determined Content-Type, and length */
+    response_init(&response, r, HTTP_STATUS_OK);
+    response_header(&response, "Content-Type", mimetype);
+    stream_open(&stream, &response, s.st_size);
+
+    /* Write small files whole (shared with other workers through the cache) */
+    if (s.st_size <= Settings->cache_max_file) {
+        char body[CACHE_MAX_VALUE];
+        ssize_t length = read_small_file(r->path_fd, &s, body);
+        if (length < 0 || stream_write(&stream, body, length) < 0)
+            goto fail;
+    }
+
+    /* Read from file and write to socket in chunks (only up to the length
+     * sent, in case the file grew since) */
+    else for (off_t left = s.st_size; left > 0; left -= nread) {
+        nread = read_file(r->path_fd, buffer, left < BUFSIZ ? (size_t)left : BUFSIZ);
+        if (nread <= 0 || stream_write(&stream, buffer, nread) < 0)
             goto fail;
     }
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    fflush(r->file);
-    free(mimetype);
+    /* Flush socket, return OK */
+    stream_close(&stream);
     return HTTP_STATUS_OK;
 
 fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    fclose(fs);
-    fflush(r->file);
-    free(mimetype);
+    /* Flush socket, return INTERNAL_SERVER_ERROR */
+    stream_close(&stream);
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
@@ -182,20 +422,33 @@ fail:
  * @return  Status of the HTTP file request.
  *
  * This popens and streams the results of the specified executables to the
- * socket.
+ * socket.  The header block emitted by the script is rewritten so that the
+ * body can be sent with chunked transfer encoding and the script's exit
+ * status is reported in the X-CGI-Status trailer.  Any number of headers
+ * may be emitted, and they are sent as a single fragment of the response.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If the path cannot be popened, or the script's header block does not fit
+ * in BUFSIZ bytes, then handle error with HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 Status  handle_cgi_request(Request *r) {
     log("HANDLE CGI REQUEST");
     FILE *pfs;
     char buffer[BUFSIZ];
-    struct header *header = r->headers;
+    static const struct {
+        HeaderId    id;
+        const char *name;
+    } HeaderVariables[] = {
+        {HEADER_ACCEPT,          "HTTP_ACCEPT"},
+        {HEADER_ACCEPT_ENCODING, "HTTP_ACCEPT_ENCODING"},
+        {HEADER_ACCEPT_LANGUAGE, "HTTP_ACCEPT_LANGUAGE"},
+        {HEADER_CONNECTION,      "HTTP_CONNECTION"},
+        {HEADER_HOST,            "HTTP_HOST"},
+        {HEADER_USER_AGENT,      "HTTP_USER_AGENT"},
+    };
 
     /* Export CGI environment variables from request:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    if (setenv("DOCUMENT_ROOT", RootPath, 1))
+    if (setenv("DOCUMENT_ROOT", r->vhost->root_path, 1))
         fprintf(stderr, "ERROR: Cannot set %s\n", strerror(errno));
     if (setenv("QUERY_STRING", r->query, 1))
         fprintf(stderr, "ERROR: Cannot set %s\n", strerror(errno));
@@ -209,40 +462,113 @@ Status  handle_cgi_request(Request *r) {
         fprintf(stderr, "ERROR: Cannot set %s\n", strerror(errno));
     if (setenv("SCRIPT_FILENAME", r->path, 1))
         fprintf(stderr, "ERROR: Cannot set %s\n", strerror(errno));
-    if (setenv("SERVER_PORT", Port, 1))
+    if (setenv("SERVER_PORT", r->server_port, 1))
         fprintf(stderr, "ERROR: Cannot set %s\n", strerror(errno));
 
     /* Export CGI environment variables from request headers */
-    while (header->name != NULL) {
-        if (streq(header->name, "Accept"))
-            setenv("HTTP_ACCEPT", header->value, 1);
-        if (streq(header->name, "Accept-Encoding"))
-            setenv("HTTP_ACCEPT_ENCODING", header->value, 1);
-        if (streq(header->name, "Accept-Language"))
-            setenv("HTTP_ACCEPT_LANGUAGE", header->value, 1);
-        if (streq(header->name, "Connection"))
-            setenv("HTTP_CONNECTION", header->value, 1);
-        if (streq(header->name, "Host"))
-            setenv("HTTP_HOST", header->value, 1);
-        if (streq(header->name, "User-Agent"))
-            setenv("HTTP_USER_AGENT", header->value, 1);
-        header = header->next;
+    for (size_t i = 0; i < sizeof(HeaderVariables) / sizeof(HeaderVariables[0]); i++) {
+        const char *value = request_header(r, HeaderVariables[i].id);
+        if (value)
+            setenv(HeaderVariables[i].name, value, 1);
+        else
+            unsetenv(HeaderVariables[i].name);
     }
     /* POpen CGI Script */
     pfs = popen(r->path, "r");
     if (!pfs) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Read CGI header block (terminated by an empty line), determining the
+     * status from a CGI status line or Status header and gathering the other
+     * headers into one block (each line ends in at least one byte and grows
+     * by at most one, so head cannot overflow) */
+    char        head[BUFSIZ + BUFSIZ / 2];
+    size_t      head_length = 0;
+    const char *status = "200 OK";
+    size_t  length = 0;
+    char   *line   = buffer;
+    char   *body   = NULL;
+    ssize_t nread;
+    int     pfd    = fileno(pfs);
+
+    while (!body && length < sizeof(buffer) - 1) {
+        nread = read(pfd, buffer + length, sizeof(buffer) - 1 - length);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            break;
+        length += nread;
+
+        char *eol;
+        while (!body && (eol = memchr(line, '\n', buffer + length - line))) {
+            char *next = eol + 1;
+            if (eol > line && eol[-1] == '\r')
+                eol--;
+            *eol = '\0';
+            if (*line == '\0')
+                body = next;
+            else if (strncmp(line, "HTTP/", 5) == 0)
+                status = skip_whitespace(skip_nonwhitespace(line));
+            else if (strncasecmp(line, "Status:", 7) == 0)
+                status = skip_whitespace(line + 7);
+            else if (strchr(line, ':') &&
+                     strncasecmp(line, "Content-Length:", 15) != 0 &&
+                     strncasecmp(line, "Transfer-Encoding:", 18) != 0 &&
+                     strncasecmp(line, "Connection:", 11) != 0) {
+                memcpy(head + head_length, line, eol - line);
+                head_length += eol - line;
+                head[head_length++] = '\r';
+                head[head_length++] = '\n';
+            }
+            line = next;
+        }
+    }
+
+    if (!body) {
+        fprintf(stderr, "CGI script did not produce a header block\n");
         pclose(pfs);
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    /* Copy data from popen to socket */
-    while (fgets(buffer, BUFSIZ, pfs)) {
-        fputs(buffer, r->file);
+    /* Write HTTP Headers, replacing any framing headers from the script */
+    Response response;
+    Stream stream;
+    response_init_text(&response, r, status);
+    response_append(&response, head, head_length);
+    if (r->http_minor >= 1)
+        response_static(&response, "Trailer: X-CGI-Status\r\n");
+    stream_open(&stream, &response, -1);
+
+    /* Stream data from popen to socket, flushing when output stalls */
+    /* Send head now since it refers to the buffer that is reused below */
+    stream_write(&stream, body, buffer + length - body);
+    stream_flush(&stream);
+
+    while (!stream.error) {
+        struct pollfd pollfd = {pfd, POLLIN, 0};
+        int ready = poll(&pollfd, 1, stream_timeout(&stream));
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready == 0) {
+            stream_flush(&stream);
+            continue;
+        }
+
+        nread = read(pfd, buffer, sizeof(buffer));
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            break;
+        stream_write(&stream, buffer, nread);
     }
 
-    /* Close popen, flush socket, return OK */
-    pclose(pfs);
-    fflush(r->file);
+    /* Close popen, report exit status as trailer, terminate stream */
+    int exit_status = pclose(pfs);
+    char code[16];
+    snprintf(code, sizeof(code), "%d", WIFEXITED(exit_status) ? WEXITSTATUS(exit_status) : -1);
+    stream_trailer(&stream, "X-CGI-Status", code);
+    stream_close(&stream);
     return HTTP_STATUS_OK;
 }
 
@@ -252,27 +578,49 @@ Status  handle_cgi_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP error request.
  *
- * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * This writes an HTTP status error code followed by the error page that was
+ * precomputed for it by load_error_pages, using a single system call.
  **/
 Status  handle_error(Request *r, Status status) {
     log("HANDLE ERROR");
-    const char *status_string = http_status_string(status);
+    const ErrorPage *page = error_page(status);
+    Response response;
 
-    /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\n", status_string);
-    fprintf(r->file, "Content type: text/html\n");
-    fprintf(r->file, "\r\n");
-
-    /* Write HTML Description of Error*/
-    fprintf(r->file, "<html><body>");
-    fprintf(r->file, "<h1><strong>%s</strong></h1><h2>I bet you tried to use sudo</h2>", status_string);
-    fprintf(r->file,"<center><img src=\"https://www3.nd.edu/~rbualuan/courses/fundcomp18/pics/ramzinew.jpg\" alt=\"...\"></center>");
-    fprintf(r->file, "<html><body>");
+    /* Write HTTP Header and HTML Description of Error */
+    response_init(&response, r, status);
+    response_append(&response, page->head, page->head_length);
+    response_end_headers(&response);
+    response_append(&response, page->body, page->body_length);
+    response_send(&response, false);
 
     /* Return specified status */
-    fflush(r->file);
     return status;
 }
 
+/**
+ * Handle request from client that exceeded its rate limit.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   retry_after Seconds until the client may make another request.
+ * @return  HTTP_STATUS_TOO_MANY_REQUESTS.
+ *
+ * This is handle_error with a Retry-After header for the specific client.
+ **/
+static Status handle_rate_limited(Request *r, int retry_after) {
+    const ErrorPage *page = error_page(HTTP_STATUS_TOO_MANY_REQUESTS);
+    Response response;
+    char seconds[24];
+
+    seconds[format_unsigned(seconds, retry_after, 10)] = '\0';
+
+    response_init(&response, r, HTTP_STATUS_TOO_MANY_REQUESTS);
+    response_append(&response, page->head, page->head_length);
+    response_header(&response, "Retry-After", seconds);
+    response_end_headers(&response);
+    response_append(&response, page->body, page->body_length);
+    response_send(&response, false);
+
+    return HTTP_STATUS_TOO_MANY_REQUESTS;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
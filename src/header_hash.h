@@ -0,0 +1,39 @@
+/* header_hash.h: Perfect Hash of Well-known Header Names */
+
+/* Generated by bin/gen_headers.py from include/spidey.h; do not edit */
+
+#pragma once
+
+#define HEADER_HASH_SIZE        32
+#define HEADER_HASH_MIN_LENGTH  4
+#define HEADER_HASH_MAX_LENGTH  17
+#define HEADER_HASH(s, n)       ((((unsigned char)(s)[0] | 0x20) * 1 + ((unsigned char)(s)[(n) - 1] | 0x20) * 8 + (n) * 23) & (HEADER_HASH_SIZE - 1))
+
+static const struct {
+    const char *name;
+    size_t      length;
+    HeaderId    id;
+} HeaderHash[HEADER_HASH_SIZE] = {
+    [  1] = {"X-Forwarded-For", 15, HEADER_X_FORWARDED_FOR},
+    [  2] = {"Accept-Language", 15, HEADER_ACCEPT_LANGUAGE},
+    [  3] = {"Referer", 7, HEADER_REFERER},
+    [  4] = {"Host", 4, HEADER_HOST},
+    [  5] = {"Content-Length", 14, HEADER_CONTENT_LENGTH},
+    [  9] = {"If-Range", 8, HEADER_IF_RANGE},
+    [ 11] = {"Accept", 6, HEADER_ACCEPT},
+    [ 13] = {"Range", 5, HEADER_RANGE},
+    [ 14] = {"Cache-Control", 13, HEADER_CACHE_CONTROL},
+    [ 15] = {"Expect", 6, HEADER_EXPECT},
+    [ 18] = {"Accept-Encoding", 15, HEADER_ACCEPT_ENCODING},
+    [ 19] = {"Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING},
+    [ 20] = {"If-None-Match", 13, HEADER_IF_NONE_MATCH},
+    [ 21] = {"Cookie", 6, HEADER_COOKIE},
+    [ 24] = {"If-Modified-Since", 17, HEADER_IF_MODIFIED_SINCE},
+    [ 25] = {"Connection", 10, HEADER_CONNECTION},
+    [ 27] = {"User-Agent", 10, HEADER_USER_AGENT},
+    [ 28] = {"Authorization", 13, HEADER_AUTHORIZATION},
+    [ 30] = {"Upgrade", 7, HEADER_UPGRADE},
+    [ 31] = {"Content-Type", 12, HEADER_CONTENT_TYPE},
+};
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,340 @@
+/* path.c: Request Path Resolution */
+
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Direct-mapped cache of normalized URIs */
+typedef struct {
+    char    uri[PATH_CACHE_URI];        /*< Raw request URI */
+    char    relative[PATH_CACHE_URI];   /*< Normalized path relative to root */
+    bool    valid;                      /*< Whether entry is in use */
+} PathCacheEntry;
+
+/* Pre-opened root directory of each virtual host, with its own path cache
+ * and asset bundle */
+typedef struct {
+    int             fd;                 /*< Root directory (O_PATH) */
+    Bundle          bundle;             /*< Mapped asset bundle (data is NULL if none) */
+    PathCacheEntry *cache;              /*< Cache of normalized URIs */
+    size_t          cache_size;         /*< Number of cache entries */
+} Root;
+
+static Root Roots[CONFIG_MAX_HOSTS];
+static int  RootsCount    = 0;
+static bool Openat2Broken = false;
+
+/**
+ * Open root directories used to resolve request paths.
+ *
+ * @param   config      Configuration whose virtual host roots are opened.
+ * @return  -1 on error and 0 on success.
+ *
+ * This should be called once at startup (before forking) and again whenever
+ * the configuration is reloaded.  Each virtual host gets a path cache with
+ * path_cache_size entries, so hosts never see each other's entries.  Hosts
+ * with a bundle also get it mapped here.  If any root or bundle cannot be
+ * opened, the current roots are kept.
+ **/
+int open_roots(const Config *config) {
+    int    fds[CONFIG_MAX_HOSTS];
+    Bundle bundles[CONFIG_MAX_HOSTS] = {{0}};
+
+    for (int i = 0; i < config->nhosts; i++) {
+        fds[i] = open(config->hosts[i].root_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fds[i] < 0)
+            fprintf(stderr, "Error opening root %s: %s\n", config->hosts[i].root_path, strerror(errno));
+        if (fds[i] < 0 || (config->hosts[i].bundle && bundle_open(config->hosts[i].bundle, &bundles[i]) < 0)) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+            while (i-- > 0) {
+                close(fds[i]);
+                bundle_close(&bundles[i]);
+            }
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < RootsCount; i++) {
+        close(Roots[i].fd);
+        free(Roots[i].cache);
+        bundle_close(&Roots[i].bundle);
+    }
+
+    for (int i = 0; i < config->nhosts; i++) {
+        Roots[i].fd         = fds[i];
+        Roots[i].bundle     = bundles[i];
+        Roots[i].cache_size = config->path_cache_size;
+        Roots[i].cache      = Roots[i].cache_size ? calloc(Roots[i].cache_size, sizeof(PathCacheEntry)) : NULL;
+        if (!Roots[i].cache)
+            Roots[i].cache_size = 0;
+    }
+    RootsCount = config->nhosts;
+    return 0;
+}
+
+/**
+ * Return asset bundle of virtual host.
+ *
+ * @param   host        Virtual host (or NULL for the default host).
+ * @return  Mapped bundle (or NULL if the host has none).
+ **/
+const Bundle * root_bundle(const VirtualHost *host) {
+    int index = host ? host->index : 0;
+
+    if (index >= RootsCount || !Roots[index].bundle.data)
+        return NULL;
+    return &Roots[index].bundle;
+}
+
+/**
+ * Convert hexadecimal digit to its value.
+ *
+ * @param   c           Character.
+ * @return  Value of digit or -1 if c is not a hexadecimal digit.
+ **/
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Lexically normalize request URI into a path relative to the root.
+ *
+ * @param   uri         Request URI (without query).
+ * @param   out         Output buffer.
+ * @param   size        Size of output buffer.
+ * @return  -1 if the URI is malformed or escapes the root and 0 on success.
+ *
+ * This percent-decodes the URI, drops empty and "." segments, and collapses
+ * ".." segments.  A ".." that would climb above the root, an encoded NUL, or
+ * a URI that does not fit in the output buffer is rejected.  The root itself
+ * normalizes to the empty string.
+ **/
+int normalize_uri(const char *uri, char *out, size_t size) {
+    size_t length = 0;
+
+    if (!uri || *uri != '/' || size == 0)
+        return -1;
+
+    while (*uri) {
+        /* Decode next segment */
+        char   segment[NAME_MAX + 1];
+        size_t n = 0;
+
+        while (*uri == '/')
+            uri++;
+        while (*uri && *uri != '/') {
+            char c = *uri++;
+            if (c == '%') {
+                int hi = hex_value(uri[0]);
+                int lo = hi < 0 ? -1 : hex_value(uri[1]);
+                if (lo < 0)
+                    return -1;
+                c    = (char)(hi << 4 | lo);
+                uri += 2;
+                if (c == '\0')
+                    return -1;
+                if (c == '/')
+                    break;
+            }
+            if (n >= sizeof(segment) - 1)     /* longer than NAME_MAX */
+                return -1;
+            segment[n++] = c;
+        }
+
+        /* Apply segment */
+        if (n == 0 || (n == 1 && segment[0] == '.'))
+            continue;
+
+        if (n == 2 && segment[0] == '.' && segment[1] == '.') {
+            if (length == 0)
+                return -1;
+            while (length > 0 && out[length - 1] != '/')
+                length--;
+            if (length > 0)
+                length--;
+            continue;
+        }
+
+        if (length + (length ? 1 : 0) + n + 1 > size)
+            return -1;
+        if (length)
+            out[length++] = '/';
+        memcpy(out + length, segment, n);
+        length += n;
+    }
+
+    out[length] = '\0';
+    return 0;
+}
+
+/**
+ * Match normalized path against configured URI prefix.
+ *
+ * @param   path        Normalized path (see normalize_uri).
+ * @param   prefix      URI prefix (normalized the same way).
+ * @return  Length of the normalized prefix if it matches whole segments of
+ *          path, otherwise -1.
+ *
+ * Since both sides are normalized, "//song.txt" and "/%73ong.txt" match the
+ * prefix "/song.txt", while "/api" matches "/api/hello" but not "/apiary".
+ **/
+int match_uri_prefix(const char *path, const char *prefix) {
+    char   normalized[PATH_MAX];
+    size_t length;
+
+    if (normalize_uri(prefix, normalized, sizeof(normalized)) < 0)
+        return -1;
+
+    length = strlen(normalized);
+    if (strncmp(path, normalized, length) != 0)
+        return -1;
+    if (length > 0 && path[length] != '\0' && path[length] != '/')
+        return -1;
+    return length;
+}
+
+/**
+ * Normalize request URI, consulting the cache of recently seen URIs.
+ *
+ * @param   root        Root whose cache is consulted.
+ * @param   uri         Request URI (without query).
+ * @param   out         Output buffer (PATH_MAX bytes).
+ * @return  -1 if the URI is rejected and 0 on success.
+ *
+ * Only URIs shorter than PATH_CACHE_URI are cached (if the cache is
+ * enabled).  A normalized path is never longer than its URI, so cached
+ * results always fit.
+ **/
+static int normalize_cached(Root *root, const char *uri, char *out) {
+    size_t length = strlen(uri);
+    if (length >= PATH_CACHE_URI || root->cache_size == 0)
+        return normalize_uri(uri, out, PATH_MAX);
+
+    /* FNV-1a hash of URI selects the cache slot */
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)uri[i]) * 16777619u;
+
+    PathCacheEntry *entry = &root->cache[hash % root->cache_size];
+    if (entry->valid && streq(entry->uri, uri)) {
+        memcpy(out, entry->relative, strlen(entry->relative) + 1);
+        return 0;
+    }
+
+    if (normalize_uri(uri, out, PATH_MAX) < 0)
+        return -1;
+
+    memcpy(entry->uri, uri, length + 1);
+    memcpy(entry->relative, out, strlen(out) + 1);
+    entry->valid = true;
+    return 0;
+}
+
+/**
+ * Open path relative to root without leaving it.
+ *
+ * @param   root        Root directory.
+ * @param   relative    Normalized path relative to root.
+ * @param   flags       Open flags.
+ * @return  File descriptor, or -1 on error (errno is ENOSYS if openat2(2) is
+ *          not supported).
+ **/
+static int open_beneath(const Root *root, const char *relative, int flags) {
+    struct open_how how = {
+        .flags   = flags | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+
+    if (Openat2Broken) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int fd = syscall(SYS_openat2, root->fd, *relative ? relative : ".", &how, sizeof(how));
+    if (fd < 0 && errno == ENOSYS)
+        Openat2Broken = true;
+    return fd;
+}
+
+/**
+ * Resolve request URI to a path and open descriptor beneath the root.
+ *
+ * @param   r           Request structure.
+ * @return  HTTP_STATUS_OK on success, otherwise the error Status.
+ *
+ * This sets r->path to the full path of the resource beneath the root of the
+ * request's virtual host and r->path_fd to a descriptor opened on it,
+ * checking containment with a single openat2(2) call instead of walking each
+ * component with realpath(3).  Symbolic links are followed only if they stay
+ * beneath the root.
+ *
+ * If openat2(2) is not available, this falls back to determine_request_path
+ * on the same normalized path (so encoded URIs resolve alike) and r->path_fd
+ * is left as -1.
+ **/
+Status resolve_request_path(Request *r) {
+    char relative[PATH_MAX];
+    const VirtualHost *host = r->vhost ? r->vhost : &Settings->hosts[0];
+
+    if (RootsCount == 0 && open_roots(Settings) < 0)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    if (host->index >= RootsCount)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+
+    Root *root = &Roots[host->index];
+    if (normalize_cached(root, r->uri, relative) < 0)
+        return HTTP_STATUS_NOT_FOUND;
+
+    /* Open for reading (without blocking on FIFOs); executables without read
+     * permission get O_PATH */
+    int fd = open_beneath(root, relative, O_RDONLY | O_NONBLOCK);
+    if (fd < 0 && errno == EACCES)
+        fd = open_beneath(root, relative, O_PATH);
+
+    if (fd < 0 && errno == ENOSYS) {
+        char *path = determine_request_path(host->root_path, relative);
+        if (!path)
+            return HTTP_STATUS_NOT_FOUND;
+        if ((r->path = request_alloc(r, strlen(path) + 1)))
+            strcpy(r->path, path);
+        free(path);
+        return r->path ? HTTP_STATUS_OK : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    if (fd < 0)
+        return errno == EACCES ? HTTP_STATUS_FORBIDDEN : HTTP_STATUS_NOT_FOUND;
+
+    size_t root_length = strlen(host->root_path);
+    size_t length      = strlen(relative);
+    r->path = request_alloc(r, root_length + 1 + length + 1);
+    if (!r->path) {
+        close(fd);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    memcpy(r->path, host->root_path, root_length);
+    if (length) {
+        r->path[root_length] = '/';
+        memcpy(r->path + root_length + 1, relative, length + 1);
+    } else {
+        r->path[root_length] = '\0';
+    }
+
+    r->path_fd = fd;
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,142 @@
+/* pool.c: Buffer Pool */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Buffers come in power of two size classes from POOL_MIN_SIZE upwards */
+#define POOL_CLASSES        5           /* 4K, 8K, 16K, 32K, 64K */
+#define POOL_MAX_SIZE       (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+
+typedef struct {
+    void       *idle[POOL_MAX_IDLE];    /*< Idle buffers (most recently used last) */
+    int         nidle;                  /*< Number of idle buffers */
+    int         ntrimmed;               /*< Idle buffers whose pages were released */
+} PoolClass;
+
+/* Idle buffers of this process */
+static PoolClass Pool[POOL_CLASSES];
+
+/**
+ * Determine size class of buffer.
+ *
+ * @param   size        Size of buffer.
+ * @return  Index of size class (or POOL_CLASSES if it is too large to pool).
+ **/
+static int pool_class(size_t size) {
+    int c = 0;
+
+    while (c < POOL_CLASSES && (size_t)POOL_MIN_SIZE << c < size)
+        c++;
+    return c;
+}
+
+/**
+ * Determine size of buffer allocated for a request.
+ *
+ * @param   size        Number of bytes needed.
+ * @return  Usable size of the buffer pool_get returns.
+ **/
+size_t pool_size(size_t size) {
+    int c = pool_class(size);
+    return c < POOL_CLASSES ? (size_t)POOL_MIN_SIZE << c : size;
+}
+
+/**
+ * Take buffer from pool (allocating one if none of its size is idle).
+ *
+ * @param   size        Number of bytes needed.
+ * @return  Page-aligned buffer of pool_size(size) bytes (or NULL on error).
+ *
+ * The buffer must be returned with pool_put.  Buffers larger than the largest
+ * size class are simply allocated and freed.
+ **/
+void * pool_get(size_t size) {
+    int   c = pool_class(size);
+    void *buffer;
+
+    if (c < POOL_CLASSES && Pool[c].nidle > 0) {
+        buffer = Pool[c].idle[--Pool[c].nidle];
+        if (Pool[c].ntrimmed > Pool[c].nidle)
+            Pool[c].ntrimmed = Pool[c].nidle;
+        return buffer;
+    }
+
+    if (c == POOL_CLASSES)
+        buffer = malloc(size);
+    else if ((errno = posix_memalign(&buffer, POOL_MIN_SIZE, pool_size(size))) != 0)
+        buffer = NULL;
+    if (!buffer)
+        fprintf(stderr, "Error with allocation (Pool): %s\n", strerror(errno));
+    return buffer;
+}
+
+/**
+ * Return buffer to pool.
+ *
+ * @param   buffer      Buffer from pool_get (or NULL).
+ * @param   size        Size the buffer was requested with.
+ *
+ * Up to pool_idle_buffers buffers of each size are kept for reuse; any more
+ * than that are freed.
+ **/
+void pool_put(void *buffer, size_t size) {
+    int c = pool_class(size);
+
+    if (!buffer)
+        return;
+    if (c == POOL_CLASSES || Pool[c].nidle >= Settings->pool_idle_buffers) {
+        free(buffer);
+        return;
+    }
+    Pool[c].idle[Pool[c].nidle++] = buffer;
+}
+
+/**
+ * Determine whether idle buffers still hold memory.
+ *
+ * @return  Whether pool_trim has anything to release.
+ **/
+bool pool_dirty(void) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (Pool[c].ntrimmed < Pool[c].nidle)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Release memory of idle buffers.
+ *
+ * This is called once a process has been idle for POOL_IDLE_MS.  The pages
+ * of idle buffers are marked with MADV_FREE, so the kernel reclaims them only
+ * under memory pressure, while the buffers stay in the pool: reusing one
+ * costs at most a page fault per page instead of an allocation.
+ **/
+void pool_trim(void) {
+    size_t released = 0;
+
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        size_t size = (size_t)POOL_MIN_SIZE << c;
+
+        for (int i = Pool[c].ntrimmed; i < Pool[c].nidle; i++) {
+#ifdef MADV_FREE
+            if (madvise(Pool[c].idle[i], size, MADV_FREE) == 0) {
+                released += size;
+                continue;
+            }
+#endif
+            if (madvise(Pool[c].idle[i], size, MADV_DONTNEED) == 0)
+                released += size;
+        }
+        Pool[c].ntrimmed = Pool[c].nidle;
+    }
+
+    log("Released %zu bytes of idle buffers", released);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
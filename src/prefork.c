@@ -0,0 +1,115 @@
+/* prefork.c: Preforking HTTP Server */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/**
+ * Accept and handle connections in a worker process until draining.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nodes       Node of each server socket (-1 = shared by all nodes).
+ * @param   nsfds       Number of server sockets.
+ * @param   cpu         Index in Machine of CPU to pin worker to (or -1).
+ *
+ * A pinned worker only accepts from the sockets of its own node (and from
+ * sockets shared by all nodes), since connections received by other nodes
+ * are steered to their sockets.  With fewer workers than nodes, some nodes
+ * would have no worker, so then every worker accepts from every socket.
+ **/
+static void prefork_worker(const int *sfds, const int *nodes, int nsfds, int cpu) {
+    int local[CONFIG_MAX_SOCKETS];
+    int nlocal = 0;
+    int node   = cpu >= 0 && Settings->workers >= Machine.nnodes ? Machine.node[cpu] : -1;
+    int sfd;
+
+    control_worker();
+    if (cpu >= 0)
+        topology_bind(&Machine, cpu);
+    for (int i = 0; i < nsfds; i++) {
+        if (node < 0 || nodes[i] < 0 || nodes[i] == node)
+            local[nlocal++] = sfds[i];
+    }
+
+    while ((sfd = wait_for_connection(local, nlocal)) >= 0) {
+        Request *r = accept_request(sfd);
+        if (!r)
+            continue;
+        handle_connection(r);
+        free_request(r);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Start workers until the configured number are running.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nodes       Node of each server socket (-1 = shared by all nodes).
+ * @param   nsfds       Number of server sockets.
+ *
+ * With cpu_affinity, each worker is placed on the CPU with the fewest
+ * current workers (see topology_place).
+ **/
+static void prefork_spawn(const int *sfds, const int *nodes, int nsfds) {
+    int load[TOPOLOGY_MAX_CPUS];
+
+    for (size_t count = worker_count(true); count < (size_t)Settings->workers; count++) {
+        int cpu = -1;
+        if (Settings->cpu_affinity) {
+            worker_load(load, Machine.ncpus);
+            cpu = topology_place(&Machine, load);
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Error with forking: %s\n", strerror(errno));
+            return;
+        }
+        if (pid == 0)
+            prefork_worker(sfds, nodes, nsfds, cpu);
+        add_worker(pid, cpu);
+    }
+}
+
+/**
+ * Handle HTTP requests with a fixed pool of worker processes.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nodes       Node of each server socket (-1 = shared by all nodes).
+ * @param   nsfds       Number of server sockets.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Each worker accepts and handles one connection at a time, so the cost of
+ * fork(2) is not paid per connection.  The parent only supervises: workers
+ * that exit are replaced, and after a reload the current workers are retired
+ * (they finish their connections) and replaced by workers started with the
+ * new configuration.
+ *
+ * On SIGTERM the parent waits for the workers to drain.
+ **/
+int prefork_server(const int *sfds, const int *nodes, int nsfds) {
+    log("Prefork Server (%d workers)", Settings->workers);
+    int event;
+
+    prefork_spawn(sfds, nodes, nsfds);
+    while ((event = wait_for_signal(sfds, nsfds)) >= 0) {
+        if (event > 0)
+            retire_workers();
+        reap_workers();
+        prefork_spawn(sfds, nodes, nsfds);
+    }
+
+    /* Close server sockets and let workers finish */
+    for (int i = 0; i < nsfds; i++)
+        close(sfds[i]);
+    drain_workers();
+    log("Server drained");
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
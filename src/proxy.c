@@ -0,0 +1,947 @@
+/* proxy.c: Reverse Proxy to Upstream Servers */
+
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Shared state slots for upstreams and routes (a power of two) */
+#define PROXY_SLOTS         256
+
+/* Longest upstream response head, and bytes read from upstreams at once */
+#define PROXY_BUFFER_SIZE   16384
+
+/* Fragments of a forwarded request head (four per header) */
+#define PROXY_MAX_IOV       (4 * REQUEST_MAX_HEADERS + 16)
+
+typedef struct {
+    _Atomic uint64_t key;               /*< Hash of upstream address or route (0 = unused) */
+    atomic_int       active;            /*< Requests in flight to upstream */
+    atomic_long      failed_until;      /*< Time (ms) until failed upstream is probed (0 = healthy) */
+    atomic_uint      next;              /*< Next upstream of route (for round-robin) */
+} ProxySlot;
+
+typedef struct {
+    uint64_t    key;                    /*< Hash of upstream address */
+    int         fd;                     /*< Idle upstream socket */
+    long        idle;                   /*< Time (ms) connection became idle */
+} PooledConnection;
+
+typedef struct {
+    const char *address;                /*< Upstream address */
+    uint64_t    key;                    /*< Hash of upstream address */
+    ProxySlot  *slot;                   /*< Shared state of upstream */
+    int         fd;                     /*< Upstream socket */
+    bool        reused;                 /*< Whether connection came from the pool */
+    char        buffer[PROXY_BUFFER_SIZE];  /*< Data read from upstream */
+    size_t      start;                  /*< Offset of first unconsumed byte */
+    size_t      end;                    /*< Offset past last byte read */
+} Upstream;
+
+/* Upstream health and load shared by all worker processes */
+static ProxySlot *Slots    = NULL;
+static ProxySlot  Fallback = {0};
+
+/* Idle upstream connections of this process */
+static PooledConnection Pool[PROXY_POOL_MAX];
+static int              PoolCount = 0;
+
+/**
+ * Allocate upstream state in memory shared with forked workers.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any worker processes are forked.  Slots are
+ * keyed by upstream address rather than configuration order so that health
+ * and load survive reloads.
+ **/
+int proxy_init(void) {
+    Slots = mmap(NULL, PROXY_SLOTS * sizeof(ProxySlot), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Slots == MAP_FAILED) {
+        fprintf(stderr, "Error with mmap: %s\n", strerror(errno));
+        Slots = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compute hash of string.
+ *
+ * @param   s           String.
+ * @param   seed        Value mixed into hash (ie. virtual host index).
+ * @return  Non-zero FNV-1a hash of string.
+ **/
+static uint64_t proxy_hash(const char *s, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for (; *s; s++)
+        hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+    return hash ? hash : 1;
+}
+
+/**
+ * Find shared state slot for key, claiming one if there is none.
+ *
+ * @param   key         Hash of upstream address or route.
+ * @return  Slot for key (a private slot if the shared table is full).
+ **/
+static ProxySlot * proxy_slot(uint64_t key) {
+    if (!Slots)
+        return &Fallback;
+
+    for (size_t n = 0, i = key & (PROXY_SLOTS - 1); n < PROXY_SLOTS; n++, i = (i + 1) & (PROXY_SLOTS - 1)) {
+        uint64_t current = atomic_load(&Slots[i].key);
+        if (current == key)
+            return &Slots[i];
+        if (current == 0) {
+            if (atomic_compare_exchange_strong(&Slots[i].key, &current, key) || current == key)
+                return &Slots[i];
+        }
+    }
+    return &Fallback;
+}
+
+/**
+ * Find longest proxied route prefix that matches request URI.
+ *
+ * @param   r           HTTP Request structure (with virtual host).
+ * @return  Route to forward request on (or NULL if it is served locally).
+ *
+ * Prefixes are matched on whole segments of the normalized path (see
+ * match_uri_prefix), so "//api/hello" is proxied like "/api/hello", while
+ * "/apiary" is not proxied by a route for "/api".
+ **/
+const ProxyRoute * proxy_route(const Request *r) {
+    const VirtualHost *host  = r->vhost ? r->vhost : &Settings->hosts[0];
+    const ProxyRoute  *route = NULL;
+    char path[PATH_MAX];
+    int  longest = -1;
+
+    if (host->nproxies == 0 || normalize_uri(r->uri, path, sizeof(path)) < 0)
+        return NULL;
+
+    for (int i = 0; i < host->nproxies; i++) {
+        int length = match_uri_prefix(path, host->proxies[i].prefix);
+
+        if (length >= 0 && length >= longest) {
+            route   = &host->proxies[i];
+            longest = length;
+        }
+    }
+    return route;
+}
+
+/**
+ * Choose upstream for request.
+ *
+ * @param   route       Proxied route.
+ * @param   slots       Shared state of each upstream of route.
+ * @param   state       Shared state of route.
+ * @param   tried       Bit mask of upstreams already tried for request.
+ * @return  Index of upstream (or -1 if every upstream has been tried).
+ *
+ * Healthy upstreams are taken in turn (round-robin) or by fewest requests in
+ * flight across all workers (least-connections, ties taken in turn).  An
+ * upstream that failed is skipped for proxy_fail_timeout seconds, after which
+ * a single request claims it as a health check: success returns it to
+ * service, while failure skips it for another proxy_fail_timeout.  If every
+ * upstream is failing, the one that failed first is tried anyway.
+ **/
+static int proxy_select(const ProxyRoute *route, ProxySlot **slots, ProxySlot *state, unsigned tried) {
+    long     now      = monotonic_ms();
+    unsigned start    = atomic_fetch_add(&state->next, 1);
+    int      best     = -1;
+    int      fallback = -1;
+    long     oldest   = LONG_MAX;
+
+    for (int n = 0; n < route->nupstreams; n++) {
+        int i = (start + n) % route->nupstreams;
+        if (tried & (1u << i))
+            continue;
+
+        long failed = atomic_load(&slots[i]->failed_until);
+        if (failed) {
+            if (failed <= now && atomic_compare_exchange_strong(&slots[i]->failed_until, &failed,
+                                                                now + Settings->proxy_fail_timeout * 1000L)) {
+                log("Checking upstream %s", route->upstreams[i]);
+                return i;
+            }
+            if (failed < oldest) {
+                oldest   = failed;
+                fallback = i;
+            }
+            continue;
+        }
+
+        if (Settings->proxy_balance == BALANCE_ROUND_ROBIN)
+            return i;
+        if (best < 0 || atomic_load(&slots[i]->active) < atomic_load(&slots[best]->active))
+            best = i;
+    }
+    return best >= 0 ? best : fallback;
+}
+
+/**
+ * Take idle connection to upstream from the pool.
+ *
+ * @param   key         Hash of upstream address.
+ * @return  Connected socket (or -1 if there is no usable idle connection).
+ *
+ * Connections the upstream has closed (or sent unexpected data on) while
+ * idle are discarded, which a non-blocking peek detects without waiting.
+ **/
+static int proxy_pool_take(uint64_t key) {
+    long now = monotonic_ms();
+
+    for (int i = PoolCount - 1; i >= 0; i--) {
+        if (Pool[i].key != key)
+            continue;
+
+        PooledConnection c = Pool[i];
+        Pool[i] = Pool[--PoolCount];
+
+        char byte;
+        if (now - c.idle <= Settings->proxy_idle_timeout * 1000L &&
+            recv(c.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return c.fd;
+        close(c.fd);
+    }
+    return -1;
+}
+
+/**
+ * Return idle connection to upstream to the pool.
+ *
+ * @param   key         Hash of upstream address.
+ * @param   fd          Connected socket with no response pending.
+ *
+ * Connections idle for longer than proxy_idle_timeout are closed first.  If
+ * the pool still holds proxy_pool_size connections, the connection is closed.
+ **/
+static void proxy_pool_put(uint64_t key, int fd) {
+    long now = monotonic_ms();
+
+    for (int i = PoolCount - 1; i >= 0; i--) {
+        if (now - Pool[i].idle > Settings->proxy_idle_timeout * 1000L) {
+            close(Pool[i].fd);
+            Pool[i] = Pool[--PoolCount];
+        }
+    }
+
+    if (PoolCount >= Settings->proxy_pool_size) {
+        close(fd);
+        return;
+    }
+    Pool[PoolCount++] = (PooledConnection){key, fd, now};
+}
+
+/**
+ * Record failure of upstream so that it is skipped for a while.
+ *
+ * @param   u           Upstream.
+ **/
+static void proxy_failed(Upstream *u) {
+    atomic_store(&u->slot->failed_until, monotonic_ms() + Settings->proxy_fail_timeout * 1000L);
+    log("Upstream %s failed: %s", u->address, strerror(errno));
+}
+
+/**
+ * Record that upstream responded, returning it to service if it had failed.
+ *
+ * @param   u           Upstream.
+ **/
+static void proxy_healthy(Upstream *u) {
+    if (atomic_load(&u->slot->failed_until) && atomic_exchange(&u->slot->failed_until, 0))
+        log("Upstream %s recovered", u->address);
+}
+
+/**
+ * Read more data from upstream into its buffer.
+ *
+ * @param   u           Upstream.
+ * @param   s           Response stream to flush while waiting (or NULL).
+ * @return  Number of bytes read (0 at end of file, -1 on error or timeout).
+ *
+ * Consumed data is discarded first.  Buffered response data is flushed to the
+ * client when the upstream stalls, as for CGI output.  Waiting longer than
+ * proxy_timeout seconds for any data fails with ETIMEDOUT.
+ **/
+static ssize_t upstream_fill(Upstream *u, Stream *s) {
+    if (u->start == u->end)
+        u->start = u->end = 0;
+    else if (u->end == sizeof(u->buffer)) {
+        memmove(u->buffer, u->buffer + u->start, u->end - u->start);
+        u->end  -= u->start;
+        u->start = 0;
+    }
+
+    long deadline = monotonic_ms() + Settings->proxy_timeout * 1000L;
+    while (true) {
+        long remaining = deadline - monotonic_ms();
+        if (remaining <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        int flush = s ? stream_timeout(s) : -1;
+        struct pollfd pollfd = {u->fd, POLLIN, 0};
+        int ready = poll(&pollfd, 1, flush >= 0 && flush < remaining ? flush : (int)remaining);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            return -1;
+        if (ready == 0) {
+            if (s)
+                stream_flush(s);
+            continue;
+        }
+
+        ssize_t nread = read(u->fd, u->buffer + u->end, sizeof(u->buffer) - u->end);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread > 0)
+            u->end += nread;
+        return nread;
+    }
+}
+
+/**
+ * Read line from upstream.
+ *
+ * @param   u           Upstream.
+ * @param   s           Response stream to flush while waiting (or NULL).
+ * @return  Line without its CRLF or LF (valid until the next read), or NULL
+ *          on error or end of file.
+ **/
+static char * upstream_line(Upstream *u, Stream *s) {
+    while (true) {
+        char *line = u->buffer + u->start;
+        char *eol  = memchr(line, '\n', u->end - u->start);
+        if (eol) {
+            u->start = eol + 1 - u->buffer;
+            if (eol > line && eol[-1] == '\r')
+                eol--;
+            *eol = '\0';
+            return line;
+        }
+        if (u->start == 0 && u->end == sizeof(u->buffer)) {
+            errno = EMSGSIZE;
+            return NULL;
+        }
+        if (upstream_fill(u, s) <= 0)
+            return NULL;
+    }
+}
+
+/**
+ * Read until a complete response head is buffered.
+ *
+ * @param   u           Upstream.
+ * @return  -1 on error and 0 on success.
+ *
+ * Once the whole head is buffered, its lines can be parsed in place without
+ * another read moving them.
+ **/
+static int upstream_head(Upstream *u) {
+    while (true) {
+        char *end = u->buffer + u->end;
+        for (char *p = u->buffer + u->start; (p = memchr(p, '\n', end - p)); p++) {
+            if ((p + 1 < end && p[1] == '\n') || (p + 2 < end && p[1] == '\r' && p[2] == '\n'))
+                return 0;
+        }
+        if (u->start == 0 && u->end == sizeof(u->buffer)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        ssize_t nread = upstream_fill(u, NULL);
+        if (nread <= 0) {
+            if (nread == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+    }
+}
+
+/**
+ * Relay response body from upstream to client.
+ *
+ * @param   u           Upstream.
+ * @param   s           Response stream.
+ * @param   length      Number of bytes to relay (or -1 for all until the
+ *                      upstream closes the connection).
+ * @return  -1 on error and 0 on success.
+ **/
+static int upstream_relay(Upstream *u, Stream *s, ssize_t length) {
+    while (length != 0) {
+        if (u->start == u->end) {
+            ssize_t nread = upstream_fill(u, s);
+            if (nread < 0 || (nread == 0 && length > 0))
+                return -1;
+            if (nread == 0)
+                return 0;
+        }
+
+        size_t available = u->end - u->start;
+        if (length > 0 && (size_t)length < available)
+            available = length;
+        if (stream_write(s, u->buffer + u->start, available) < 0)
+            return -1;
+        u->start += available;
+        if (length > 0)
+            length -= available;
+    }
+    return 0;
+}
+
+/**
+ * Relay chunked response body from upstream to client.
+ *
+ * @param   u           Upstream.
+ * @param   s           Response stream.
+ * @return  -1 on error and 0 on success.
+ *
+ * Chunks are decoded and written to the stream, which frames the body again
+ * for the client (so HTTP/1.0 clients get a plain body).  Upstream trailers
+ * are discarded.
+ **/
+static int upstream_relay_chunked(Upstream *u, Stream *s) {
+    char *line;
+
+    while ((line = upstream_line(u, s))) {
+        char *end;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (end == line || !strchr("0123456789abcdefABCDEF", *line) || size > SSIZE_MAX)
+            return -1;
+        if (size == 0)
+            break;
+        if (upstream_relay(u, s, size) < 0 || !(line = upstream_line(u, s)) || *line)
+            return -1;
+    }
+
+    while (line && *line)
+        line = upstream_line(u, s);
+    return line ? 0 : -1;
+}
+
+/**
+ * Send data to upstream.
+ *
+ * @param   u           Upstream.
+ * @param   data        Data to send.
+ * @param   n           Number of bytes to send.
+ * @return  -1 on error and 0 on success.
+ **/
+static int upstream_send(Upstream *u, const void *data, size_t n) {
+    struct iovec iov = {(void *)data, n};
+    return send_iovec(u->fd, &iov, 1, false);
+}
+
+/**
+ * Check whether comma separated header value lists token.
+ *
+ * @param   list        Header value (or NULL).
+ * @param   token       Token (ie. "close").
+ * @return  Whether token is in list (ignoring case).
+ **/
+static bool header_lists(const char *list, const char *token) {
+    size_t length = strlen(token);
+
+    while (list && *list) {
+        list = skip_whitespace((char *)list);
+        size_t n = strcspn(list, ", \t");
+        if (n == length && strncasecmp(list, token, length) == 0)
+            return true;
+        list += n;
+        list += strspn(list, ", \t");
+    }
+    return false;
+}
+
+/**
+ * Check whether request header is hop-by-hop (and so is not forwarded).
+ *
+ * @param   r           HTTP Request structure.
+ * @param   header      Request header.
+ * @return  Whether header only applies to the client connection.
+ *
+ * Besides the standard hop-by-hop headers, this covers any header named in
+ * the Connection header, Expect (handled here), and X-Forwarded-For (which is
+ * extended with the client address).
+ **/
+static bool proxy_hop_header(const Request *r, const Header *header) {
+    switch (header->id) {
+        case HEADER_CONNECTION:
+        case HEADER_EXPECT:
+        case HEADER_UPGRADE:
+        case HEADER_X_FORWARDED_FOR:
+            return true;
+        case HEADER_OTHER:
+            return strieq(header->name, "Keep-Alive") || strieq(header->name, "Proxy-Connection") ||
+                   strieq(header->name, "TE") || strieq(header->name, "Trailer") ||
+                   strieq(header->name, "Proxy-Authorization") ||
+                   header_lists(request_header(r, HEADER_CONNECTION), header->name);
+        default:
+            return false;
+    }
+}
+
+/**
+ * Relay request body from client to upstream.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   u           Upstream.
+ * @param   length      Content-Length of body (or -1 if chunked).
+ * @return  HTTP_STATUS_OK on success, HTTP_STATUS_BAD_REQUEST if the client
+ *          body is malformed or incomplete, and HTTP_STATUS_BAD_GATEWAY if
+ *          the upstream cannot be sent to.
+ *
+ * Bodies are streamed through a fixed buffer.  Chunked bodies are relayed as
+ * they are, with only the chunk sizes parsed to find the end of the body.
+ **/
+static Status proxy_relay_body(Request *r, Upstream *u, long long length) {
+    char    buffer[BUFSIZ];
+    bool    chunked = length < 0;
+    ssize_t nread;
+
+    while (true) {
+        if (chunked) {
+            /* Relay chunk size line and determine length of chunk data */
+            if (!request_gets(r, buffer, sizeof(buffer)) || !strchr(buffer, '\n'))
+                return HTTP_STATUS_BAD_REQUEST;
+            char *end;
+            length = strtoll(buffer, &end, 16);
+            if (end == buffer || !strchr("0123456789abcdefABCDEF", *buffer) || length < 0)
+                return HTTP_STATUS_BAD_REQUEST;
+            if (upstream_send(u, buffer, strlen(buffer)) < 0)
+                return HTTP_STATUS_BAD_GATEWAY;
+            if (length == 0)
+                break;
+            length += 2;        /* CRLF after chunk data */
+        }
+
+        while (length > 0) {
+            nread = request_read(r, buffer, length < (long long)sizeof(buffer) ? (size_t)length : sizeof(buffer));
+            if (nread <= 0)
+                return HTTP_STATUS_BAD_REQUEST;
+            if (upstream_send(u, buffer, nread) < 0)
+                return HTTP_STATUS_BAD_GATEWAY;
+            length -= nread;
+        }
+
+        if (!chunked)
+            return HTTP_STATUS_OK;
+    }
+
+    /* Relay trailers up to and including the empty line */
+    do {
+        if (!request_gets(r, buffer, sizeof(buffer)))
+            return HTTP_STATUS_BAD_REQUEST;
+        if (upstream_send(u, buffer, strlen(buffer)) < 0)
+            return HTTP_STATUS_BAD_GATEWAY;
+    } while (!streq(buffer, "\r\n") && !streq(buffer, "\n"));
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Build request target forwarded upstream.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Normalized path of the request URI, percent-encoded again (or NULL
+ *          on error).
+ *
+ * The route was chosen on the normalized path (see proxy_route), so that is
+ * what is forwarded: an upstream that does not decode "%2F" would otherwise
+ * see a URI such as "/admin/x%2F..%2F..%2Fapi/h" under a prefix that is not
+ * proxied.  Characters other than unreserved ones, sub-delimiters, ':', '@',
+ * and the separating '/' are encoded, and a trailing '/' is kept.  The target
+ * lives in the memory of the request (see request_alloc).
+ **/
+static char * proxy_target(Request *r) {
+    static const char Hex[] = "0123456789ABCDEF";
+    char   path[PATH_MAX];
+    size_t length = strlen(r->uri);
+
+    if (normalize_uri(r->uri, path, sizeof(path)) < 0)
+        return NULL;
+
+    char *target = request_alloc(r, 3 * strlen(path) + 3);
+    char *t      = target;
+    if (!target)
+        return NULL;
+
+    *t++ = '/';
+    for (const char *c = path; *c; c++) {
+        if (isalnum((unsigned char)*c) || strchr("-._~!$&'()*+,;=:@/", *c)) {
+            *t++ = *c;
+        } else {
+            *t++ = '%';
+            *t++ = Hex[(unsigned char)*c >> 4];
+            *t++ = Hex[(unsigned char)*c & 15];
+        }
+    }
+    if (*path && r->uri[length - 1] == '/')
+        *t++ = '/';
+    *t = '\0';
+    return target;
+}
+
+/**
+ * Forward request head and body to upstream.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   u           Upstream (connected).
+ * @param   target      Request target (see proxy_target).
+ * @param   length      Length of request body (0 if none, -1 if chunked).
+ * @return  HTTP_STATUS_OK on success, otherwise the error Status.
+ *
+ * The request line carries target and the query as received.  Host and
+ * end-to-end headers are forwarded as received, followed by X-Forwarded-For
+ * with the client address appended.  The request is always sent as HTTP/1.1
+ * so that the upstream connection can be reused.
+ **/
+static Status proxy_send_request(Request *r, Upstream *u, const char *target, long long length) {
+    struct iovec iov[PROXY_MAX_IOV];
+    int iovcnt = 0;
+
+#define proxy_append(data, n)   (iov[iovcnt].iov_base = (char *)(data), iov[iovcnt].iov_len = (n), iovcnt++)
+#define proxy_static(s)         proxy_append((s), sizeof(s) - 1)
+#define proxy_string(s)         proxy_append((s), strlen(s))
+
+    proxy_string(r->method);
+    proxy_static(" ");
+    proxy_string(target);
+    if (*r->query) {
+        proxy_static("?");
+        proxy_string(r->query);
+    }
+    proxy_static(" HTTP/1.1\r\n");
+
+    if (!request_header(r, HEADER_HOST)) {
+        proxy_static("Host: ");
+        proxy_string(u->address);
+        proxy_static("\r\n");
+    }
+
+    for (int i = 0; i < r->nheaders; i++) {
+        const Header *header = &r->headers[i];
+        if (proxy_hop_header(r, header) || (length < 0 && header->id == HEADER_CONTENT_LENGTH))
+            continue;
+        proxy_string(header->name);
+        proxy_static(": ");
+        proxy_string(header->value);
+        proxy_static("\r\n");
+    }
+
+    const char *forwarded = request_header(r, HEADER_X_FORWARDED_FOR);
+    proxy_static("X-Forwarded-For: ");
+    if (forwarded) {
+        proxy_string(forwarded);
+        proxy_static(", ");
+    }
+    proxy_string(r->host);
+    proxy_static("\r\n\r\n");
+
+#undef proxy_append
+#undef proxy_static
+#undef proxy_string
+
+    if (send_iovec(u->fd, iov, iovcnt, length != 0) < 0)
+        return HTTP_STATUS_BAD_GATEWAY;
+    if (length == 0)
+        return HTTP_STATUS_OK;
+    return proxy_relay_body(r, u, length);
+}
+
+/**
+ * Relay upstream response to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   u           Upstream with complete response head buffered.
+ * @param   reusable    Pointer to store whether the upstream connection can
+ *                      be reused afterwards.
+ * @return  Status of the HTTP request.
+ *
+ * Interim (1xx) responses are skipped.  Hop-by-hop headers (and Date, which
+ * the response adds itself) are dropped and the body is streamed to the
+ * client, reframed by the response stream.
+ **/
+static Status proxy_relay_response(Request *r, Upstream *u, bool *reusable) {
+    char   *line;
+    int     code;
+    int     minor;
+    char    status[128];
+    char    head[PROXY_BUFFER_SIZE];
+    size_t  head_length;
+    long long length;
+    bool    chunked;
+
+    /* Parse status line, skipping interim responses */
+    while (true) {
+        line = upstream_line(u, NULL);
+        if (!line || sscanf(line, "HTTP/1.%d %3d", &minor, &code) != 2 || code < 100 || code > 999)
+            return HTTP_STATUS_BAD_GATEWAY;
+        snprintf(status, sizeof(status), "%s", skip_whitespace(skip_nonwhitespace(line)));
+
+        head_length = 0;
+        length      = -1;
+        chunked     = false;
+        *reusable   = minor >= 1;
+
+        /* Copy end-to-end headers */
+        while ((line = upstream_line(u, NULL)) && *line) {
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+                length = strtoll(line + 15, NULL, 10);
+            else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+                chunked = header_lists(line + 18, "chunked");
+            else if (strncasecmp(line, "Connection:", 11) == 0 && header_lists(line + 11, "close"))
+                *reusable = false;
+
+            if (strncasecmp(line, "Date:", 5) == 0 ||
+                strncasecmp(line, "Transfer-Encoding:", 18) == 0 ||
+                strncasecmp(line, "Connection:", 11) == 0 ||
+                strncasecmp(line, "Keep-Alive:", 11) == 0 ||
+                strncasecmp(line, "Proxy-Connection:", 17) == 0 ||
+                strncasecmp(line, "Trailer:", 8) == 0 ||
+                strncasecmp(line, "Upgrade:", 8) == 0)
+                continue;
+
+            size_t n = strlen(line);
+            if (head_length + n + 2 > sizeof(head))
+                return HTTP_STATUS_BAD_GATEWAY;
+            memcpy(head + head_length, line, n);
+            memcpy(head + head_length + n, "\r\n", 2);
+            head_length += n + 2;
+        }
+        if (!line)
+            return HTTP_STATUS_BAD_GATEWAY;
+
+        if (code >= 200)
+            break;
+        if (code == 101 || upstream_head(u) < 0)
+            return HTTP_STATUS_BAD_GATEWAY;
+    }
+    proxy_healthy(u);
+
+    Response response;
+    Stream   stream;
+    response_init_text(&response, r, status);
+
+    /* Responses without a body keep their Content-Length as it is */
+    if (streq(r->method, "HEAD") || code == 204 || code == 304) {
+        response_append(&response, head, head_length);
+        response_end_headers(&response);
+        response_send(&response, false);
+        return HTTP_STATUS_OK;
+    }
+
+    /* Content-Length is added again by the stream */
+    size_t kept = 0;
+    for (char *p = head, *end = head + head_length; p < end; ) {
+        char *next = memchr(p, '\n', end - p) + 1;
+        if (strncasecmp(p, "Content-Length:", 15) != 0) {
+            memmove(head + kept, p, next - p);
+            kept += next - p;
+        }
+        p = next;
+    }
+    response_append(&response, head, kept);
+
+    int result;
+    if (chunked) {
+        stream_open(&stream, &response, -1);
+        result = upstream_relay_chunked(u, &stream);
+    } else if (length >= 0) {
+        stream_open(&stream, &response, length);
+        result = upstream_relay(u, &stream, length);
+    } else {
+        stream_open(&stream, &response, -1);
+        result = upstream_relay(u, &stream, -1);
+        *reusable = false;
+    }
+
+    /* A truncated body must not look complete, so the client connection is
+     * closed without terminating the stream */
+    if (result < 0) {
+        log("Upstream %s response incomplete: %s", u->address, stream.error ? "client closed" : strerror(errno));
+        stream_flush(&stream);
+        r->keep_alive = false;
+        *reusable     = false;
+        return HTTP_STATUS_OK;
+    }
+
+    stream_close(&stream);
+    *reusable = *reusable && u->start == u->end;
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Connect to upstream, preferring an idle pooled connection.
+ *
+ * @param   u           Upstream (with address and slot).
+ * @param   pooled      Whether a pooled connection may be used.
+ * @return  -1 on error and 0 on success.
+ **/
+static int proxy_connect(Upstream *u, bool pooled) {
+    u->start  = u->end = 0;
+    u->fd     = pooled ? proxy_pool_take(u->key) : -1;
+    u->reused = u->fd >= 0;
+    if (u->reused)
+        return 0;
+
+    u->fd = socket_connect(u->address, Settings->proxy_timeout * 1000);
+    if (u->fd < 0)
+        return -1;
+
+    /* Bound how long sending the request may block */
+    struct timeval timeout = {Settings->proxy_timeout, 0};
+    setsockopt(u->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return 0;
+}
+
+/**
+ * Handle request for proxied route.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   route       Route that matched the request URI.
+ * @return  Status of the HTTP request.
+ *
+ * This forwards the request to an upstream chosen by proxy_select and
+ * streams the response back.  Connections to upstreams are kept open between
+ * requests in a per-process pool of up to proxy_pool_size connections.
+ *
+ * If an upstream cannot be reached, or fails before its response begins, it
+ * is marked as failed.  The next upstream is tried if the connection could
+ * not be made, or if the request is a GET or HEAD without a body.  A pooled
+ * connection that turns out to be closed is retried on a new connection to
+ * the same upstream.  When no upstream responds, handle error with
+ * HTTP_STATUS_BAD_GATEWAY (or HTTP_STATUS_GATEWAY_TIMEOUT if the last one
+ * timed out).
+ **/
+Status handle_proxy_request(Request *r, const ProxyRoute *route) {
+    log("HANDLE PROXY REQUEST");
+    const VirtualHost *host = r->vhost ? r->vhost : &Settings->hosts[0];
+    uint64_t   keys[CONFIG_MAX_UPSTREAMS];
+    ProxySlot *slots[CONFIG_MAX_UPSTREAMS];
+    ProxySlot *state = proxy_slot(proxy_hash(route->prefix, host->index + 1));
+    Upstream   upstream;
+    Upstream  *u       = &upstream;
+    Status     result  = HTTP_STATUS_BAD_GATEWAY;
+    unsigned   tried   = 0;
+    bool       pooled  = true;
+    long long  length  = 0;
+
+    for (int i = 0; i < route->nupstreams; i++) {
+        keys[i]  = proxy_hash(route->upstreams[i], 0);
+        slots[i] = proxy_slot(keys[i]);
+    }
+
+    /* Determine request body framing (chunked takes precedence) */
+    const char *encoding = request_header(r, HEADER_TRANSFER_ENCODING);
+    const char *content  = request_header(r, HEADER_CONTENT_LENGTH);
+    if (encoding) {
+        if (!header_lists(encoding, "chunked")) {
+            r->keep_alive = false;
+            return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        }
+        length = -1;
+    } else if (content) {
+        char *end;
+        length = strtoll(content, &end, 10);
+        if (end == content || *end || length < 0) {
+            r->keep_alive = false;
+            return handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        }
+    }
+
+    /* Forward the normalized path that the route was chosen on */
+    const char *target = proxy_target(r);
+    if (!target) {
+        r->keep_alive = false;
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Let clients waiting for permission send the body, since it is streamed
+     * to the upstream rather than checked first */
+    if (length != 0 && r->http_minor >= 1 && header_lists(request_header(r, HEADER_EXPECT), "100-continue")) {
+        static const char Continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        struct iovec iov = {(char *)Continue, sizeof(Continue) - 1};
+        send_iovec(r->fd, &iov, 1, false);
+    }
+
+    while (true) {
+        int i = proxy_select(route, slots, state, tried);
+        if (i < 0)
+            break;
+
+        u->address = route->upstreams[i];
+        u->key     = keys[i];
+        u->slot    = slots[i];
+        if (proxy_connect(u, pooled) < 0) {
+            result = errno == ETIMEDOUT ? HTTP_STATUS_GATEWAY_TIMEOUT : HTTP_STATUS_BAD_GATEWAY;
+            proxy_failed(u);
+            tried |= 1u << i;
+            continue;
+        }
+        trace(r, UPSTREAM);
+        debug("Forwarding to %s (%s connection)", u->address, u->reused ? "pooled" : "new");
+
+        atomic_fetch_add(&u->slot->active, 1);
+        result = proxy_send_request(r, u, target, length);
+        if (result == HTTP_STATUS_OK && upstream_head(u) < 0)
+            result = errno == ETIMEDOUT || errno == EAGAIN ? HTTP_STATUS_GATEWAY_TIMEOUT : HTTP_STATUS_BAD_GATEWAY;
+
+        if (result == HTTP_STATUS_OK) {
+            bool reusable = false;
+            result = proxy_relay_response(r, u, &reusable);
+            atomic_fetch_sub(&u->slot->active, 1);
+            if (result != HTTP_STATUS_OK) {
+                proxy_failed(u);
+                close(u->fd);
+                break;
+            }
+            if (reusable)
+                proxy_pool_put(u->key, u->fd);
+            else
+                close(u->fd);
+            return result;
+        }
+
+        atomic_fetch_sub(&u->slot->active, 1);
+        close(u->fd);
+
+        if (result == HTTP_STATUS_BAD_REQUEST) {
+            r->keep_alive = false;
+            return handle_error(r, result);
+        }
+
+        /* Retry stale pooled connections, and other upstreams if the request
+         * can safely be repeated */
+        if (u->reused && result == HTTP_STATUS_BAD_GATEWAY && length == 0) {
+            pooled = false;
+            continue;
+        }
+        proxy_failed(u);
+        tried |= 1u << i;
+        if (length != 0 || !(streq(r->method, "GET") || streq(r->method, "HEAD")))
+            break;
+    }
+
+    if (length != 0)
+        r->keep_alive = false;
+    return handle_error(r, result);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
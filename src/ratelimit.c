@@ -0,0 +1,223 @@
+/* ratelimit.c: Per-client Rate Limiting */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+/* Token buckets per set (one set fills a cache line) */
+#define RATE_LIMIT_WAYS     4
+
+/* Tokens are counted in thousandths so that slow rates refill smoothly */
+#define RATE_LIMIT_TOKEN    1000
+
+typedef struct {
+    _Atomic uint64_t key;               /*< Hash of client and route (0 = unused) */
+    _Atomic uint64_t bucket;            /*< Tokens << 32 | time (ms) of last update */
+} RateLimitEntry;
+
+typedef struct {
+    _Alignas(64) RateLimitEntry entries[RATE_LIMIT_WAYS];
+} RateLimitSet;
+
+/* Token bucket table shared by all worker processes */
+static RateLimitSet *Sets     = NULL;
+static size_t        SetsMask = 0;
+
+/**
+ * Mix bits of 64-bit value (splitmix64 finalizer).
+ *
+ * @param   x           Value to mix.
+ * @return  Well-distributed hash of value.
+ **/
+static inline uint64_t rate_limit_mix(uint64_t x) {
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * Allocate token bucket table in memory shared with forked workers.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The table holds rate_limit_table buckets (rounded up to a power of two).
+ * Pages are only touched once clients are limited, so the table costs nothing
+ * until rate limits are configured.  Since it is allocated once before
+ * forking, a change of rate_limit_table takes effect on upgrade, while the
+ * limits themselves are reloaded with the rest of the configuration.
+ **/
+int rate_limit_init(void) {
+    size_t sets = 1;
+
+    while (sets * RATE_LIMIT_WAYS < (size_t)Settings->rate_limit_table)
+        sets <<= 1;
+
+    Sets = mmap(NULL, sets * sizeof(RateLimitSet), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Sets == MAP_FAILED) {
+        fprintf(stderr, "Error with mmap: %s\n", strerror(errno));
+        Sets = NULL;
+        return -1;
+    }
+    SetsMask = sets - 1;
+    return 0;
+}
+
+/**
+ * Compute rate limiting key for client address.
+ *
+ * @param   addr        Client socket address.
+ * @return  Hash of client address (or 0 if the client is not rate limited).
+ *
+ * IPv6 clients are keyed by their /64 prefix, since a single host usually
+ * has a whole prefix to itself.  Unix domain socket clients are local and are
+ * never limited.
+ **/
+uint64_t rate_limit_key(const struct sockaddr *addr) {
+    uint64_t key;
+
+    switch (addr->sa_family) {
+        case AF_INET:
+            key = ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+            break;
+        case AF_INET6:
+            memcpy(&key, &((const struct sockaddr_in6 *)addr)->sin6_addr, sizeof(key));
+            key ^= 0x6ULL << 60;
+            break;
+        default:
+            return 0;
+    }
+
+    key = rate_limit_mix(key);
+    return key ? key : 1;
+}
+
+/**
+ * Find longest configured route prefix that matches URI.
+ *
+ * @param   host        Virtual host whose routes are searched.
+ * @param   uri         Request URI.
+ * @return  Index of rate limit (or -1 if no limit applies).
+ *
+ * Prefixes are matched on whole segments of the normalized path (see
+ * match_uri_prefix), so alternate spellings of a URI share its limit.
+ **/
+static int rate_limit_route(const VirtualHost *host, const char *uri) {
+    char path[PATH_MAX];
+    int  route   = -1;
+    int  longest = -1;
+
+    if (normalize_uri(uri, path, sizeof(path)) < 0)
+        return -1;
+
+    for (int i = 0; i < host->nrate_limits; i++) {
+        int length = match_uri_prefix(path, host->rate_limits[i].prefix);
+
+        if (length >= 0 && length >= longest) {
+            route   = i;
+            longest = length;
+        }
+    }
+    return route;
+}
+
+/**
+ * Find bucket for key in set, claiming one if there is none.
+ *
+ * @param   set         Set the key hashes to.
+ * @param   key         Hash of client and route.
+ * @param   full        Initial bucket for a newly claimed entry.
+ * @return  Token bucket for key.
+ *
+ * An unused entry is claimed with compare-and-swap.  When every entry is in
+ * use, the least recently updated one is taken over.  Two processes may
+ * occasionally race for the same entry; the loser simply shares a bucket for
+ * a while, which makes limiting approximate but never blocks.
+ **/
+static _Atomic uint64_t * rate_limit_bucket(RateLimitSet *set, uint64_t key, uint64_t full) {
+    RateLimitEntry *oldest = &set->entries[0];
+
+    for (int i = 0; i < RATE_LIMIT_WAYS; i++) {
+        if (atomic_load_explicit(&set->entries[i].key, memory_order_acquire) == key)
+            return &set->entries[i].bucket;
+    }
+
+    for (int i = 0; i < RATE_LIMIT_WAYS; i++) {
+        RateLimitEntry *entry = &set->entries[i];
+        uint64_t unused = 0;
+
+        if (atomic_compare_exchange_strong(&entry->key, &unused, key)) {
+            atomic_store(&entry->bucket, full);
+            return &entry->bucket;
+        }
+        if ((int32_t)((uint32_t)atomic_load(&entry->bucket) - (uint32_t)atomic_load(&oldest->bucket)) < 0)
+            oldest = entry;
+    }
+
+    atomic_store(&oldest->key, key);
+    atomic_store(&oldest->bucket, full);
+    return &oldest->bucket;
+}
+
+/**
+ * Take token for request from its client's bucket.
+ *
+ * @param   r           HTTP Request structure (parsed).
+ * @return  0 if the request may proceed, otherwise the number of seconds the
+ *          client should wait before retrying (for 429 Too Many Requests).
+ *
+ * Each client has one token bucket per route of each virtual host, refilled
+ * at rate tokens per second up to burst tokens.  The bucket is updated with a
+ * single compare-and-swap, so this costs a hash and a few loads on one cache
+ * line.
+ **/
+int rate_limit_check(Request *r) {
+    const VirtualHost *host = r->vhost ? r->vhost : &Settings->hosts[0];
+
+    if (!Sets || !r->client || host->nrate_limits == 0)
+        return 0;
+
+    int route = rate_limit_route(host, r->uri);
+    if (route < 0)
+        return 0;
+
+    const RateLimit *limit = &host->rate_limits[route];
+    uint64_t key      = rate_limit_mix(r->client + host->index * CONFIG_MAX_RATE_LIMITS + route + 1);
+    uint32_t now      = r->accepted;
+    uint64_t capacity = (uint64_t)limit->burst * RATE_LIMIT_TOKEN;
+    uint64_t full     = capacity << 32 | now;
+
+    _Atomic uint64_t *bucket = rate_limit_bucket(&Sets[key & SetsMask], key ? key : 1, full);
+    uint64_t old = atomic_load(bucket);
+    uint64_t tokens;
+    uint32_t updated;
+
+    do {
+        /* Refill for time since the last update (requests accepted by other
+         * processes may carry slightly older times) */
+        int32_t elapsed = now - (uint32_t)old;
+        updated = elapsed > 0 ? now : (uint32_t)old;
+        tokens  = (old >> 32) + (elapsed > 0 ? (uint64_t)elapsed * limit->rate : 0);
+        if (tokens > capacity)
+            tokens = capacity;
+
+        if (tokens < RATE_LIMIT_TOKEN) {
+            long wait = (RATE_LIMIT_TOKEN - tokens + limit->rate - 1) / limit->rate;
+            log("Rate limiting %s on %s", r->host, limit->prefix);
+            return (wait + 999) / 1000;
+        }
+    } while (!atomic_compare_exchange_weak(bucket, &old, (tokens - RATE_LIMIT_TOKEN) << 32 | updated));
+
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,14 +2,33 @@
 
 
 #include "spidey.h"
+#include "header_hash.h"
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
-int parse_request_method(Request *r);
-int parse_request_headers(Request *r);
+/* Source of request lines: the client socket or a buffer in memory */
+typedef struct {
+    Request    *request;                /*< Request received from socket (or NULL) */
+    const char *data;                   /*< Unread part of buffer */
+    const char *end;                    /*< End of buffer */
+} LineSource;
+
+/* Header of each pooled block holding the strings of a request */
+typedef struct StringBlock {
+    struct StringBlock *previous;       /*< Block filled before this one */
+    size_t              size;           /*< Size of block (including header) */
+} StringBlock;
+
+static Status parse_request_lines(Request *r, LineSource *source);
+static Status parse_request_method(Request *r, LineSource *source);
+static Status parse_request_headers(Request *r, LineSource *source);
 
 /**
  * Accept request from server socket.
@@ -19,55 +38,69 @@ int parse_request_headers(Request *r);
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Takes a request struct from the buffer pool and initializes it to 0.
+ *  2. Accepts a client connection from the server socket.
+ *  3. Looks up the client information and stores it in the request struct.
+ *  4. Returns the request struct.
+ *
+ * The returned request struct must be deallocated using free_request.  No
+ * receive buffer is taken until the client sends something (see
+ * request_fill).
  *
- * The returned request struct must be deallocated using free_request.
+ * Since server sockets are non-blocking, NULL is also returned (quietly) if
+ * another process accepted the connection first.
  **/
 Request * accept_request(int sfd) {
     Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
 
-    /* Allocate request struct (zeroed) */
-    r = calloc(1, sizeof(Request));
-    if (!r) {
-        fprintf(stderr, "Error with allocation (Request): %s\n", strerror(errno));
-        goto fail;
-    }
+    /* Take request struct from pool (zeroed) */
+    r = pool_get(sizeof(Request));
+    if (!r)
+        return NULL;
+
+    memset(r, 0, sizeof(Request));
+    r->path_fd = -1;
 
-    r->headers = calloc(1, sizeof(struct header));
-    if (!r->headers) {
-        fprintf(stderr, "Error with allocation (Headers): %s\n", strerror(errno));
-    }
     /* Accept a client */
-    r->fd = accept(sfd, (struct sockaddr *) &raddr, &rlen);
+    r->fd = socket_accept(sfd, (struct sockaddr *) &raddr, &rlen);
     if (r->fd < 0) {
-        fprintf(stderr, "Error with accepting: %s\n", strerror(errno));
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            fprintf(stderr, "Error with accepting: %s\n", strerror(errno));
         goto fail;
     }
+    trace(r, ACCEPT);
+
+    /* Lookup client information (numerically, to avoid a DNS query) */
+    if (raddr.ss_family == AF_UNIX) {
+        strcpy(r->host, "unix");
+        strcpy(r->port, "0");
+        strcpy(r->server_port, "0");
+    } else {
+        int info = getnameinfo((struct sockaddr *) &raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
+        if (info != 0) {
+            fprintf(stderr, "Error with lookup: %s\n", gai_strerror(info));
+            goto fail;
+        }
 
-    /* Lookup client information */
-    int info = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NAMEREQD);
-    if (info != 0) {
-        fprintf(stderr, "Error with lookup: %s\n", strerror(errno));
-        goto fail;
+        struct sockaddr_storage laddr;
+        socklen_t llen = sizeof(laddr);
+        if (getsockname(r->fd, (struct sockaddr *) &laddr, &llen) < 0 ||
+            getnameinfo((struct sockaddr *) &laddr, llen, NULL, 0, r->server_port, sizeof(r->server_port), NI_NUMERICSERV) != 0)
+            strcpy(r->server_port, "0");
+        r->tcp    = true;
+        r->client = rate_limit_key((struct sockaddr *) &raddr);
     }
 
-    /* Open socket stream */
-    FILE *file = fdopen(r->fd, "r+");
-    if (!file) {
-        fprintf(stderr, "Error with socket stream: %s\n", strerror(errno));
-        close(r->fd);
-        goto fail;
+    /* Bound how long a client may stall in the middle of a request */
+    struct timeval timeout = {Settings->keepalive_timeout, 0};
+    if (setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        fprintf(stderr, "Error with setsockopt: %s\n", strerror(errno));
     }
 
-    r->file = file;
-
+    r->accepted = monotonic_ms();
+    trace(r, LOOKUP);
     log("Accepted request from %s:%s", r->host, r->port);
     return r;
 
@@ -84,71 +117,420 @@ Request * accept_request(int sfd) {
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ *  1. Closes the request socket.
+ *  2. Returns the strings, headers, and receive buffer to the pool.
+ *  3. Returns request struct to the pool.
  **/
 void free_request(Request *r) {
     if (!r) {
     	return;
     }
 
-    /* Close socket or fd */
-    if (r->file)
-        fclose(r->file);
-    else
+    /* Close socket */
+    if (r->fd >= 0)
         close(r->fd);
-    /* Free allocated strings */
-    free(r->method);
-    free(r->uri);
-    free(r->path);
-    free(r->query);
-
-    /* Free headers */
-    struct header *header;
-    while (r->headers) {
-        header = r->headers;
-        r->headers = r->headers->next;
-        free(header->name);
-        free(header->value);
-        free(header);
+
+    /* Release strings, headers, and received data */
+    clear_request(r);
+    drop_request_input(r);
+
+    /* Return request to pool */
+    pool_put(r, sizeof(Request));
+}
+
+/**
+ * Clear everything parsed from or resolved for a request.
+ *
+ * @param   r           Request structure.
+ *
+ * This returns the blocks holding the strings and headers to the pool and
+ * closes the path descriptor, leaving the connection (and any data received
+ * for the next request) untouched.
+ **/
+void clear_request(Request *r) {
+    /* Release strings and headers (all stored in pooled blocks) */
+    while (r->strings) {
+        StringBlock *block = r->strings;
+        r->strings = block->previous;
+        pool_put(block, block->size);
+    }
+    r->strings_used = 0;
+    r->method = r->uri = r->path = r->query = NULL;
+    if (r->path_fd >= 0)
+        close(r->path_fd);
+    r->path_fd = -1;
+    r->http_minor = 0;
+    r->keep_alive = false;
+
+    r->nheaders = 0;
+    memset(r->known, 0, sizeof(r->known));
+}
+
+/**
+ * Allocate memory that lives as long as the current request.
+ *
+ * @param   r           Request structure.
+ * @param   size        Number of bytes needed.
+ * @return  Memory aligned for any pointer (or NULL on error).
+ *
+ * Memory is carved out of blocks taken from the buffer pool, which are all
+ * returned at once by clear_request, so parsing a request allocates nothing
+ * once the pool is warm.
+ **/
+void * request_alloc(Request *r, size_t size) {
+    StringBlock *block = r->strings;
+
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (!block || r->strings_used + size > block->size) {
+        size_t needed = pool_size(sizeof(StringBlock) + size);
+        if (!(block = pool_get(needed)))
+            return NULL;
+        block->previous = r->strings;
+        block->size     = needed;
+        r->strings      = block;
+        r->strings_used = sizeof(StringBlock);
+    }
+
+    void *memory = (char *)block + r->strings_used;
+    r->strings_used += size;
+    return memory;
+}
+
+/**
+ * Copy string into memory of the current request (see request_alloc).
+ *
+ * @param   r           Request structure.
+ * @param   s           String to copy.
+ * @return  Copy of string (or NULL on error).
+ **/
+static char *request_strdup(Request *r, const char *s) {
+    size_t length = strlen(s) + 1;
+    char  *copy   = request_alloc(r, length);
+
+    if (copy)
+        memcpy(copy, s, length);
+    return copy;
+}
+
+/**
+ * Return receive buffer to the pool, discarding any unread data.
+ *
+ * @param   r           Request structure.
+ **/
+void drop_request_input(Request *r) {
+    pool_put(r->input, r->input_size);
+    r->input       = NULL;
+    r->input_size  = 0;
+    r->input_start = r->input_end = 0;
+    r->input_error = 0;
+}
+
+/**
+ * Wait for client socket to become readable.
+ *
+ * @param   fd          Client socket.
+ * @param   timeout     Longest time to wait (ms).
+ * @param   between     Whether the connection is between requests, so that
+ *                      waiting ends once the server is draining.
+ * @return  1 once data (or EOF) arrives, 0 on timeout, and -1 on error or
+ *          when draining.
+ *
+ * Idle buffers are released after POOL_IDLE_MS (see pool_trim), so a process
+ * waiting on an idle keep-alive connection holds no more memory than it must.
+ **/
+static int request_wait(int fd, long timeout, bool between) {
+    struct pollfd pfd      = {.fd = fd, .events = POLLIN};
+    long          deadline = monotonic_ms() + timeout;
+
+    while (true) {
+        long remaining = deadline - monotonic_ms();
+        if (remaining <= 0)
+            return 0;
+
+        bool trim  = pool_dirty() && remaining > POOL_IDLE_MS;
+        int  ready = poll(&pfd, 1, trim ? POOL_IDLE_MS : remaining);
+        if (ready > 0)
+            return 1;
+        if (ready < 0 && (errno != EINTR || (between && Draining)))
+            return -1;
+        if (ready == 0 && trim)
+            pool_trim();
+    }
+}
+
+/**
+ * Receive more data from the client socket.
+ *
+ * @param   r           Request structure (with no unread data).
+ * @param   between     Whether the connection is between requests.
+ * @return  Number of bytes received, 0 on EOF, or -1 on error (recorded in
+ *          input_error, with EAGAIN for an idle timeout).
+ *
+ * A connection without a receive buffer takes one from the pool only while
+ * data is ready, and otherwise waits up to keepalive_timeout seconds without
+ * holding one.  A request that the client only began sending after such a
+ * wait is taken to have arrived then (see accepted), so its queue time does
+ * not include the client's own delay.  Reads are retried when interrupted, so
+ * a SIGTERM does not turn a request into a read error.
+ **/
+static ssize_t request_fill(Request *r, bool between) {
+    bool    idle  = !r->input;
+    ssize_t nread = -1;
+
+    r->input_start = r->input_end = 0;
+    if (idle) {
+        r->input_size = pool_size(Settings->request_buffer);
+        if (!(r->input = pool_get(r->input_size))) {
+            r->input_error = ENOMEM;
+            return -1;
+        }
+
+        nread = recv(r->fd, r->input, r->input_size, MSG_DONTWAIT);
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            drop_request_input(r);
+            int ready = request_wait(r->fd, Settings->keepalive_timeout * 1000L, between);
+            if (ready <= 0) {
+                r->input_error = ready == 0 ? EAGAIN : errno;
+                return -1;
+            }
+            r->accepted = monotonic_ms();
+            return request_fill(r, between);
+        }
+    }
+
+    if (nread < 0 && (!idle || errno == EINTR))
+        while ((nread = read(r->fd, r->input, r->input_size)) < 0 && errno == EINTR);
+    if (nread < 0) {
+        r->input_error = errno;
+        return -1;
+    }
+    r->input_end = nread;
+    return nread;
+}
+
+/**
+ * Read line from the client socket.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Output buffer.
+ * @param   size        Size of output buffer.
+ * @return  buffer on success and NULL on EOF or error (see input_error).
+ *
+ * Like fgets(3), this reads up to and including the newline, and at most
+ * size - 1 bytes.  A line cut short by a receive error (such as the idle
+ * timeout) is discarded.
+ **/
+char * request_gets(Request *r, char *buffer, int size) {
+    int length = 0;
+
+    while (length < size - 1) {
+        if (r->input_start == r->input_end) {
+            ssize_t nread = request_fill(r, false);
+            if (nread < 0)
+                return NULL;
+            if (nread == 0)
+                break;
+        }
+
+        const char *data    = r->input + r->input_start;
+        size_t      n       = r->input_end - r->input_start;
+        if (n > (size_t)(size - 1 - length))
+            n = size - 1 - length;
+        const char *newline = memchr(data, '\n', n);
+        if (newline)
+            n = newline - data + 1;
+
+        memcpy(buffer + length, data, n);
+        r->input_start += n;
+        length         += n;
+        if (newline)
+            break;
+    }
+
+    if (length == 0)
+        return NULL;
+    buffer[length] = '\0';
+    return buffer;
+}
+
+/**
+ * Read data from the client socket.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Output buffer.
+ * @param   n           Most bytes to read.
+ * @return  Number of bytes read (at least 1), 0 on EOF, or -1 on error.
+ **/
+ssize_t request_read(Request *r, void *buffer, size_t n) {
+    if (r->input_start == r->input_end) {
+        ssize_t nread = request_fill(r, false);
+        if (nread <= 0)
+            return nread;
     }
 
-    /* Free request */
-    free(r);
+    if (n > r->input_end - r->input_start)
+        n = r->input_end - r->input_start;
+    memcpy(buffer, r->input + r->input_start, n);
+    r->input_start += n;
+    return n;
+}
+
+/**
+ * Reset request struct for the next request on a persistent connection.
+ *
+ * @param   r           Request structure.
+ * @return  -1 if no further request arrives and 0 otherwise.
+ *
+ * This function does the following:
+ *
+ *  1. Clears the previous request (see clear_request).
+ *  2. Waits up to keepalive_timeout seconds for the next request to begin,
+ *     unless it was already received (pipelined) with the previous one.
+ *
+ * While waiting, the connection holds no receive buffer (see request_fill).
+ * Phase timing of the next request starts once its first byte arrives, so
+ * the idle time between requests is not counted.
+ **/
+int reset_request(Request *r) {
+    clear_request(r);
+
+    /* Wait for the next request (or EOF / idle timeout / SIGTERM) */
+    if (r->input_start == r->input_end) {
+        drop_request_input(r);
+        if (request_fill(r, true) <= 0)
+            return -1;
+    }
+    r->accepted = monotonic_ms();
+    trace_reset(r);
+    trace(r, ACCEPT);
+    return 0;
+}
+
+/**
+ * Read next line from line source.
+ *
+ * @param   source      Socket or buffer lines are read from.
+ * @param   buffer      Output buffer.
+ * @param   size        Size of output buffer.
+ * @return  buffer on success and NULL on end of input or error.
+ *
+ * Lines are taken from a buffer exactly as request_gets reads them from the
+ * socket (up to and including the newline, and at most size - 1 bytes), so
+ * both sources parse identically.
+ **/
+static char *source_line(LineSource *source, char *buffer, int size) {
+    if (source->request)
+        return request_gets(source->request, buffer, size);
+    if (source->data >= source->end)
+        return NULL;
+
+    size_t      length  = source->end - source->data;
+    if (length > (size_t)size - 1)
+        length = size - 1;
+    const char *newline = memchr(source->data, '\n', length);
+    if (newline)
+        length = newline - source->data + 1;
+
+    memcpy(buffer, source->data, length);
+    buffer[length] = '\0';
+    source->data  += length;
+    return buffer;
+}
+
+/**
+ * Determine error Status for a line source that ran out.
+ *
+ * @param   source      Socket or buffer lines are read from.
+ * @return  HTTP_STATUS_REQUEST_TIMEOUT if the client was idle for longer
+ *          than keepalive_timeout seconds, HTTP_STATUS_BAD_REQUEST for any
+ *          other receive error, or HTTP_STATUS_OK if the input simply ended.
+ **/
+static Status source_error(const LineSource *source) {
+    int error = source->request ? source->request->input_error : 0;
+
+    if (error == EAGAIN || error == EWOULDBLOCK)
+        return HTTP_STATUS_REQUEST_TIMEOUT;
+    return error ? HTTP_STATUS_BAD_REQUEST : HTTP_STATUS_OK;
 }
 
 /**
  * Parse HTTP Request.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
+ * @return  HTTP_STATUS_OK on success, otherwise the error Status to respond
+ *          with.
+ *
+ * This function reads the request from the client socket (see
+ * parse_request_lines).
+ **/
+Status parse_request(Request *r) {
+    LineSource source = {.request = r};
+    return parse_request_lines(r, &source);
+}
+
+/**
+ * Parse HTTP Request held in memory.
+ *
+ * @param   r           Request structure.
+ * @param   data        Request line and headers (need not be NUL-terminated).
+ * @param   length      Length of data.
+ * @return  HTTP_STATUS_OK on success, otherwise the error Status to respond
+ *          with.
+ *
+ * This parses exactly as parse_request does from a socket, which lets the
+ * parser be benchmarked and fuzzed without one.  Anything after the blank line
+ * that ends the headers is ignored.
+ **/
+Status parse_request_buffer(Request *r, const char *data, size_t length) {
+    LineSource source = {.data = data, .end = data + length};
+    return parse_request_lines(r, &source);
+}
+
+/**
+ * Parse HTTP Request from line source.
+ *
+ * @param   r           Request structure.
+ * @param   source      Socket or buffer lines are read from.
+ * @return  HTTP_STATUS_OK on success, otherwise the error Status to respond
+ *          with.
  *
  * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * headers.
  **/
-int parse_request(Request *r) {
+static Status parse_request_lines(Request *r, LineSource *source) {
+    Status status;
+
     /* Parse HTTP Request Method */
-    if(parse_request_method(r) != 0) {
+    status = parse_request_method(r, source);
+    if (status != HTTP_STATUS_OK) {
         fprintf(stderr,"Cannot parse method\n");
-        return -1;
+        return status;
     }
 
     /* Parse HTTP Requet Headers*/
-    if (parse_request_headers(r) != 0) {
+    status = parse_request_headers(r, source);
+    if (status != HTTP_STATUS_OK) {
         fprintf(stderr,"Cannot parse headers\n");
-        return -1;
+        return status;
     }
 
-    return 0;
+    /* Determine whether connection persists after this request */
+    const char *connection = request_header(r, HEADER_CONNECTION);
+    r->keep_alive = r->http_minor >= 1;
+    if (connection && strieq(connection, "close"))
+        r->keep_alive = false;
+    else if (connection && strieq(connection, "keep-alive"))
+        r->keep_alive = true;
+
+    return HTTP_STATUS_OK;
 }
 
 /**
  * Parse HTTP Request Method and URI.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
+ * @param   source      Socket or buffer lines are read from.
+ * @return  HTTP_STATUS_OK on success, otherwise the error Status.
  *
  * HTTP Requests come in the form
  *
@@ -159,70 +541,68 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and the HTTP
+ * minor version (0 if the version is missing or unrecognized).
  **/
-int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
+static Status parse_request_method(Request *r, LineSource *source) {
+    char buffer[Settings->request_buffer];
     char *method;
     char *uri;
     char *query;
+    char *version;
 
     /* Read line from socket */
-    if(fgets(buffer, BUFSIZ, r->file) == NULL) {
+    if (source_line(source, buffer, sizeof(buffer)) == NULL) {
         printf("CHECK\n");
-        return -1;
+        Status status = source_error(source);
+        return status != HTTP_STATUS_OK ? status : HTTP_STATUS_BAD_REQUEST;
+    }
+    if (!strchr(buffer, '\n') && strlen(buffer) == sizeof(buffer) - 1) {
+        return HTTP_STATUS_URI_TOO_LONG;
     }
 
     /* Parse method and uri */
     method = strtok(buffer, WHITESPACE);
     if (!method) {
         printf("No method found\n");
-        return -1;
+        return HTTP_STATUS_BAD_REQUEST;
     }
 
-    r->method = strdup(method);
+    if (!(r->method = request_strdup(r, method)))
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
     uri = strtok(NULL, WHITESPACE);
     if (!uri) {
         printf("No uri found\n");
-        return -1;
+        return HTTP_STATUS_BAD_REQUEST;
     }
 
-    /* Parse query from uri */
+    /* Parse version */
+    version = strtok(NULL, WHITESPACE);
+    if (version && strncmp(version, "HTTP/1.1", 8) == 0)
+        r->http_minor = 1;
+
+    /* Parse query from uri (a uri of only '?' has no path at all) */
     char *uriReal;
-    char *whitespace;
 
     uriReal = strtok(uri, "?");
-
-    if (uriReal) {
-        query = strtok(NULL, WHITESPACE);
-    }
-    else {
-        whitespace = skip_nonwhitespace(buffer);
-        if (whitespace)
-            uri = skip_whitespace(whitespace);
-        else {
-            printf("Check\n");
-            return -1;
-        }
-
-        uriReal = strtok(uri, WHITESPACE);
-        query = NULL;
+    if (!uriReal) {
+        return HTTP_STATUS_BAD_REQUEST;
     }
+    query = strtok(NULL, WHITESPACE);
 
-    r->uri = strdup(uriReal);
-
-    if (query)
-        r->query = strdup(query);
-    else
-        r->query = strdup("");
+    r->uri   = request_strdup(r, uriReal);
+    r->query = request_strdup(r, query ? query : "");
+    if (!r->uri || !r->query)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
     /* Record method, uri, and query in request struct */
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
     debug("HTTP QUERY:  %s", r->query);
+    debug("HTTP MINOR:  %d", r->http_minor);
 
-    return 0;
+    return HTTP_STATUS_OK;
 
 }
 
@@ -230,7 +610,8 @@ int parse_request_method(Request *r) {
  * Parse HTTP Request Headers.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
+ * @param   source      Socket or buffer lines are read from.
+ * @return  HTTP_STATUS_OK on success, otherwise the error Status.
  *
  * HTTP Headers come in the form:
  *
@@ -250,49 +631,102 @@ int parse_request_method(Request *r) {
  *
  *  while (buffer = read_from_socket() and buffer is not empty):
  *      name, value = buffer.split(':')
- *      header      = new Header(name, value)
+ *      header      = new Header(header_id(name), name, value)
  *      headers.append(header)
+ *
+ * Headers are kept in a flat array in the order received, and the first
+ * header with each well-known name is indexed so that request_header finds
+ * it without searching.  More than REQUEST_MAX_HEADERS headers is an error.
  **/
-int parse_request_headers(Request *r) {
-    struct header *curr = NULL;
-    char buffer[BUFSIZ];
+static Status parse_request_headers(Request *r, LineSource *source) {
+    char buffer[Settings->request_buffer];
     char *name;
     char *value;
+    char *end;
 
     /* Parse headers from socket */
-    while (fgets(buffer, BUFSIZ, r->file) && strlen(buffer) > 2) {
-        chomp(buffer);
-        value = strchr(buffer, ':');
-        debug("Value: %s", value);
-        if (!value)
+    while (true) {
+        if (!source_line(source, buffer, sizeof(buffer))) {
+            Status status = source_error(source);
+            if (status != HTTP_STATUS_OK)
+                return status;
+            break;
+        }
+        if (buffer[0] == '\n' || (buffer[0] == '\r' && buffer[1] == '\n'))
+            break;
+
+        /* Split line at the colon, ending it at CR or LF (one scan each) */
+        name  = buffer;
+        value = scan_delimiter(buffer, ':', '\n');
+        if (*value != ':' || value == buffer)
             goto fail;
 
-        value++;
-        value = skip_whitespace(value);
-        name = strtok(buffer, ":");
-        debug("Name: %s", value);
-        if (!name)
+        size_t name_length = value - name;
+        value = skip_whitespace(value + 1);
+        end   = scan_delimiter(value, '\r', '\n');
+        if (r->nheaders >= REQUEST_MAX_HEADERS)
             goto fail;
 
-        curr = (struct header*) malloc(sizeof(*curr));
-        curr->value = strdup(value);
-        curr->name = strdup(name);
-        curr->next = r->headers;
-        r->headers = curr;
+        /* Copy name and value together into request memory */
+        Header *header = &r->headers[r->nheaders];
+        header->name = request_alloc(r, name_length + 1 + (end - value) + 1);
+        if (!header->name)
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        memcpy(header->name, name, name_length);
+        header->name[name_length] = '\0';
+        header->value = header->name + name_length + 1;
+        memcpy(header->value, value, end - value);
+        header->value[end - value] = '\0';
+        header->id = header_id(name, name_length);
+
+        r->nheaders++;
+        if (header->id != HEADER_OTHER && !r->known[header->id])
+            r->known[header->id] = r->nheaders;
     }
 
-    if (!r->headers)
-        goto fail;
-
     #ifndef NDEBUG
-    for (struct header *header = r->headers; header; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->value);
+    for (int i = 0; i < r->nheaders; i++) {
+    	debug("HTTP HEADER %s = %s", r->headers[i].name, r->headers[i].value);
     }
     #endif
-    return 0;
+    return HTTP_STATUS_OK;
 
     fail:
-        return -1;
+        return HTTP_STATUS_BAD_REQUEST;
+}
+
+/**
+ * Determine id of header name.
+ *
+ * @param   name        Header name (need not be NUL-terminated).
+ * @param   length      Length of header name.
+ * @return  Id of well-known header, or HEADER_OTHER.
+ *
+ * Names are looked up in a perfect hash table generated by
+ * bin/gen_headers.py from the HeaderId enum, so this costs one hash and one
+ * case-insensitive comparison.
+ **/
+HeaderId header_id(const char *name, size_t length) {
+    if (length < HEADER_HASH_MIN_LENGTH || length > HEADER_HASH_MAX_LENGTH)
+        return HEADER_OTHER;
+
+    unsigned slot = HEADER_HASH(name, length);
+    if (HeaderHash[slot].length == length && strncasecmp(HeaderHash[slot].name, name, length) == 0)
+        return HeaderHash[slot].id;
+    return HEADER_OTHER;
+}
+
+/**
+ * Return value of first request header with specified id.
+ *
+ * @param   r           Request structure.
+ * @param   id          Well-known header id.
+ * @return  Header value (or NULL if the request has no such header).
+ **/
+const char * request_header(const Request *r, HeaderId id) {
+    if ((unsigned)id >= HEADER_OTHER || !r->known[id])
+        return NULL;
+    return r->headers[r->known[id] - 1].value;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,250 @@
+/* response.c: HTTP Response Builder */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Preformatted status lines indexed by HTTP minor version and Status */
+#define STATUS_LINES(version) { \
+    version "200 OK\r\n", \
+    version "301 Moved Permanently\r\n", \
+    version "304 Not Modified\r\n", \
+    version "400 Bad Request\r\n", \
+    version "403 Forbidden\r\n", \
+    version "404 Not Found\r\n", \
+    version "405 Method Not Allowed\r\n", \
+    version "408 Request Timeout\r\n", \
+    version "413 Payload Too Large\r\n", \
+    version "414 URI Too Long\r\n", \
+    version "416 Range Not Satisfiable\r\n", \
+    version "429 Too Many Requests\r\n", \
+    version "500 Internal Server Error\r\n", \
+    version "502 Bad Gateway\r\n", \
+    version "503 Service Unavailable\r\n", \
+    version "504 Gateway Timeout\r\n", \
+}
+
+static const char *StatusLines[2][HTTP_STATUS_COUNT] = {
+    STATUS_LINES("HTTP/1.0 "),
+    STATUS_LINES("HTTP/1.1 "),
+};
+
+/* Cached Date header, refreshed at most once per second */
+static char   DateLine[64];
+static size_t DateLength = 0;
+static time_t DateTime   = 0;
+
+/**
+ * Format unsigned integer in specified base into buffer.
+ *
+ * @param   buffer      Output buffer (must hold at least 24 bytes).
+ * @param   value       Value to format.
+ * @param   base        Numeric base (10 or 16).
+ * @return  Number of characters written (not NUL-terminated).
+ **/
+size_t format_unsigned(char *buffer, unsigned long long value, unsigned base) {
+    static const char Digits[] = "0123456789abcdef";
+    char reversed[24];
+    size_t n = 0;
+
+    do {
+        reversed[n++] = Digits[value % base];
+        value /= base;
+    } while (value);
+
+    for (size_t i = 0; i < n; i++)
+        buffer[i] = reversed[n - 1 - i];
+    return n;
+}
+
+/**
+ * Send all of the specified io vectors to a socket.
+ *
+ * @param   fd          Socket file descriptor.
+ * @param   iov         Array of io vectors (modified in place).
+ * @param   iovcnt      Number of io vectors.
+ * @param   more        Whether more data follows immediately (MSG_MORE).
+ * @return  -1 on error and 0 on success.
+ *
+ * MSG_MORE lets the kernel hold back a partial segment when the caller knows
+ * that more data is coming, so headers and the start of a body share packets.
+ **/
+int send_iovec(int fd, struct iovec *iov, int iovcnt, bool more) {
+    struct msghdr msg = {0};
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+
+    while (iovcnt > 0) {
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t nwritten = sendmsg(fd, &msg, flags);
+        if (nwritten < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        /* Advance past fully written vectors and into a partial one */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + nwritten;
+            iov->iov_len  -= nwritten;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Refresh cached Date header if the second has changed.
+ **/
+static void response_update_date(void) {
+    time_t now = time(NULL);
+    if (now == DateTime)
+        return;
+
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    DateLength = strftime(DateLine, sizeof(DateLine), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    DateTime   = now;
+}
+
+/**
+ * Append fragment to response.
+ *
+ * @param   res         Response structure.
+ * @param   data        Fragment data (must remain valid until sent).
+ * @param   n           Number of bytes in fragment.
+ **/
+void response_append(Response *res, const void *data, size_t n) {
+    if (n == 0)
+        return;
+    if (res->iovcnt >= RESPONSE_MAX_IOV) {
+        res->error = true;
+        return;
+    }
+
+    res->iov[res->iovcnt].iov_base = (void *)data;
+    res->iov[res->iovcnt].iov_len  = n;
+    res->iovcnt++;
+}
+
+/**
+ * Initialize response with a preformatted status line and Date header.
+ *
+ * @param   res         Response structure.
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP Status.
+ *
+ * The response uses the same HTTP minor version as the request.
+ **/
+void response_init(Response *res, Request *r, Status status) {
+    res->request = r;
+    res->iovcnt  = 0;
+    res->error   = false;
+
+    const char *line = StatusLines[r->http_minor >= 1][status];
+    response_append(res, line, strlen(line));
+    response_update_date();
+    response_append(res, DateLine, DateLength);
+}
+
+/**
+ * Initialize response with an arbitrary status and Date header.
+ *
+ * @param   res         Response structure.
+ * @param   r           HTTP Request structure.
+ * @param   status      Status string (ie. "302 Found").
+ **/
+void response_init_text(Response *res, Request *r, const char *status) {
+    res->request = r;
+    res->iovcnt  = 0;
+    res->error   = false;
+
+    response_append(res, r->http_minor >= 1 ? "HTTP/1.1 " : "HTTP/1.0 ", 9);
+    response_append(res, status, strlen(status));
+    response_append(res, "\r\n", 2);
+    response_update_date();
+    response_append(res, DateLine, DateLength);
+}
+
+/**
+ * Add header to response.
+ *
+ * @param   res         Response structure.
+ * @param   name        Header name (must remain valid until sent).
+ * @param   value       Header value (must remain valid until sent).
+ **/
+void response_header(Response *res, const char *name, const char *value) {
+    response_append(res, name, strlen(name));
+    response_append(res, ": ", 2);
+    response_append(res, value, strlen(value));
+    response_append(res, "\r\n", 2);
+}
+
+/**
+ * Add Content-Length header to response.
+ *
+ * @param   res         Response structure.
+ * @param   length      Length of body in bytes.
+ **/
+void response_content_length(Response *res, size_t length) {
+    static const char Prefix[] = "Content-Length: ";
+    size_t n = sizeof(Prefix) - 1;
+
+    memcpy(res->length, Prefix, n);
+    n += format_unsigned(res->length + n, length, 10);
+    res->length[n++] = '\r';
+    res->length[n++] = '\n';
+    response_append(res, res->length, n);
+}
+
+/**
+ * Complete response header block.
+ *
+ * @param   res         Response structure.
+ *
+ * HTTP/1.1 connections persist by default and HTTP/1.0 connections close by
+ * default, so a Connection header is only added when deviating from that.
+ **/
+void response_end_headers(Response *res) {
+    Request *r = res->request;
+
+    if (r->http_minor >= 1 && !r->keep_alive)
+        response_static(res, "Connection: close\r\n");
+    else if (r->http_minor == 0 && r->keep_alive)
+        response_static(res, "Connection: keep-alive\r\n");
+    response_static(res, "\r\n");
+}
+
+/**
+ * Send response fragments to client socket with a single system call.
+ *
+ * @param   res         Response structure.
+ * @param   more        Whether more data follows immediately.
+ * @return  -1 on error and 0 on success.
+ *
+ * On error the connection is marked as not reusable.
+ **/
+int response_send(Response *res, bool more) {
+    if (res->error || send_iovec(res->request->fd, res->iov, res->iovcnt, more) < 0) {
+        res->request->keep_alive = false;
+        return -1;
+    }
+    trace(res->request, RESPONSE);
+
+    res->iovcnt = 0;
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
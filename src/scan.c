@@ -0,0 +1,209 @@
+/* scan.c: Vectorized Delimiter Scanning */
+
+
+#include "spidey.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(__SANITIZE_ADDRESS__)
+#define SCAN_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Scanners in use (scalar until scan_init selects vector versions) */
+static char *scan_delimiter_scalar(const char *s, char a, char b);
+static char *scan_whitespace_scalar(const char *s);
+static char *scan_text_scalar(const char *s);
+
+static char *(*ScanDelimiter)(const char *, char, char) = scan_delimiter_scalar;
+static char *(*ScanWhitespace)(const char *)            = scan_whitespace_scalar;
+static char *(*ScanText)(const char *)                  = scan_text_scalar;
+
+/* Whitespace as classified by isspace(3) in the C locale */
+#define is_space(c)     ((c) == ' ' || (unsigned char)((c) - '\t') <= '\r' - '\t')
+
+/* Scalar Scanners */
+
+static char *scan_delimiter_scalar(const char *s, char a, char b) {
+    while (*s && *s != a && *s != b)
+        s++;
+    return (char *)s;
+}
+
+static char *scan_whitespace_scalar(const char *s) {
+    while (*s && !is_space(*s))
+        s++;
+    return (char *)s;
+}
+
+static char *scan_text_scalar(const char *s) {
+    while (is_space(*s))
+        s++;
+    return (char *)s;
+}
+
+#ifdef SCAN_SIMD
+
+/*
+ * Vector scanners load pairs of whole aligned blocks, which never cross a
+ * page boundary, so reading past the terminating NUL of a string is harmless.
+ * Bytes before the start of the string are masked off the first pair.
+ *
+ * SSE2 is part of x86-64 and is always used; AVX2 doubles the block size
+ * when the CPU supports it.  Single byte comparisons (pcmpeqb) are cheaper
+ * than the SSE4.2 string instructions for the few delimiters used here.
+ */
+
+#define SCAN_LOOP(width, load, mask)                                        \
+    uintptr_t offset = (uintptr_t)s & (2 * (width) - 1);                    \
+    const char *p = s - offset;                                             \
+    uint64_t bits = (mask(load(p)) | (uint64_t)mask(load(p + (width))) << (width)) & (~0ULL << offset); \
+    while (!bits) {                                                         \
+        p += 2 * (width);                                                   \
+        bits = mask(load(p)) | (uint64_t)mask(load(p + (width))) << (width); \
+    }                                                                       \
+    return (char *)p + __builtin_ctzll(bits);
+
+/* SSE2 */
+
+#define sse2_load(p)    _mm_load_si128((const __m128i *)(p))
+
+static inline __m128i sse2_space(__m128i v) {
+    __m128i control = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i range   = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8('\r' - '\t')), control);
+    return _mm_or_si128(range, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+static char *scan_delimiter_sse2(const char *s, char a, char b) {
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), zero = _mm_setzero_si128();
+#define sse2_delimiter(v)   (uint32_t)_mm_movemask_epi8(_mm_or_si128( \
+        _mm_or_si128(_mm_cmpeq_epi8((v), va), _mm_cmpeq_epi8((v), vb)), _mm_cmpeq_epi8((v), zero)))
+    SCAN_LOOP(16, sse2_load, sse2_delimiter)
+#undef sse2_delimiter
+}
+
+static char *scan_whitespace_sse2(const char *s) {
+    __m128i zero = _mm_setzero_si128();
+#define sse2_whitespace(v)  (uint32_t)_mm_movemask_epi8(_mm_or_si128(sse2_space(v), _mm_cmpeq_epi8((v), zero)))
+    SCAN_LOOP(16, sse2_load, sse2_whitespace)
+#undef sse2_whitespace
+}
+
+static char *scan_text_sse2(const char *s) {
+#define sse2_text(v)        ((uint32_t)_mm_movemask_epi8(sse2_space(v)) ^ 0xffff)
+    SCAN_LOOP(16, sse2_load, sse2_text)
+#undef sse2_text
+}
+
+/* AVX2 */
+
+#define avx2_load(p)    _mm256_load_si256((const __m256i *)(p))
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_space(__m256i v) {
+    __m256i control = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i range   = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8('\r' - '\t')), control);
+    return _mm256_or_si256(range, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2")))
+static char *scan_delimiter_avx2(const char *s, char a, char b) {
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), zero = _mm256_setzero_si256();
+#define avx2_delimiter(v)   (uint32_t)_mm256_movemask_epi8(_mm256_or_si256( \
+        _mm256_or_si256(_mm256_cmpeq_epi8((v), va), _mm256_cmpeq_epi8((v), vb)), _mm256_cmpeq_epi8((v), zero)))
+    SCAN_LOOP(32, avx2_load, avx2_delimiter)
+#undef avx2_delimiter
+}
+
+__attribute__((target("avx2")))
+static char *scan_whitespace_avx2(const char *s) {
+    __m256i zero = _mm256_setzero_si256();
+#define avx2_whitespace(v)  (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(avx2_space(v), _mm256_cmpeq_epi8((v), zero)))
+    SCAN_LOOP(32, avx2_load, avx2_whitespace)
+#undef avx2_whitespace
+}
+
+__attribute__((target("avx2")))
+static char *scan_text_avx2(const char *s) {
+#define avx2_text(v)        ~(uint32_t)_mm256_movemask_epi8(avx2_space(v))
+    SCAN_LOOP(32, avx2_load, avx2_text)
+#undef avx2_text
+}
+
+#endif
+
+/**
+ * Select fastest scanners supported by the CPU.
+ *
+ * @return  Name of selected implementation.
+ *
+ * Until this is called, the portable scalar scanners are used.  Setting the
+ * SPIDEY_SCAN environment variable to "scalar" or "sse2" restricts the
+ * choice (for benchmarking).
+ **/
+const char * scan_init(void) {
+    ScanDelimiter  = scan_delimiter_scalar;
+    ScanWhitespace = scan_whitespace_scalar;
+    ScanText       = scan_text_scalar;
+
+#ifdef SCAN_SIMD
+    const char *limit = getenv("SPIDEY_SCAN");
+    if (limit && streq(limit, "scalar"))
+        return "scalar";
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && !(limit && streq(limit, "sse2"))) {
+        ScanDelimiter  = scan_delimiter_avx2;
+        ScanWhitespace = scan_whitespace_avx2;
+        ScanText       = scan_text_avx2;
+        return "avx2";
+    }
+
+    ScanDelimiter  = scan_delimiter_sse2;
+    ScanWhitespace = scan_whitespace_sse2;
+    ScanText       = scan_text_sse2;
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+/**
+ * Find first occurrence of either delimiter in string.
+ *
+ * @param   s           String.
+ * @param   a           Delimiter.
+ * @param   b           Delimiter (may be the same as a).
+ * @return  Pointer to first a or b in s, or to the terminating NUL.
+ **/
+char * scan_delimiter(const char *s, char a, char b) {
+    return ScanDelimiter(s, a, b);
+}
+
+/**
+ * Find first whitespace character in string.
+ *
+ * @param   s           String.
+ * @return  Pointer to first whitespace in s, or to the terminating NUL.
+ **/
+char * scan_whitespace(const char *s) {
+    return ScanWhitespace(s);
+}
+
+/**
+ * Find first non-whitespace character in string.
+ *
+ * @param   s           String.
+ * @return  Pointer to first non-whitespace in s (or to the terminating NUL).
+ *
+ * Runs of whitespace in requests are usually a single space, so the first
+ * character is checked before using the vector scanner.
+ **/
+char * scan_text(const char *s) {
+    if (!is_space(*s))
+        return (char *)s;
+    return ScanText(s + 1);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
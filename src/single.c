@@ -11,24 +11,31 @@
 /**
  * Handle one HTTP request at a time.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * On SIGTERM the current connection is finished and the server returns.
  **/
-int single_server(int sfd) {
+int single_server(const int *sfds, int nsfds) {
+    int sfd;
+
     /* Accept and handle HTTP request */
-    while (true) {
+    while ((sfd = wait_for_connection(sfds, nsfds)) >= 0) {
     	/* Accept request */
         Request *r = accept_request(sfd);
         if (!r)
             continue;
-	/* Handle request */
-        handle_request(r);
+	/* Handle requests on connection */
+        handle_connection(r);
 	/* Free request */
         free_request(r);
     }
 
-    /* Close server socket */
-    close(sfd);
+    /* Close server sockets */
+    log("Server drained");
+    for (int i = 0; i < nsfds; i++)
+        close(sfds[i]);
     return EXIT_SUCCESS;
 }
 
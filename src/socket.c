@@ -1,67 +1,413 @@
 /* socket.c: Simple Socket Functions */
 
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Take over inherited socket bound to the specified address.
+ *
+ * @param   addr        Socket address.
+ * @param   addrlen     Length of socket address.
+ * @param   inherited   Array of inherited socket file descriptors.
+ * @param   ninherited  Number of inherited sockets.
+ * @return  Socket file descriptor (removed from inherited), or -1 if no
+ *          inherited socket is bound to the address.
+ **/
+static int socket_inherit(const struct sockaddr *addr, socklen_t addrlen, int *inherited, int ninherited) {
+    for (int i = 0; i < ninherited; i++) {
+        struct sockaddr_storage bound;
+        socklen_t boundlen = sizeof(bound);
+
+        if (inherited[i] < 0 || getsockname(inherited[i], (struct sockaddr *)&bound, &boundlen) < 0)
+            continue;
+        if (boundlen == addrlen && memcmp(&bound, addr, addrlen) == 0) {
+            int fd = inherited[i];
+            inherited[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Set integer socket option, reporting failure.
+ *
+ * @param   fd          Socket file descriptor.
+ * @param   level       Protocol level (ie. SOL_SOCKET, IPPROTO_TCP).
+ * @param   name        Option name.
+ * @param   label       Option name for error messages.
+ * @param   value       Option value.
+ * @return  -1 on error and 0 on success.
+ **/
+static int set_option(int fd, int level, int name, const char *label, int value) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "Error with %s: %s\n", label, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+#define socket_option(fd, level, name, value)   set_option((fd), (level), (name), #name, (value))
+
+/**
+ * Apply configured options to listening socket.
+ *
+ * @param   fd          Server socket file descriptor.
+ * @param   family      Address family.
+ *
+ * Options that are zero are left at the kernel default.  Accepted sockets
+ * inherit buffer sizes and busy polling from the listening socket, so these
+ * cost nothing per connection.  This is also applied to inherited sockets so
+ * that option changes take effect on upgrade.
+ **/
+static void socket_tune(int fd, int family) {
+    if (Settings->send_buffer > 0)
+        socket_option(fd, SOL_SOCKET, SO_SNDBUF, Settings->send_buffer);
+    if (Settings->receive_buffer > 0)
+        socket_option(fd, SOL_SOCKET, SO_RCVBUF, Settings->receive_buffer);
+    if (Settings->busy_poll > 0)
+        socket_option(fd, SOL_SOCKET, SO_BUSY_POLL, Settings->busy_poll);
+
+    if (family == AF_UNIX)
+        return;
+
+    /* Wake up accept only once request data has arrived */
+    if (Settings->tcp_defer_accept > 0)
+        socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, Settings->tcp_defer_accept);
+
+    /* Accept data in the SYN of repeat clients */
+    if (Settings->tcp_fastopen > 0)
+        socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, Settings->tcp_fastopen);
+}
+
+/**
+ * Bind socket to address and listen with the configured options.
+ *
+ * @param   family      Address family.
+ * @param   addr        Socket address.
+ * @param   addrlen     Length of socket address.
+ * @return  Server socket file descriptor (or -1 on error).
+ **/
+static int socket_bind(int family, const struct sockaddr *addr, socklen_t addrlen) {
+    /* Allocate socket */
+    int socket_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Error with socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Keep IPv6 listeners separate from IPv4 listeners on the same port */
+    if (family == AF_INET6)
+        socket_option(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, 1);
+
+    /* Allow rebinding while old connections are in TIME_WAIT, and binding
+     * alongside other sockets on the same port (such as those of other nodes) */
+    if (family != AF_UNIX && Settings->reuse_address)
+        socket_option(socket_fd, SOL_SOCKET, SO_REUSEADDR, 1);
+    if (family != AF_UNIX && (Settings->reuse_port || Settings->node_listeners))
+        socket_option(socket_fd, SOL_SOCKET, SO_REUSEPORT, 1);
+
+    /* Bind socket */
+    if (bind(socket_fd, addr, addrlen) < 0) {
+        fprintf(stderr, "Error with binding: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* Buffer sizes must be set before listen to affect window scaling */
+    socket_tune(socket_fd, family);
+
+    /* Listen to socket */
+    if (listen(socket_fd, Settings->backlog) < 0) {
+        fprintf(stderr, "Error with listening: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    return socket_fd;
+
+fail:
+    close(socket_fd);
+    return -1;
+}
+
+/**
+ * Split address into host and port.
  *
- * @param   port        Port number to bind to and listen on.
+ * @param   address     Address of the form <PORT>, <HOST>:<PORT>, or
+ *                      [<ADDRESS>]:<PORT>.
+ * @param   buffer      Buffer to copy address into.
+ * @param   size        Size of buffer.
+ * @param   host        Pointer to store host (NULL for all interfaces).
+ * @param   port        Pointer to store port.
+ **/
+static void socket_split(const char *address, char *buffer, size_t size, char **host, char **port) {
+    snprintf(buffer, size, "%s", address);
+    *host = NULL;
+    *port = buffer;
+
+    char *colon = strrchr(buffer, ':');
+    if (colon) {
+        *colon = '\0';
+        *host  = buffer;
+        *port  = colon + 1;
+        if (**host == '[' && (*host)[strlen(*host) - 1] == ']') {
+            (*host)[strlen(*host) - 1] = '\0';
+            (*host)++;
+        }
+        if (!**host || streq(*host, "*"))
+            *host = NULL;
+    }
+}
+
+/**
+ * Allocate socket, bind it, and listen to specified address.
+ *
+ * @param   address     Address to bind to and listen on.
+ * @param   inherited   Array of sockets inherited from a previous server.
+ * @param   ninherited  Number of inherited sockets.
  * @return  Allocated server socket file descriptor.
+ *
+ * Addresses have one of the following forms:
+ *
+ *  <PORT>              All interfaces (ie. 9898)
+ *  <HOST>:<PORT>       IPv4 address or host name (ie. 127.0.0.1:9898)
+ *  [<ADDRESS>]:<PORT>  IPv6 address (ie. [::1]:9898)
+ *  unix:<PATH>         Unix domain socket (ie. unix:/run/spidey.sock)
+ *
+ * An inherited socket already bound to the address is used instead of
+ * binding a new one.  Server sockets are non-blocking so that several
+ * processes can wait on them and only one of them accepts a connection.
+ **/
+int socket_listen(const char *address, int *inherited, int ninherited) {
+    int socket_fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        /* Unix domain socket */
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        struct stat s;
+
+        if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Unix socket path too long: %s\n", address + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, address + 5);
+
+        socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path) + 1;
+        socket_fd = socket_inherit((struct sockaddr *)&addr, addrlen, inherited, ninherited);
+        if (socket_fd >= 0)
+            socket_tune(socket_fd, AF_UNIX);
+        else {
+            /* Remove stale socket left behind by a previous server */
+            if (lstat(addr.sun_path, &s) == 0 && S_ISSOCK(s.st_mode))
+                unlink(addr.sun_path);
+            socket_fd = socket_bind(AF_UNIX, (struct sockaddr *)&addr, sizeof(addr));
+        }
+    } else {
+        /* Split host and port */
+        char  buffer[NI_MAXHOST + NI_MAXSERV];
+        char *host;
+        char *port;
+
+        socket_split(address, buffer, sizeof(buffer), &host, &port);
+
+        /* Lookup server address information */
+        struct addrinfo *results;
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+            .ai_flags = AI_PASSIVE
+        };
+
+        int status = getaddrinfo(host, port, &hints, &results);
+        if (status != 0) {
+            fprintf(stderr, "Error with getaddrinfo %s: %s\n", address, gai_strerror(status));
+            return -1;
+        }
+
+        /* For each server entry, take over or bind a socket */
+        for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
+            socket_fd = socket_inherit(p->ai_addr, p->ai_addrlen, inherited, ninherited);
+            if (socket_fd >= 0)
+                socket_tune(socket_fd, p->ai_family);
+            else
+                socket_fd = socket_bind(p->ai_family, p->ai_addr, p->ai_addrlen);
+        }
+
+        freeaddrinfo(results);
+    }
+
+    if (socket_fd >= 0)
+        fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+    return socket_fd;
+}
+
+/**
+ * Connect socket to address within timeout.
+ *
+ * @param   fd          Socket file descriptor.
+ * @param   addr        Socket address.
+ * @param   addrlen     Length of socket address.
+ * @param   timeout     Milliseconds to wait for the connection.
+ * @return  -1 on error and 0 on success.
  **/
-int socket_listen(const char *port) {
-    /* Lookup server address information */
-    struct addrinfo *results;
-    struct addrinfo hints = {
-        .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
-        .ai_flags = AI_PASSIVE
-    };
-
-    int status = getaddrinfo(NULL, port, &hints, &results);
-    if (status != 0) {
-        fprintf(stderr, "Error with getaddrinfo: %s\n", strerror(errno));
+static int socket_connect_within(int fd, const struct sockaddr *addr, socklen_t addrlen, int timeout) {
+    if (connect(fd, addr, addrlen) == 0)
+        return 0;
+    if (errno != EINPROGRESS)
+        return -1;
+
+    struct pollfd pollfd = {fd, POLLOUT, 0};
+    int ready;
+    while ((ready = poll(&pollfd, 1, timeout)) < 0 && errno == EINTR);
+    if (ready == 0)
+        errno = ETIMEDOUT;
+    if (ready <= 0)
+        return -1;
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0)
+        return -1;
+    if (error) {
+        errno = error;
         return -1;
     }
+    return 0;
+}
 
-    /* For each server entry, allocate socket and try to connect */
+/**
+ * Allocate socket and connect it to specified address.
+ *
+ * @param   address     Address to connect to (as for socket_listen, but
+ *                      with a host).
+ * @param   timeout     Milliseconds to wait for each address of the host.
+ * @return  Connected socket file descriptor (or -1 on error).
+ *
+ * The socket is close-on-exec and blocking once connected.  Each address the
+ * host resolves to is tried in turn.
+ **/
+int socket_connect(const char *address, int timeout) {
     int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
-	/* Allocate socket */
-        socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (socket_fd < 0) {
-            fprintf(stderr, "Error with socket: %s\n", strerror(errno));
-            continue;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        /* Unix domain socket */
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+        if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Unix socket path too long: %s\n", address + 5);
+            return -1;
         }
-	/* Bind socket */
-        if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
-            fprintf(stderr, "Error with binding: %s\n", strerror(errno));
+        strcpy(addr.sun_path, address + 5);
+
+        socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (socket_fd >= 0 && socket_connect_within(socket_fd, (struct sockaddr *)&addr, sizeof(addr), timeout) < 0) {
             close(socket_fd);
             socket_fd = -1;
-            continue;
         }
+    } else {
+        /* Split host and port */
+        char  buffer[NI_MAXHOST + NI_MAXSERV];
+        char *host;
+        char *port;
 
-    	/* Listen to socket */
-        if (listen(socket_fd, SOMAXCONN) < 0) {
-            fprintf(stderr, "Error with listening: %s\n", strerror(errno));
-            close(socket_fd);
-            socket_fd = -1;
-            continue;
+        socket_split(address, buffer, sizeof(buffer), &host, &port);
+
+        /* Lookup server address information */
+        struct addrinfo *results;
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+        };
+
+        int status = getaddrinfo(host, port, &hints, &results);
+        if (status != 0) {
+            fprintf(stderr, "Error with getaddrinfo %s: %s\n", address, gai_strerror(status));
+            return -1;
+        }
+
+        /* Connect to the first address that accepts */
+        for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
+            socket_fd = socket(p->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+            if (socket_fd < 0)
+                continue;
+            if (socket_connect_within(socket_fd, p->ai_addr, p->ai_addrlen, timeout) < 0) {
+                close(socket_fd);
+                socket_fd = -1;
+                continue;
+            }
+            if (Settings->tcp_nodelay)
+                socket_option(socket_fd, IPPROTO_TCP, TCP_NODELAY, 1);
         }
+
+        freeaddrinfo(results);
+    }
+
+    if (socket_fd < 0) {
+        fprintf(stderr, "Error connecting to %s: %s\n", address, strerror(errno));
+        return -1;
     }
 
-    freeaddrinfo(results);
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
     return socket_fd;
 }
 
+/**
+ * Accept client connection and apply per-connection options.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @param   addr        Pointer to store client address.
+ * @param   addrlen     Pointer to size of client address (updated).
+ * @return  Client socket file descriptor (or -1 on error).
+ *
+ * accept4(2) marks the client socket close-on-exec without an extra fcntl(2),
+ * so CGI scripts do not inherit the connection.  The client socket is left
+ * blocking: requests are read into a pooled buffer by request_fill, which
+ * tries a non-blocking recv(2) first and otherwise waits in poll(2) without
+ * holding a buffer, while reads of the rest of a request are bounded by a
+ * receive timeout.
+ **/
+int socket_accept(int sfd, struct sockaddr *addr, socklen_t *addrlen) {
+    int fd = accept4(sfd, addr, addrlen, SOCK_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    /* Send small responses without waiting for acknowledgements */
+    if (addr->sa_family != AF_UNIX && Settings->tcp_nodelay)
+        socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    return fd;
+}
+
+/**
+ * Cork or uncork client socket while a response is being sent.
+ *
+ * @param   r           Request structure.
+ * @param   cork        Whether to hold back partial packets.
+ *
+ * While corked, the kernel only sends full packets, so response headers and
+ * the start of the body share packets even when written separately.
+ * Uncorking sends whatever is pending.  This does nothing unless tcp_cork is
+ * enabled.
+ **/
+void socket_cork(Request *r, bool cork) {
+    if (Settings->tcp_cork && r->tcp)
+        socket_option(r->fd, IPPROTO_TCP, TCP_CORK, cork);
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
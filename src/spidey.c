@@ -9,129 +9,120 @@
 
 #include <unistd.h>
 
-/* Global Variables */
-char *Port	      = "9898";
-char *MimeTypesPath   = "/etc/mime.types";
-char *DefaultMimeType = "text/plain";
-char *RootPath	      = "www";
-
 /**
- * Display usage message and exit with specified status code.
- *
- * @param   progname    Program Name
- * @param   status      Exit status.
- */
-void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
-    fprintf(stderr, "Options:\n");
-    fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
-    fprintf(stderr, "    -m path       Path to mimetypes file\n");
-    fprintf(stderr, "    -M mimetype   Default mimetype\n");
-    fprintf(stderr, "    -p port       Port to listen on\n");
-    fprintf(stderr, "    -r path       Root directory\n");
-    exit(status);
-}
+ * Parses configuration and command line options and starts appropriate server
+ **/
+int main(int argc, char *argv[]) {
+    int sfds[CONFIG_MAX_SOCKETS];
+    int nodes[CONFIG_MAX_SOCKETS];
+    int nsfds = 0;
+    int inherited[CONFIG_MAX_SOCKETS];
+    int ninherited;
 
-/**
- * Parse command-line options.
- *
- * @param   argc        Number of arguments.
- * @param   argv        Array of argument strings.
- * @param   mode        Pointer to ServerMode variable.
- * @return  true if parsing was successful, false if there was an error.
- *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
- */
-bool parse_options(int argc, char *argv[], ServerMode *mode) {
-    int argind = 1;
-    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
-        char *arg = argv[argind++];
-    	switch (arg[1]) {
-	    case 'c':
-	    	if (streq(argv[argind], "single")) {
-	    	    *mode = SINGLE;
-                }
-                else if (streq(argv[argind], "forking")) {
-	    	    *mode = FORKING;
-	    	}
-                else {
-	    	    usage(argv[0], EXIT_FAILURE);
-	    	}
-	    	argind++;
-	    	break;
-	    case 'h':
-	    	usage(argv[0], EXIT_SUCCESS);
-	    	break;
-	    case 'm':
-	    	MimeTypesPath = argv[argind++];
-	    	break;
-	    case 'M':
-	    	DefaultMimeType = argv[argind++];
-	    	break;
-	    case 'p':
-	    	Port = argv[argind++];
-	    	break;
-	    case 'r':
-	    	RootPath = argv[argind++];
-	    	break;
-	    default:
-	        usage(argv[0], EXIT_FAILURE);
-	    	break;
-	}
+    /* Select vectorized scanners supported by the CPU */
+    log("Scanning with %s", scan_init());
+
+    /* Handle control signals (SIGTERM, SIGHUP, SIGUSR2) */
+    control_init(argc, argv);
+
+    /* Load configuration file and command line options */
+    Config *config = config_load(argc, argv);
+    if (!config) {
+        return EXIT_FAILURE;
     }
+    Settings = config;
 
-    return true;
-}
+    /* Find CPUs and NUMA nodes that workers are placed on */
+    if (topology_load(&Machine, Settings->cpu_topology) < 0) {
+        goto fail;
+    }
 
-/**
- * Parses command line options and starts appropriate server
- **/
-int main(int argc, char *argv[]) {
-    ServerMode mode;
-    mode = SINGLE;
+    /* Listen to server sockets (taking over any from a previous binary), with
+     * one socket per node for each TCP address when node_listeners is on */
+    ninherited = inherit_sockets(inherited, CONFIG_MAX_SOCKETS);
+    for (int i = 0; i < Settings->nlisteners; i++) {
+        bool tcp    = strncmp(Settings->listeners[i], "unix:", 5) != 0;
+        int  copies = Settings->node_listeners && tcp ? Machine.nnodes : 1;
+
+        for (int n = 0; n < copies; n++) {
+            int sock = nsfds < CONFIG_MAX_SOCKETS ? socket_listen(Settings->listeners[i], inherited, ninherited) : -1;
+            if (sock < 0) {
+                fprintf(stderr, "Error socket_listen %s: %s\n", Settings->listeners[i], strerror(errno));
+                goto fail;
+            }
+            nodes[nsfds]  = copies > 1 ? n : -1;
+            sfds[nsfds++] = sock;
+        }
+        if (copies > 1)
+            topology_steer(&Machine, sfds[nsfds - copies]);
+        debug("Listening on %s", Settings->listeners[i]);
+    }
 
-    /* Parse command line options */
-    if (!parse_options(argc, argv, &mode)) {
-        usage(argv[0], EXIT_FAILURE);
+    /* Close inherited sockets that are no longer configured */
+    for (int i = 0; i < ninherited; i++) {
+        if (inherited[i] >= 0)
+            close(inherited[i]);
     }
 
-    /* Listen to server socket */
-    int sock = socket_listen(Port);
-    if (sock < 0) {
-        fprintf(stderr, "Error socket_listen: %s\n", strerror(errno));
-        close(sock);
-        return EXIT_FAILURE;
+    /* Open root directories that request paths are resolved beneath */
+    if (open_roots(Settings) < 0) {
+        fprintf(stderr, "Error with root directory\n");
+        goto fail;
     }
 
-    /* Determine real RootPath */
-    RootPath = realpath(RootPath, NULL);
+    /* Precompute error pages (shared by all request handlers) */
+    load_error_pages(Settings->hosts[0].root_path);
 
-    debug("Listening on port %s", Port);
-    debug("RootPath        = %s", RootPath);
-    debug("MimeTypesPath   = %s", MimeTypesPath);
-    debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    /* Allocate admission counters shared with workers */
+    if (admission_init() < 0) {
+        goto fail;
+    }
 
-    /* Start either forking or single HTTP server */
-    switch (mode) {
-        case SINGLE:
-            single_server(sock);
-            break;
+    /* Allocate rate limiting buckets shared with workers */
+    if (rate_limit_init() < 0) {
+        goto fail;
+    }
+
+    /* Allocate upstream health and load shared with workers */
+    if (proxy_init() < 0) {
+        goto fail;
+    }
+
+    /* Allocate file and metadata cache shared with workers */
+    if (cache_init() < 0) {
+        goto fail;
+    }
+
+    debug("RootPath        = %s", Settings->hosts[0].root_path);
+    debug("VirtualHosts    = %d", Settings->nhosts - 1);
+    debug("MimeTypesPath   = %s", Settings->mime_types);
+    debug("DefaultMimeType = %s", Settings->hosts[0].default_mime_type);
+    debug("ConcurrencyMode = %s", Settings->mode == SINGLE ? "Single" : Settings->mode == FORKING ? "Forking" : "Prefork");
+
+    /* Let the previous binary (if upgrading) drain now that we are ready */
+    announce_ready();
+
+    /* Start forking, prefork, or single HTTP server */
+    switch (Settings->mode) {
         case FORKING:
-            forking_server(sock);
+            forking_server(sfds, nsfds);
             break;
-        case UNKNOWN:
-            usage(argv[0], EXIT_FAILURE);
+        case PREFORK:
+            prefork_server(sfds, nodes, nsfds);
             break;
         default:
-            single_server(sock);
+            single_server(sfds, nsfds);
             break;
     }
 
-    free(RootPath);
+    config_free(Settings);
     return EXIT_SUCCESS;
+
+fail:
+    for (int i = 0; i < nsfds; i++)
+        close(sfds[i]);
+    config_free(Settings);
+    return EXIT_FAILURE;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
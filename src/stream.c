@@ -0,0 +1,295 @@
+/* stream.c: HTTP Response Body Stream */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Add body data to io vectors, framing it as a chunk if necessary.
+ *
+ * @param   s           Stream structure.
+ * @param   iov         Array of io vectors.
+ * @param   iovcnt      Number of io vectors used so far.
+ * @param   size        Buffer for chunk size line.
+ * @param   data        Body data.
+ * @param   n           Number of bytes of body data.
+ * @return  New number of io vectors used.
+ **/
+static int stream_frame(Stream *s, struct iovec *iov, int iovcnt, char size[32], const char *data, size_t n) {
+    if (n == 0)
+        return iovcnt;
+
+    if (s->chunked) {
+        size_t length = format_unsigned(size, n, 16);
+        size[length++] = '\r';
+        size[length++] = '\n';
+        iov[iovcnt].iov_base = size;
+        iov[iovcnt].iov_len  = length;
+        iovcnt++;
+    }
+
+    iov[iovcnt].iov_base = (char *)data;
+    iov[iovcnt].iov_len  = n;
+    iovcnt++;
+
+    if (s->chunked) {
+        iov[iovcnt].iov_base = "\r\n";
+        iov[iovcnt].iov_len  = 2;
+        iovcnt++;
+    }
+    return iovcnt;
+}
+
+/**
+ * Send pending response head and body data followed by any additional data.
+ *
+ * @param   s           Stream structure.
+ * @param   data        Additional body data to send (or NULL).
+ * @param   n           Number of bytes of additional body data.
+ * @param   tail        Raw data to send after the body (or NULL).
+ * @param   tail_len    Number of bytes of raw data.
+ * @param   more        Whether more body data is expected soon.
+ * @return  -1 on error and 0 on success.
+ *
+ * Everything is sent in a single sendmsg(2) call.
+ **/
+static int stream_emit(Stream *s, const char *data, size_t n, const char *tail, size_t tail_len, bool more) {
+    char sizes[2][32];
+    struct iovec iov[RESPONSE_MAX_IOV + 8];
+    int iovcnt = 0;
+
+    if (s->response) {
+        if (s->response->error)
+            goto fail;
+        memcpy(iov, s->response->iov, s->response->iovcnt * sizeof(struct iovec));
+        iovcnt = s->response->iovcnt;
+        s->response = NULL;
+    }
+
+    iovcnt = stream_frame(s, iov, iovcnt, sizes[0], s->buffer, s->length);
+    iovcnt = stream_frame(s, iov, iovcnt, sizes[1], data, n);
+
+    if (tail_len) {
+        iov[iovcnt].iov_base = (char *)tail;
+        iov[iovcnt].iov_len  = tail_len;
+        iovcnt++;
+    }
+
+    /* Bodies of known length are complete once the last byte is sent */
+    if (s->remaining >= 0) {
+        s->remaining -= s->length + n;
+        more = more && s->remaining > 0;
+    }
+    s->length = 0;
+
+    if (iovcnt && send_iovec(s->request->fd, iov, iovcnt, more) < 0)
+        goto fail;
+    trace(s->request, RESPONSE);
+    return 0;
+
+fail:
+    s->error = true;
+    s->request->keep_alive = false;
+    return -1;
+}
+
+/**
+ * Open response body stream.
+ *
+ * @param   s           Stream structure.
+ * @param   res         Response with status line and headers (sent with the
+ *                      first body data).
+ * @param   length      Length of body in bytes (or -1 if unknown).
+ *
+ * Bodies of known length are sent with a Content-Length header.  Bodies of
+ * unknown length are framed with chunked transfer encoding for HTTP/1.1
+ * clients so that the connection can be reused; HTTP/1.0 clients get the raw
+ * body and the connection is closed afterwards to delimit it.
+ *
+ * The response is written directly to the client socket rather than through
+ * the request socket stream so that pipelined input buffered there is kept.
+ * The socket stays corked (see socket_cork) until the stream is closed.
+ **/
+void stream_open(Stream *s, Response *res, ssize_t length) {
+    Request *r = res->request;
+
+    s->request   = r;
+    s->response  = res;
+    s->chunked   = length < 0 && r->http_minor >= 1;
+    s->error     = false;
+    s->length    = 0;
+    s->deadline  = 0;
+    s->remaining = length;
+    s->ntrailers = 0;
+
+    if (length >= 0)
+        response_content_length(res, length);
+    else if (s->chunked)
+        response_static(res, "Transfer-Encoding: chunked\r\n");
+    else
+        r->keep_alive = false;
+    response_end_headers(res);
+    socket_cork(r, true);
+}
+
+/**
+ * Buffer data in response body.
+ *
+ * @param   s           Stream structure.
+ * @param   data        Data to write.
+ * @param   n           Number of bytes to write.
+ * @return  -1 on error and 0 on success.
+ *
+ * Small writes are coalesced into chunks of up to stream_chunk_size bytes.
+ * The buffer is flushed when it fills or when data has been waiting longer
+ * than stream_flush_ms.  Writes larger than the buffer are sent as their own
+ * chunk without copying.
+ *
+ * Bodies of known length never get more than their Content-Length, which
+ * would corrupt the next response on the connection: bytes beyond it are
+ * dropped and -1 is returned.
+ **/
+int stream_write(Stream *s, const void *data, size_t n) {
+    size_t capacity = Settings->stream_chunk_size;
+
+    if (s->error)
+        return -1;
+
+    if (s->remaining >= 0 && n > (size_t)s->remaining - s->length) {
+        size_t allowed = s->remaining - s->length;
+        if (allowed)
+            stream_write(s, data, allowed);
+        return -1;
+    }
+
+    if (s->length + n > capacity) {
+        if (n >= capacity)
+            return stream_emit(s, data, n, NULL, 0, true);
+        if (stream_emit(s, NULL, 0, NULL, 0, true) < 0)
+            return -1;
+    }
+
+    if (s->length == 0)
+        s->deadline = monotonic_ms() + Settings->stream_flush_ms;
+
+    memcpy(s->buffer + s->length, data, n);
+    s->length += n;
+
+    if (s->length == capacity)
+        return stream_emit(s, NULL, 0, NULL, 0, true);
+    if (monotonic_ms() >= s->deadline)
+        return stream_flush(s);
+    return 0;
+}
+
+/**
+ * Buffer string in response body.
+ *
+ * @param   s           Stream structure.
+ * @param   str         String to write.
+ * @return  -1 on error and 0 on success.
+ **/
+int stream_puts(Stream *s, const char *str) {
+    return stream_write(s, str, strlen(str));
+}
+
+/**
+ * Send response head and any buffered body data immediately.
+ *
+ * @param   s           Stream structure.
+ * @return  -1 on error and 0 on success.
+ **/
+int stream_flush(Stream *s) {
+    if (s->error || stream_emit(s, NULL, 0, NULL, 0, false) < 0)
+        return -1;
+
+    /* Push out partial packets held back by the cork */
+    socket_cork(s->request, false);
+    socket_cork(s->request, true);
+    return 0;
+}
+
+/**
+ * Return number of milliseconds until buffered body data must be flushed.
+ *
+ * @param   s           Stream structure.
+ * @return  Milliseconds until flush deadline, or -1 if nothing is buffered.
+ *
+ * This is suitable as a poll(2) timeout while waiting for more output.
+ **/
+int stream_timeout(Stream *s) {
+    if (s->length == 0)
+        return -1;
+
+    long remaining = s->deadline - monotonic_ms();
+    return remaining > 0 ? (int)remaining : 0;
+}
+
+/**
+ * Record a trailer to send when response stream is closed.
+ *
+ * @param   s           Stream structure.
+ * @param   name        Trailer name (must remain valid until stream_close).
+ * @param   value       Trailer value.
+ *
+ * Trailers are only sent on chunked streams and are silently dropped
+ * otherwise.
+ **/
+void stream_trailer(Stream *s, const char *name, const char *value) {
+    if (s->ntrailers >= STREAM_MAX_TRAILERS)
+        return;
+
+    s->trailers[s->ntrailers].name = name;
+    snprintf(s->trailers[s->ntrailers].value, sizeof(s->trailers[0].value), "%s", value);
+    s->ntrailers++;
+}
+
+/**
+ * Flush and terminate response stream.
+ *
+ * @param   s           Stream structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * On chunked streams this sends the last chunk followed by any trailers in
+ * the same write as the remaining body data.  If any write failed, the
+ * connection is marked as not reusable.
+ **/
+int stream_close(Stream *s) {
+    char tail[BUFSIZ];
+    size_t length = 0;
+
+    if (s->error)
+        goto fail;
+
+    if (s->chunked) {
+        length = snprintf(tail, sizeof(tail), "0\r\n");
+        for (size_t i = 0; i < s->ntrailers && length < sizeof(tail); i++) {
+            length += snprintf(tail + length, sizeof(tail) - length, "%s: %s\r\n",
+                               s->trailers[i].name, s->trailers[i].value);
+        }
+        if (length < sizeof(tail))
+            length += snprintf(tail + length, sizeof(tail) - length, "\r\n");
+        if (length >= sizeof(tail))
+            goto fail;
+    }
+
+    int status = stream_emit(s, NULL, 0, tail, length, false);
+    socket_cork(s->request, false);
+
+    /* A short body cannot be delimited, so the connection must close */
+    if (status < 0 || s->remaining > 0)
+        goto fail;
+    return 0;
+
+fail:
+    s->request->keep_alive = false;
+    return -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,248 @@
+/* topology.c: CPU and NUMA Topology */
+
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define TOPOLOGY_WORDS      (TOPOLOGY_MAX_CPUS / 64)
+
+/* CPUs and nodes of this machine (loaded once at startup) */
+Topology Machine;
+
+/**
+ * Parse CPUs of each node.
+ *
+ * @param   t           Topology to fill in.
+ * @param   nodes       CPU lists of nodes separated by whitespace, each in the
+ *                      format of sysfs cpulist files (ie. "0-3,8-11 4-7,12-15").
+ * @param   allowed     Bitmap of CPUs workers may run on (NULL = all).
+ * @return  -1 on error (including when no CPU is allowed) and 0 on success.
+ *
+ * CPUs that are not allowed are left out, as are nodes with no allowed CPUs.
+ * Each remaining node records its position in the list in numa.
+ **/
+int topology_parse(Topology *t, const char *nodes, const uint64_t *allowed) {
+    uint64_t seen[TOPOLOGY_WORDS] = {0};
+    const char *s = nodes;
+
+    t->ncpus  = 0;
+    t->nnodes = 0;
+    for (int position = 0; *s; position++) {
+        int first = t->ncpus;
+
+        while (isspace((unsigned char)*s))
+            s++;
+        if (!*s)
+            break;
+        if (position >= TOPOLOGY_MAX_NODES)
+            return -1;
+
+        /* CPUs and ranges of CPUs separated by commas */
+        while (*s && !isspace((unsigned char)*s)) {
+            char *end;
+            long low  = strtol(s, &end, 10);
+            long high = low;
+
+            if (end == s || !isdigit((unsigned char)*s))
+                return -1;
+            if (*end == '-') {
+                s    = end + 1;
+                high = strtol(s, &end, 10);
+                if (end == s || !isdigit((unsigned char)*s))
+                    return -1;
+            }
+            if (high < low || high >= TOPOLOGY_MAX_CPUS)
+                return -1;
+            if (*end == ',')
+                end++;
+            else if (*end && !isspace((unsigned char)*end))
+                return -1;
+            s = end;
+
+            for (long cpu = low; cpu <= high; cpu++) {
+                if (seen[cpu / 64] >> (cpu % 64) & 1)
+                    return -1;
+                seen[cpu / 64] |= 1ULL << (cpu % 64);
+                if (allowed && !(allowed[cpu / 64] >> (cpu % 64) & 1))
+                    continue;
+                t->cpus[t->ncpus]   = cpu;
+                t->node[t->ncpus++] = t->nnodes;
+            }
+        }
+
+        if (t->ncpus > first)
+            t->numa[t->nnodes++] = position;
+    }
+
+    return t->ncpus > 0 ? 0 : -1;
+}
+
+/**
+ * Load CPUs and NUMA nodes the server may use.
+ *
+ * @param   t           Topology to fill in.
+ * @param   nodes       CPU lists of nodes (as for topology_parse), or NULL to
+ *                      read the NUMA nodes from sysfs.
+ * @return  -1 on error and 0 on success.
+ *
+ * Only CPUs in the affinity mask the server was started with are used.  A
+ * machine without NUMA information in sysfs is a single node, and nodes given
+ * explicitly (to try node_listeners on a machine with a single node) have no
+ * NUMA node id, so their memory is not bound.
+ **/
+int topology_load(Topology *t, const char *nodes) {
+    uint64_t  allowed[TOPOLOGY_WORDS] = {0};
+    char      description[BUFSIZ] = "";
+    int       ids[TOPOLOGY_MAX_NODES];
+    int       count = 0;
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < TOPOLOGY_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                allowed[cpu / 64] |= 1ULL << (cpu % 64);
+        }
+    }
+    else {
+        memset(allowed, 0xff, sizeof(allowed));
+    }
+
+    /* Read CPU list of each node with CPUs */
+    if (!nodes || !*nodes) {
+        size_t length = 0;
+        for (int id = 0; id < TOPOLOGY_MAX_NODES; id++) {
+            char  path[64];
+            char  buffer[BUFSIZ];
+            FILE *fs;
+
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            if (!(fs = fopen(path, "r")))
+                continue;
+            if (fgets(buffer, sizeof(buffer), fs) && *skip_whitespace(buffer)) {
+                buffer[strcspn(buffer, WHITESPACE)] = '\0';
+                length += snprintf(description + length, sizeof(description) - length, "%s ", buffer);
+                ids[count++] = id;
+            }
+            fclose(fs);
+        }
+        if (count == 0 || length >= sizeof(description))
+            snprintf(description, sizeof(description), "0-%d", TOPOLOGY_MAX_CPUS - 1);
+        nodes = description;
+    }
+
+    if (topology_parse(t, nodes, allowed) < 0) {
+        fprintf(stderr, "Invalid CPU topology: %s\n", nodes);
+        return -1;
+    }
+
+    for (int n = 0; n < t->nnodes; n++)
+        t->numa[n] = nodes == description && count > 0 ? ids[t->numa[n]] : -1;
+
+    debug("Topology: %d CPUs in %d nodes", t->ncpus, t->nnodes);
+    return 0;
+}
+
+/**
+ * Choose CPU for a new worker.
+ *
+ * @param   t           Topology.
+ * @param   load        Number of workers on each CPU (by index in cpus).
+ * @return  Index of CPU in cpus.
+ *
+ * The CPU with the fewest workers is chosen, and among those one on the node
+ * with the fewest workers per CPU, so that workers are spread over all nodes
+ * before any CPU has a second worker.
+ **/
+int topology_place(const Topology *t, const int *load) {
+    int workers[TOPOLOGY_MAX_NODES] = {0};
+    int size[TOPOLOGY_MAX_NODES]    = {0};
+    int best = 0;
+
+    for (int i = 0; i < t->ncpus; i++) {
+        workers[t->node[i]] += load[i];
+        size[t->node[i]]++;
+    }
+
+    for (int i = 1; i < t->ncpus; i++) {
+        int a = t->node[i];
+        int b = t->node[best];
+
+        if (load[i] < load[best] ||
+            (load[i] == load[best] && workers[a] * size[b] < workers[b] * size[a]))
+            best = i;
+    }
+    return best;
+}
+
+/**
+ * Pin calling process to CPU and prefer memory of its NUMA node.
+ *
+ * @param   t           Topology.
+ * @param   cpu         Index of CPU in cpus.
+ *
+ * Buffers and caches that the worker allocates from then on come from its
+ * own node (falling back to other nodes when it is full).
+ **/
+void topology_bind(const Topology *t, int cpu) {
+    int numa = t->numa[t->node[cpu]];
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(t->cpus[cpu], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        fprintf(stderr, "Error with sched_setaffinity: %s\n", strerror(errno));
+
+    if (numa >= 0) {
+        unsigned long mask[TOPOLOGY_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+        mask[numa / (8 * sizeof(unsigned long))] |= 1UL << (numa % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, TOPOLOGY_MAX_NODES + 1) < 0)
+            fprintf(stderr, "Error with set_mempolicy: %s\n", strerror(errno));
+    }
+    log("Worker on CPU %d (node %d)", t->cpus[cpu], t->node[cpu]);
+}
+
+/**
+ * Steer connections to the listening socket of the node that received them.
+ *
+ * @param   t           Topology.
+ * @param   fd          First socket of a SO_REUSEPORT group with one socket
+ *                      per node, in node order.
+ * @return  -1 on error and 0 on success.
+ *
+ * The group selects sockets with a classic BPF program that maps the CPU
+ * handling the incoming SYN to its node.  CPUs the server does not use map
+ * out of range, for which the kernel falls back to hashing.
+ **/
+int topology_steer(const Topology *t, int fd) {
+    struct sock_filter code[2 * TOPOLOGY_MAX_CPUS + 2];
+    struct sock_fprog  program = {.filter = code};
+    int n = 0;
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    for (int i = 0; i < t->ncpus; i++) {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, t->cpus[i], 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, t->node[i]);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+    program.len = n;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+        fprintf(stderr, "Error with SO_ATTACH_REUSEPORT_CBPF: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,71 @@
+/* trace.c: Request Phase Tracing */
+
+
+#include "spidey.h"
+
+#include <string.h>
+#include <time.h>
+
+#ifdef SPIDEY_TRACE
+
+/* Names of phases in slow request log (and USDT probes) */
+static const char *TracePhaseNames[TRACE_COUNT] = {
+    [TRACE_ACCEPT]   = "accept",
+    [TRACE_LOOKUP]   = "lookup",
+    [TRACE_PARSE]    = "parse",
+    [TRACE_ROUTE]    = "route",
+    [TRACE_RESOLVE]  = "resolve",
+    [TRACE_MIMETYPE] = "mimetype",
+    [TRACE_UPSTREAM] = "upstream",
+    [TRACE_RESPONSE] = "response",
+    [TRACE_DONE]     = "done",
+};
+
+/**
+ * Read monotonic clock for phase timestamps.
+ *
+ * @return  Nanoseconds since an arbitrary point (never 0).
+ **/
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+/**
+ * Log phase breakdown of request if it took longer than slow_request_ms.
+ *
+ * @param   r           HTTP Request structure (handled).
+ *
+ * Each phase the request reached is logged with the microseconds since the
+ * previous one, so the slow step stands out.  Phases a request skips (such
+ * as mimetype for proxied requests) are left out.
+ **/
+void trace_slow_request(const Request *r) {
+    uint64_t start = r->trace[TRACE_ACCEPT];
+    uint64_t end   = r->trace[TRACE_DONE];
+
+    if (Settings->slow_request_ms <= 0 || !start || !end ||
+        end - start < (uint64_t)Settings->slow_request_ms * 1000000ULL)
+        return;
+
+    char   phases[256] = "";
+    size_t length = 0;
+    uint64_t previous = start;
+
+    for (int phase = TRACE_ACCEPT + 1; phase < TRACE_COUNT && length < sizeof(phases); phase++) {
+        if (!r->trace[phase])
+            continue;
+        length += snprintf(phases + length, sizeof(phases) - length, " %s=%lu",
+                           TracePhaseNames[phase], (unsigned long)((r->trace[phase] - previous) / 1000));
+        previous = r->trace[phase];
+    }
+
+    log("Slow request from %s:%s %s %s: %lu us (%s)", r->host, r->port,
+        r->method ? r->method : "-", r->uri ? r->uri : "-",
+        (unsigned long)((end - start) / 1000), phases + (length > 0));
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
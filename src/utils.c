@@ -3,23 +3,29 @@
 
 #include "spidey.h"
 
-#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 /**
  * Determine mime-type from file extension.
  *
+ * @param   host        Virtual host serving the file.
  * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
+ * @param   buffer      Buffer for a mimetype found in the mime_types file.
+ * @param   size        Size of buffer.
+ * @return  The mime-type of the specified file.
  *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * This function first finds the file's extension and then checks the
+ * mimetype overrides of the virtual host and of the default host.  Otherwise
+ * it scans the contents of the mime_types file to determine which mimetype
+ * the file has.
  *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
+ * The mime_types file (typically /etc/mime.types) consists of rules in the
  * following format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
@@ -28,15 +34,23 @@
  * each mimetype and returns the mimetype on the first match.
  *
  * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
+ * default_mime_type of the virtual host.
  *
- * This function returns an allocated string that must be free'd.
+ * Results of scanning the file (including misses) are kept in the shared
+ * cache, so each extension is only looked up once per configuration.
+ *
+ * The returned string is either buffer or one from the configuration, so
+ * nothing is allocated.
  **/
-char * determine_mimetype(const char *path) {
+const char * determine_mimetype(const VirtualHost *host, const char *path, char *buffer, size_t size) {
     char *ext;
     char *mimetype;
     char *token;
-    char buffer[BUFSIZ];
+    char line[BUFSIZ];
+    char key[CACHE_MAX_KEY];
+    int key_length;
+    CacheStamp stamp;
+    ssize_t length;
     FILE *fs = NULL;
 
     /* Find file extension */
@@ -47,16 +61,34 @@ char * determine_mimetype(const char *path) {
     ext++;
 
     log("Extension: %s", ext);
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");
+    /* Check overrides of virtual host, then of default host */
+    for (const VirtualHost *h = host; h; h = h->index ? &Settings->hosts[0] : NULL) {
+        for (int i = 0; i < h->nmime_types; i++) {
+            if (streq(h->mime_types[i].extension, ext))
+                return h->mime_types[i].type;
+        }
+    }
+
+    /* Check lookups made by any worker ("" when there was no match) */
+    key_length = snprintf(key, sizeof(key), "M:%s", ext);
+    if (key_length >= (int)sizeof(key))
+        key_length = -1;
+    cache_stamp(&stamp, NULL);
+    if (key_length > 0 && (length = cache_get(key, key_length, &stamp, buffer, size - 1)) >= 0) {
+        buffer[length] = 0;
+        return length ? buffer : host->default_mime_type;
+    }
+
+    /* Open mime_types file */
+    fs = fopen(Settings->mime_types, "r");
     if (fs == NULL) {
         fprintf(stderr, "Error with fopen: %s\n", strerror(errno));
         goto error;
     }
 
     /* Scan file for matching file extensions */
-    while (fgets(buffer, BUFSIZ, fs) != NULL) {
-        mimetype = strtok(skip_whitespace(buffer), WHITESPACE);
+    while (fgets(line, BUFSIZ, fs) != NULL) {
+        mimetype = strtok(skip_whitespace(line), WHITESPACE);
         if (mimetype == NULL)
             continue;
 
@@ -69,42 +101,54 @@ char * determine_mimetype(const char *path) {
             token = strtok(NULL, WHITESPACE);
         }
     }
+    if (key_length > 0)
+        cache_put(key, key_length, &stamp, "", 0);
+
     error:
-        mimetype = DefaultMimeType;
-        return strdup(mimetype);
+        if (fs)
+            fclose(fs);
+        return host->default_mime_type;
 
     end:
+        if (key_length > 0)
+            cache_put(key, key_length, &stamp, mimetype, strlen(mimetype));
         if (fs)
             fclose(fs);
-        return strdup(mimetype);
+        snprintf(buffer, size, "%s", mimetype);
+        return buffer;
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
+ * Determine actual filesystem path based on root and URI.
  *
+ * @param   root        Real path of root directory.
  * @param   uri         Resource path of URI.
  * @return  An allocated string containing the full path of the resource on the
  * local filesystem.
  *
  * This function uses realpath(3) to generate the realpath of the
- * file requested in the URI.
+ * file requested in the URI.  It is the slow path used by
+ * resolve_request_path when openat2(2) is unavailable.
  *
- * As a security check, if the real path does not begin with the RootPath, then
+ * As a security check, if the real path does not begin with the root, then
  * return NULL.
  *
  * Otherwise, return a newly allocated string containing the real path.  This
  * string must later be free'd.
  **/
-char * determine_request_path(const char *uri) {
+char * determine_request_path(const char *root, const char *uri) {
     char path[BUFSIZ];
-    char real[BUFSIZ];
+    char real[PATH_MAX];
+    size_t root_length = strlen(root);
 
-    if ((snprintf(path, BUFSIZ, "%s/%s/", RootPath, uri)) < 0)
+    if ((snprintf(path, BUFSIZ, "%s/%s", root, uri)) >= BUFSIZ)
         return NULL;
 
-    realpath(path, real);
+    if (!realpath(path, real))
+        return NULL;
 
-    if (strncmp(real, RootPath, strlen(RootPath)))
+    if (strncmp(real, root, root_length) ||
+        (real[root_length] != '/' && real[root_length] != '\0'))
         return NULL;
 
     return strdup(real);
@@ -121,24 +165,27 @@ char * determine_request_path(const char *uri) {
 const char * http_status_string(Status status) {
     static char *StatusStrings[] = {
         "200 OK",
+        "301 Moved Permanently",
+        "304 Not Modified",
         "400 Bad Request",
+        "403 Forbidden",
         "404 Not Found",
+        "405 Method Not Allowed",
+        "408 Request Timeout",
+        "413 Payload Too Large",
+        "414 URI Too Long",
+        "416 Range Not Satisfiable",
+        "429 Too Many Requests",
         "500 Internal Server Error",
+        "502 Bad Gateway",
+        "503 Service Unavailable",
+        "504 Gateway Timeout",
         "418 I'm A Teapot",
     };
 
-    switch (status) {
-        case HTTP_STATUS_OK:
-            return StatusStrings[0];
-        case HTTP_STATUS_BAD_REQUEST:
-            return StatusStrings[1];
-        case HTTP_STATUS_NOT_FOUND:
-            return StatusStrings[2];
-        case HTTP_STATUS_INTERNAL_SERVER_ERROR:
-            return StatusStrings[3];
-        default:
-            return StatusStrings[4];
-    }
+    if ((unsigned)status >= HTTP_STATUS_COUNT)
+        return StatusStrings[HTTP_STATUS_COUNT];
+    return StatusStrings[status];
 }
 
 /**
@@ -146,12 +193,11 @@ const char * http_status_string(Status status) {
  *
  * @param   s           String.
  * @return  Point to first whitespace character in s.
+ *
+ * This uses the vectorized scanner (see scan_whitespace).
  **/
 char * skip_nonwhitespace(char *s) {
-    while (*s && !isspace(*s)) {
-        s++;
-    }
-    return s;
+    return scan_whitespace(s);
 }
 
 /**
@@ -159,12 +205,20 @@ char * skip_nonwhitespace(char *s) {
  *
  * @param   s           String.
  * @return  Point to first non-whitespace character in s.
+ *
+ * This uses the vectorized scanner (see scan_text).
  **/
 char * skip_whitespace(char *s) {
-    while (*s && isspace(*s)) {
-        s++;
-    }
-    return s;
+    return scan_text(s);
+}
+
+/**
+ * Return current monotonic time in milliseconds.
+ **/
+long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
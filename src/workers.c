@@ -0,0 +1,142 @@
+/* workers.c: Worker Process Table */
+
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Child process handling connections */
+typedef struct {
+    pid_t   pid;                        /*< Process id of worker */
+    int     generation;                 /*< Configuration generation of worker */
+    int     cpu;                        /*< Index of CPU worker is pinned to (-1 = none) */
+} Worker;
+
+static Worker *Workers         = NULL;
+static size_t  WorkersCount    = 0;
+static size_t  WorkersCapacity = 0;
+static int     Generation      = 0;
+
+/**
+ * Record newly forked worker.
+ *
+ * @param   pid         Process id of worker.
+ * @param   cpu         Index in Machine of CPU the worker is pinned to (or -1).
+ * @return  -1 on error and 0 on success.
+ **/
+int add_worker(pid_t pid, int cpu) {
+    if (WorkersCount == WorkersCapacity) {
+        size_t capacity = WorkersCapacity ? WorkersCapacity * 2 : 64;
+        Worker *workers = realloc(Workers, capacity * sizeof(Worker));
+        if (!workers) {
+            fprintf(stderr, "Error with allocation (Workers): %s\n", strerror(errno));
+            return -1;
+        }
+        Workers         = workers;
+        WorkersCapacity = capacity;
+    }
+
+    Workers[WorkersCount].pid        = pid;
+    Workers[WorkersCount].generation = Generation;
+    Workers[WorkersCount].cpu        = cpu;
+    WorkersCount++;
+    return 0;
+}
+
+/**
+ * Reap terminated workers without blocking.
+ *
+ * Only children recorded with add_worker are counted, so an upgraded server
+ * started by upgrade_server does not affect the worker count.
+ **/
+void reap_workers(void) {
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (size_t i = 0; i < WorkersCount; i++) {
+            if (Workers[i].pid == pid) {
+                Workers[i] = Workers[--WorkersCount];
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Return number of running workers.
+ *
+ * @param   current     Whether to count only workers started since the last
+ *                      call to retire_workers.
+ * @return  Number of workers.
+ **/
+size_t worker_count(bool current) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < WorkersCount; i++) {
+        if (!current || Workers[i].generation == Generation)
+            count++;
+    }
+    return count;
+}
+
+/**
+ * Count current workers pinned to each CPU.
+ *
+ * @param   load        Array to store number of workers on each CPU.
+ * @param   ncpus       Number of CPUs (in Machine).
+ **/
+void worker_load(int *load, int ncpus) {
+    memset(load, 0, ncpus * sizeof(int));
+    for (size_t i = 0; i < WorkersCount; i++) {
+        if (Workers[i].generation == Generation && Workers[i].cpu >= 0 && Workers[i].cpu < ncpus)
+            load[Workers[i].cpu]++;
+    }
+}
+
+/**
+ * Ask current workers to drain so they can be replaced.
+ *
+ * Retired workers finish their connections in the background and are no
+ * longer counted as current.
+ **/
+void retire_workers(void) {
+    for (size_t i = 0; i < WorkersCount; i++) {
+        if (Workers[i].generation == Generation)
+            kill(Workers[i].pid, SIGTERM);
+    }
+    Generation++;
+}
+
+/**
+ * Ask workers to finish their connections and wait for them to exit.
+ *
+ * Workers finish the request in progress and then close their connection
+ * (see handle_connection).  Any that are still running after drain_timeout
+ * seconds are killed.
+ **/
+void drain_workers(void) {
+    struct timespec interval = {0, 50 * 1000 * 1000};
+    long deadline = monotonic_ms() + Settings->drain_timeout * 1000L;
+
+    log("Draining %zu workers", WorkersCount);
+    for (size_t i = 0; i < WorkersCount; i++)
+        kill(Workers[i].pid, SIGTERM);
+
+    for (reap_workers(); WorkersCount > 0 && monotonic_ms() < deadline; reap_workers())
+        nanosleep(&interval, NULL);
+
+    for (size_t i = 0; i < WorkersCount; i++) {
+        log("Killing worker %d after drain timeout", Workers[i].pid);
+        kill(Workers[i].pid, SIGKILL);
+        waitpid(Workers[i].pid, NULL, 0);
+    }
+    WorkersCount = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,110 @@
+/* path.c: Request Path Unit Tests
+ *
+ * Checks normalization of request URIs, including the longest segment a
+ * file name may have, and that encoded and plain spellings of a URI resolve
+ * to the same file (run from the top directory, since it serves www):
+ *
+ *  make test-unit
+ */
+
+#include "spidey.h"
+
+#include <limits.h>
+#include <string.h>
+
+static int Failures = 0;
+
+#define check(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: FAILURE: %s\n", __FILE__, __LINE__, #condition); \
+            Failures++; \
+        } \
+    } while (0)
+
+/**
+ * Normalize URI and compare with the expected path (NULL = rejected).
+ **/
+static void check_normalize(const char *uri, const char *expected) {
+    char path[PATH_MAX];
+    int  status = normalize_uri(uri, path, sizeof(path));
+
+    if (expected ? status != 0 || !streq(path, expected) : status == 0) {
+        fprintf(stderr, "%.40s: normalized to %s (expected %s)\n", uri, status ? "error" : path, expected ? expected : "error");
+        Failures++;
+    }
+}
+
+static void test_normalize(void) {
+    char name[NAME_MAX + 2];
+    char uri[NAME_MAX + 8];
+
+    check_normalize("/", "");
+    check_normalize("//song.txt", "song.txt");
+    check_normalize("/./text/../song.txt", "song.txt");
+    check_normalize("/%73ong.txt", "song.txt");
+    check_normalize("/text%2flyrics.txt", "text/lyrics.txt");
+    check_normalize("/..", NULL);
+    check_normalize("/%00", NULL);
+    check_normalize("/%7", NULL);
+    check_normalize("song.txt", NULL);
+
+    /* Segments may be as long as NAME_MAX, but no longer */
+    memset(name, 'a', NAME_MAX);
+    name[NAME_MAX] = '\0';
+    snprintf(uri, sizeof(uri), "/%s", name);
+    check_normalize(uri, name);
+    snprintf(uri, sizeof(uri), "/%sa", name);
+    check_normalize(uri, NULL);
+}
+
+static void test_prefix(void) {
+    check(match_uri_prefix("song.txt", "/song.txt") == 8);
+    check(match_uri_prefix("api/hello", "/api") == 3);
+    check(match_uri_prefix("api", "/api/") == 3);
+    check(match_uri_prefix("apiary", "/api") < 0);
+    check(match_uri_prefix("text/lyrics.txt", "/") == 0);
+    check(match_uri_prefix("", "/api") < 0);
+}
+
+/**
+ * Resolve URI and compare with the expected path relative to the root.
+ **/
+static void check_resolve(const char *uri, const char *expected) {
+    Request r = {.fd = -1, .path_fd = -1, .uri = (char *)uri};
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", Settings->hosts[0].root_path, expected);
+    if (resolve_request_path(&r) != HTTP_STATUS_OK || !streq(r.path, path)) {
+        fprintf(stderr, "%s: resolved to %s (expected %s)\n", uri, r.path ? r.path : "error", path);
+        Failures++;
+    }
+    r.uri = NULL;
+    clear_request(&r);
+}
+
+static void test_resolve(void) {
+    check_resolve("/song.txt", "song.txt");
+    check_resolve("//text/./lyrics.txt", "text/lyrics.txt");
+    check_resolve("/%74ext/lyrics.txt", "text/lyrics.txt");
+}
+
+int main(int argc, char *argv[]) {
+    char *options[] = {argv[0], "-r", "www", NULL};
+
+    (void)argc;
+    if (!(Settings = config_load(3, options)) || open_roots(Settings) < 0)
+        return EXIT_FAILURE;
+
+    test_normalize();
+    test_prefix();
+    test_resolve();
+
+    if (Failures)
+        fprintf(stderr, "%d failures\n", Failures);
+    else
+        printf("path: all tests passed\n");
+    return Failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
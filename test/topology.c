@@ -0,0 +1,163 @@
+/* topology.c: CPU Topology Unit Tests
+ *
+ * Checks parsing of CPU lists, placement of workers on CPUs and nodes, and
+ * that the reuseport program steers connections to the socket of the node of
+ * the CPU that received them (with a made-up topology, so that this also runs
+ * on a machine with a single node):
+ *
+ *  make test-unit
+ */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+static int Failures = 0;
+
+#define check(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: FAILURE: %s\n", __FILE__, __LINE__, #condition); \
+            Failures++; \
+        } \
+    } while (0)
+
+static void test_parse(void) {
+    Topology t;
+    uint64_t allowed[TOPOLOGY_MAX_CPUS / 64] = {0};
+
+    check(topology_parse(&t, "0-3,8-11 4-7,12-15", NULL) == 0);
+    check(t.ncpus == 16 && t.nnodes == 2);
+    check(t.cpus[0] == 0 && t.cpus[3] == 3 && t.cpus[4] == 8 && t.cpus[8] == 4 && t.cpus[15] == 15);
+    check(t.node[7] == 0 && t.node[8] == 1);
+    check(t.numa[0] == 0 && t.numa[1] == 1);
+
+    /* Nodes without allowed CPUs are left out */
+    allowed[0] = 0xf0;
+    check(topology_parse(&t, " 0-3\n4-7 ", allowed) == 0);
+    check(t.ncpus == 4 && t.nnodes == 1 && t.cpus[0] == 4 && t.numa[0] == 1);
+    check(topology_parse(&t, "0-3", allowed) < 0);
+
+    check(topology_parse(&t, "", NULL) < 0);
+    check(topology_parse(&t, "a", NULL) < 0);
+    check(topology_parse(&t, "3-1", NULL) < 0);
+    check(topology_parse(&t, "1-", NULL) < 0);
+    check(topology_parse(&t, "-1", NULL) < 0);
+    check(topology_parse(&t, "0,0", NULL) < 0);
+    check(topology_parse(&t, "0 0-1", NULL) < 0);
+    check(topology_parse(&t, "0;1", NULL) < 0);
+    check(topology_parse(&t, "1024", NULL) < 0);
+    check(topology_parse(&t, "0,1, 2", NULL) == 0 && t.nnodes == 2);
+}
+
+/**
+ * Place workers one after another and compare the chosen CPUs.
+ **/
+static void check_placement(const char *nodes, const int *expected, int n) {
+    Topology t;
+    int load[TOPOLOGY_MAX_CPUS] = {0};
+
+    check(topology_parse(&t, nodes, NULL) == 0);
+    for (int i = 0; i < n; i++) {
+        int cpu = topology_place(&t, load);
+        if (t.cpus[cpu] != expected[i]) {
+            fprintf(stderr, "%s: worker %d placed on CPU %d (expected %d)\n", nodes, i, t.cpus[cpu], expected[i]);
+            Failures++;
+        }
+        load[cpu]++;
+    }
+}
+
+static void test_place(void) {
+    /* Alternate between nodes before any CPU has a second worker */
+    check_placement("0-1 2-3", (int[]){0, 2, 1, 3, 0, 2, 1, 3}, 8);
+    check_placement("0,2 1,3", (int[]){0, 1, 2, 3, 0}, 5);
+
+    /* Nodes of different sizes are filled in proportion */
+    check_placement("0-2 3", (int[]){0, 3, 1, 2, 0, 3}, 6);
+    check_placement("0", (int[]){0, 0, 0}, 3);
+}
+
+/**
+ * Open listening socket on loopback in a SO_REUSEPORT group.
+ **/
+static int listen_loopback(struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1;
+
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "Error listening on loopback: %s\n", strerror(errno));
+        return -1;
+    }
+    return fd;
+}
+
+static void test_steer(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addrlen = sizeof(addr);
+    cpu_set_t set;
+    Topology  t;
+    int cpu = 0;
+    int fds[2];
+
+    /* Run on one CPU, which the topology puts on the second node */
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        while (cpu < CPU_SETSIZE && !CPU_ISSET(cpu, &set))
+            cpu++;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    t.ncpus  = 2;
+    t.nnodes = 2;
+    t.cpus[0] = cpu + 1; t.node[0] = 0;
+    t.cpus[1] = cpu;     t.node[1] = 1;
+
+    if ((fds[0] = listen_loopback(&addr)) < 0)
+        return;
+    getsockname(fds[0], (struct sockaddr *)&addr, &addrlen);
+    if ((fds[1] = listen_loopback(&addr)) < 0)
+        return;
+    check(topology_steer(&t, fds[0]) == 0);
+
+    for (int i = 0; i < 4; i++) {
+        int client = socket(AF_INET, SOCK_STREAM, 0);
+        check(connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+        int other    = accept(fds[0], NULL, NULL);
+        int accepted = accept(fds[1], NULL, NULL);
+        check(other < 0 && accepted >= 0);
+        if (other >= 0)
+            close(other);
+        if (accepted >= 0)
+            close(accepted);
+        close(client);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void) {
+    test_parse();
+    test_place();
+    test_steer();
+
+    if (Failures)
+        fprintf(stderr, "%d failures\n", Failures);
+    else
+        printf("topology: all tests passed\n");
+    return Failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */